@@ -0,0 +1,181 @@
+#include "batch.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "kernels.h"
+#include "pool.h"
+
+struct BatchJob {
+    char input[4096];
+    char output[4096];
+    int n;
+    int nsteps;
+    double delta_time;
+    // Line of the manifest
+    int line;
+    // Why the job failed, empty if it did not
+    char error[8192];
+};
+
+struct Batch {
+    struct BatchJob *jobs;
+    int count;
+    // Job run by each tile of the pool
+    int *order;
+    enum GalFormat format;
+    int tile;
+    double epsilon;
+};
+
+static int read_manifest(const char *manifest, struct BatchJob **jobs) {
+    FILE *file = fopen(manifest, "r");
+    if (!file) {
+        fprintf(stderr, "Error opening %s\n", manifest);
+        exit(1);
+    }
+    int count = 0;
+    int capacity = 16;
+    *jobs = malloc(sizeof(struct BatchJob) * capacity);
+    char line[8192];
+    for (int number = 1; fgets(line, sizeof(line), file); number++) {
+        char *start = line + strspn(line, " \t");
+        if (*start == '#' || *start == '\n' || *start == '\0') {
+            continue;
+        }
+        if (count == capacity) {
+            capacity *= 2;
+            *jobs = realloc(*jobs, sizeof(struct BatchJob) * capacity);
+        }
+        struct BatchJob *job = &(*jobs)[count];
+        int fields = sscanf(start, "%4095s %d %d %lf %4095s", job->input,
+                            &job->n, &job->nsteps, &job->delta_time,
+                            job->output);
+        if (fields < 4 || job->n < 1 || job->nsteps < 0) {
+            fprintf(stderr, "%s:%d: expected file N nsteps delta_time "
+                            "[output]\n",
+                    manifest, number);
+            exit(1);
+        }
+        job->line = number;
+        job->error[0] = '\0';
+        if (fields == 4) {
+            snprintf(job->output, sizeof(job->output), "batch_%04d.gal",
+                     count);
+        }
+        count++;
+    }
+    fclose(file);
+    return count;
+}
+
+static double job_cost(const struct BatchJob *job) {
+    return (double)job->n * job->n * job->nsteps;
+}
+
+// Lays the jobs out so that every worker's contiguous block of tiles, as
+// pool_run hands them out, gets a similar share of the work: the most
+// expensive job goes to the block that has the least so far
+static void balance(struct Batch *batch) {
+    int workers = pool_threads();
+    int *sorted = malloc(sizeof(int) * batch->count);
+    for (int j = 0; j < batch->count; j++) {
+        sorted[j] = j;
+    }
+    for (int j = 1; j < batch->count; j++) {
+        int job = sorted[j];
+        int k = j;
+        for (; k > 0 && job_cost(&batch->jobs[sorted[k - 1]]) <
+                            job_cost(&batch->jobs[job]);
+             k--) {
+            sorted[k] = sorted[k - 1];
+        }
+        sorted[k] = job;
+    }
+
+    int *filled = calloc(workers, sizeof(int));
+    double *load = calloc(workers, sizeof(double));
+    for (int j = 0; j < batch->count; j++) {
+        int best = -1;
+        for (int w = 0; w < workers; w++) {
+            int size = (long)batch->count * (w + 1) / workers -
+                       (long)batch->count * w / workers;
+            if (filled[w] < size && (best < 0 || load[w] < load[best])) {
+                best = w;
+            }
+        }
+        int first = (long)batch->count * best / workers;
+        batch->order[first + filled[best]++] = sorted[j];
+        load[best] += job_cost(&batch->jobs[sorted[j]]);
+    }
+    free(load);
+    free(filled);
+    free(sorted);
+}
+
+static void run_job(void *arg, int worker, int tile) {
+    (void)worker;
+    struct Batch *batch = arg;
+    struct BatchJob *job = &batch->jobs[batch->order[tile]];
+    struct ParticleStore particles;
+    struct ParticleChange changes;
+    if (!gal_load(job->input, job->n, &particles, job->error,
+                  sizeof(job->error))) {
+        return;
+    }
+    changes_alloc(&changes, job->n);
+
+    const double G = 100.0 / job->n;
+    for (int s = 0; s < job->nsteps; s++) {
+        memset(changes.x_velocity, 0, sizeof(double) * job->n);
+        memset(changes.y_velocity, 0, sizeof(double) * job->n);
+        direct_rows(&particles, 0, job->n, batch->tile, G, batch->epsilon,
+                    job->delta_time, &changes);
+        integrate(&particles, &changes, job->delta_time);
+    }
+
+    // gal_write() would exit on errors, which one job must not do to the
+    // others
+    gal_save(job->output, batch->format, &particles, job->nsteps,
+             job->delta_time, job->error, sizeof(job->error));
+    changes_free(&changes);
+    store_free(&particles);
+}
+
+int run_batch(const char *manifest, enum GalFormat format, int tile,
+              double epsilon) {
+    struct Batch batch;
+    batch.count = read_manifest(manifest, &batch.jobs);
+    batch.order = malloc(sizeof(int) * (batch.count ? batch.count : 1));
+    batch.format = format;
+    batch.tile = tile;
+    batch.epsilon = epsilon;
+    balance(&batch);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pool_run(batch.count, run_job, &batch);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double pairs = 0;
+    int failed = 0;
+    for (int j = 0; j < batch.count; j++) {
+        const struct BatchJob *job = &batch.jobs[j];
+        if (job->error[0]) {
+            fprintf(stderr, "%s:%d: %s\n", manifest, job->line, job->error);
+            failed++;
+            continue;
+        }
+        pairs += 0.5 * job->n * (job->n - 1.0) * job->nsteps;
+    }
+    double seconds =
+        (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+    printf("batch: %d jobs, %d failed, %.3e pair interactions/s\n",
+           batch.count, failed, seconds > 0 ? pairs / seconds : 0);
+    printf("wall seconds: %.15lf \n", seconds);
+    free(batch.order);
+    free(batch.jobs);
+    return failed;
+}
@@ -0,0 +1,19 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "galfile.h"
+
+// Runs every job of a manifest with the direct solver. Each line of the
+// manifest is
+//
+//     file N nsteps delta_time [output]
+//
+// and lines starting with # are skipped. Jobs without an output are written
+// to batch_NNNN.gal, numbered by line order. The jobs are independent, so
+// each runs on one worker of the thread pool and the pool balances them.
+// A job whose input cannot be loaded or whose output cannot be written is
+// reported and skipped. Returns the number of such jobs.
+int run_batch(const char *manifest, enum GalFormat format, int tile,
+              double epsilon);
+
+#endif
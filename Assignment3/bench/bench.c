@@ -0,0 +1,350 @@
+// Benchmark driver for galsim. Runs the simulator over the ellipse inputs
+// and a list of thread counts, and reports the per-step time distribution,
+// pair interactions per second and GFLOP/s as JSON or CSV.
+//
+// Interactions are the N (N - 1) / 2 particle pairs of one step. With the
+// approximate solvers this is the equivalent direct work, so the figures
+// compare directly against the direct solver.
+
+#include <glob.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+// Floating point operations of one symmetric pair update in the direct
+// kernel: separation 2, squared distance 3, sqrt 1, softening 1, cube 2,
+// reciprocal 1, and a scale and two multiply-adds for each particle 10
+#define FLOPS_PER_PAIR 20
+#define MAX_THREAD_COUNTS 16
+
+struct Options {
+    const char *galsim;
+    const char *input_dir;
+    int steps;
+    int warmup_steps;
+    int warmup_runs;
+    int repeats;
+    int min_n;
+    int max_n;
+    int threads[MAX_THREAD_COUNTS];
+    int thread_counts;
+    const char *format;
+    const char *output;
+    // Extra galsim options, passed through unchanged
+    char **extra;
+    int extra_count;
+};
+
+struct Result {
+    int n;
+    int threads;
+    int samples;
+    double median;
+    double p95;
+    double mean;
+    double interactions_per_second;
+    double gflops;
+};
+
+static void usage() {
+    printf("Usage: bench [options] [-- galsim options]\n"
+           "  -g PATH      galsim executable (default ./galsim)\n"
+           "  -i DIR       directory of ellipse_N_*.gal inputs "
+           "(default input_data)\n"
+           "  -n MIN,MAX   range of N to run (default all)\n"
+           "  -t T1,T2,... thread counts (default 1)\n"
+           "  -s STEPS     steps per run (default 20)\n"
+           "  -w STEPS     leading steps of each run left out (default 2)\n"
+           "  -W RUNS      untimed warm-up runs per case (default 1)\n"
+           "  -r RUNS      timed runs per case (default 3)\n"
+           "  -f json|csv  output format (default json)\n"
+           "  -o FILE      output file (default stdout)\n");
+}
+
+static void read_options(struct Options *options, int argc, char **argv) {
+    *options = (struct Options){.galsim = "./galsim",
+                                .input_dir = "input_data",
+                                .steps = 20,
+                                .warmup_steps = 2,
+                                .warmup_runs = 1,
+                                .repeats = 3,
+                                .min_n = 0,
+                                .max_n = 1 << 30,
+                                .threads = {1},
+                                .thread_counts = 1,
+                                .format = "json",
+                                .output = NULL};
+    int option;
+    while ((option = getopt(argc, argv, "g:i:n:t:s:w:W:r:f:o:h")) != -1) {
+        switch (option) {
+        case 'g':
+            options->galsim = optarg;
+            break;
+        case 'i':
+            options->input_dir = optarg;
+            break;
+        case 'n':
+            if (sscanf(optarg, "%d,%d", &options->min_n, &options->max_n) !=
+                2) {
+                fprintf(stderr, "-n wants MIN,MAX\n");
+                exit(1);
+            }
+            break;
+        case 't': {
+            options->thread_counts = 0;
+            for (char *item = strtok(optarg, ","); item;
+                 item = strtok(NULL, ",")) {
+                if (options->thread_counts == MAX_THREAD_COUNTS) {
+                    fprintf(stderr, "At most %d thread counts\n",
+                            MAX_THREAD_COUNTS);
+                    exit(1);
+                }
+                options->threads[options->thread_counts++] = atoi(item);
+            }
+            break;
+        }
+        case 's':
+            options->steps = atoi(optarg);
+            break;
+        case 'w':
+            options->warmup_steps = atoi(optarg);
+            break;
+        case 'W':
+            options->warmup_runs = atoi(optarg);
+            break;
+        case 'r':
+            options->repeats = atoi(optarg);
+            break;
+        case 'f':
+            options->format = optarg;
+            break;
+        case 'o':
+            options->output = optarg;
+            break;
+        default:
+            usage();
+            exit(option == 'h' ? 0 : 1);
+        }
+    }
+    if (options->steps <= options->warmup_steps || options->repeats < 1) {
+        fprintf(stderr, "Need more steps than warm-up steps and one run\n");
+        exit(1);
+    }
+    if (strcmp(options->format, "json") != 0 &&
+        strcmp(options->format, "csv") != 0) {
+        fprintf(stderr, "Unknown format '%s'\n", options->format);
+        exit(1);
+    }
+    options->extra = argv + optind;
+    options->extra_count = argc - optind;
+}
+
+// Runs galsim once and appends its per-step times after the warm-up steps
+// to samples. Returns the number of samples added.
+static int run_galsim(const struct Options *options, const char *input, int n,
+                      int threads, const char *scratch, double *samples) {
+    char n_arg[16], steps_arg[16], threads_arg[32];
+    char times_path[4096], times_arg[4200], output_arg[4200];
+    snprintf(n_arg, sizeof(n_arg), "%d", n);
+    snprintf(steps_arg, sizeof(steps_arg), "%d", options->steps);
+    snprintf(threads_arg, sizeof(threads_arg), "--threads=%d", threads);
+    snprintf(times_path, sizeof(times_path), "%s/times.txt", scratch);
+    snprintf(times_arg, sizeof(times_arg), "--step-times=%s", times_path);
+    snprintf(output_arg, sizeof(output_arg), "--output=%s/results.gal",
+             scratch);
+
+    char **args = malloc(sizeof(char *) * (options->extra_count + 10));
+    int count = 0;
+    args[count++] = (char *)options->galsim;
+    args[count++] = n_arg;
+    args[count++] = (char *)input;
+    args[count++] = steps_arg;
+    args[count++] = "0.00001";
+    args[count++] = "0";
+    args[count++] = threads_arg;
+    args[count++] = times_arg;
+    args[count++] = output_arg;
+    for (int e = 0; e < options->extra_count; e++) {
+        args[count++] = options->extra[e];
+    }
+    args[count] = NULL;
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        // galsim prints its wall seconds, which would mix into our output
+        if (!freopen("/dev/null", "w", stdout)) {
+            _exit(127);
+        }
+        execv(options->galsim, args);
+        perror(options->galsim);
+        _exit(127);
+    }
+    free(args);
+    int status;
+    if (pid < 0 || waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+        WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "galsim failed for %s with %d threads\n", input,
+                threads);
+        exit(1);
+    }
+
+    FILE *file = fopen(times_path, "r");
+    if (!file) {
+        fprintf(stderr, "galsim wrote no step times\n");
+        exit(1);
+    }
+    int added = 0;
+    double time;
+    for (int i = 0; fscanf(file, "%lf", &time) == 1; i++) {
+        if (i >= options->warmup_steps) {
+            samples[added++] = time;
+        }
+    }
+    fclose(file);
+    return added;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static struct Result measure(const struct Options *options, const char *input,
+                             int n, int threads, const char *scratch) {
+    for (int r = 0; r < options->warmup_runs; r++) {
+        double *ignored = malloc(sizeof(double) * options->steps);
+        run_galsim(options, input, n, threads, scratch, ignored);
+        free(ignored);
+    }
+    double *samples = malloc(sizeof(double) * options->steps *
+                             options->repeats);
+    int count = 0;
+    for (int r = 0; r < options->repeats; r++) {
+        count += run_galsim(options, input, n, threads, scratch,
+                            samples + count);
+    }
+    qsort(samples, count, sizeof(double), compare_doubles);
+
+    struct Result result = {.n = n, .threads = threads, .samples = count};
+    double sum = 0;
+    for (int i = 0; i < count; i++) {
+        sum += samples[i];
+    }
+    result.mean = sum / count;
+    result.median = count % 2 ? samples[count / 2]
+                              : 0.5 * (samples[count / 2 - 1] +
+                                       samples[count / 2]);
+    int p95_index = (int)(0.95 * count + 0.999999) - 1;
+    result.p95 = samples[p95_index < 0 ? 0 : p95_index];
+    double pairs = 0.5 * (double)n * (n - 1);
+    result.interactions_per_second = pairs / result.median;
+    result.gflops = result.interactions_per_second * FLOPS_PER_PAIR * 1e-9;
+    free(samples);
+    return result;
+}
+
+static void print_results(const struct Options *options, FILE *out,
+                          const struct Result *results, int count) {
+    if (strcmp(options->format, "csv") == 0) {
+        fprintf(out, "n,threads,samples,median_step_s,p95_step_s,"
+                     "mean_step_s,interactions_per_s,gflops\n");
+        for (int r = 0; r < count; r++) {
+            const struct Result *result = &results[r];
+            fprintf(out, "%d,%d,%d,%.9e,%.9e,%.9e,%.6e,%.3f\n", result->n,
+                    result->threads, result->samples, result->median,
+                    result->p95, result->mean,
+                    result->interactions_per_second, result->gflops);
+        }
+        return;
+    }
+
+    char host[256] = "unknown";
+    gethostname(host, sizeof(host) - 1);
+    fprintf(out, "{\n  \"host\": \"%s\",\n  \"timestamp\": %ld,\n", host,
+            (long)time(NULL));
+    fprintf(out, "  \"steps\": %d,\n  \"warmup_steps\": %d,\n"
+                 "  \"repeats\": %d,\n  \"galsim_options\": [",
+            options->steps, options->warmup_steps, options->repeats);
+    for (int e = 0; e < options->extra_count; e++) {
+        fprintf(out, "%s\"%s\"", e ? ", " : "", options->extra[e]);
+    }
+    fprintf(out, "],\n  \"flops_per_pair\": %d,\n  \"results\": [\n",
+            FLOPS_PER_PAIR);
+    for (int r = 0; r < count; r++) {
+        const struct Result *result = &results[r];
+        fprintf(out,
+                "    {\"n\": %d, \"threads\": %d, \"samples\": %d, "
+                "\"median_step_s\": %.9e, \"p95_step_s\": %.9e, "
+                "\"mean_step_s\": %.9e, \"interactions_per_s\": %.6e, "
+                "\"gflops\": %.3f}%s\n",
+                result->n, result->threads, result->samples, result->median,
+                result->p95, result->mean, result->interactions_per_second,
+                result->gflops, r + 1 < count ? "," : "");
+    }
+    fprintf(out, "  ]\n}\n");
+}
+
+int main(int argc, char **argv) {
+    struct Options options;
+    read_options(&options, argc, argv);
+
+    char pattern[4096];
+    snprintf(pattern, sizeof(pattern), "%s/ellipse_N_*.gal",
+             options.input_dir);
+    glob_t inputs;
+    if (glob(pattern, 0, NULL, &inputs) != 0) {
+        fprintf(stderr, "No inputs match %s\n", pattern);
+        exit(1);
+    }
+
+    char scratch[] = "/tmp/galsim_bench_XXXXXX";
+    if (!mkdtemp(scratch)) {
+        fprintf(stderr, "Error creating scratch directory\n");
+        exit(1);
+    }
+
+    // glob sorts the names, and the zero-padded N sorts them by size
+    struct Result *results = malloc(sizeof(struct Result) * inputs.gl_pathc *
+                                    options.thread_counts);
+    int count = 0;
+    for (size_t f = 0; f < inputs.gl_pathc; f++) {
+        const char *input = inputs.gl_pathv[f];
+        const char *name = strrchr(input, '/');
+        int n;
+        if (sscanf(name ? name + 1 : input, "ellipse_N_%d.gal", &n) != 1 ||
+            n < options.min_n || n > options.max_n) {
+            continue;
+        }
+        for (int t = 0; t < options.thread_counts; t++) {
+            results[count] =
+                measure(&options, input, n, options.threads[t], scratch);
+            fprintf(stderr, "N = %6d  threads = %2d  median %.3e s/step\n", n,
+                    options.threads[t], results[count].median);
+            count++;
+        }
+    }
+
+    FILE *out = options.output ? fopen(options.output, "w") : stdout;
+    if (!out) {
+        fprintf(stderr, "Error opening %s\n", options.output);
+        exit(1);
+    }
+    print_results(&options, out, results, count);
+    if (out != stdout) {
+        fclose(out);
+    }
+
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/times.txt", scratch);
+    unlink(path);
+    snprintf(path, sizeof(path), "%s/results.gal", scratch);
+    unlink(path);
+    rmdir(scratch);
+    free(results);
+    globfree(&inputs);
+    return 0;
+}
@@ -0,0 +1,232 @@
+#include "bh.h"
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "kernels.h"
+
+// Cells with at most this many particles are not split any further
+#define BH_LEAF_SIZE 8
+// Bounds the recursion when many particles sit on (almost) the same spot
+#define BH_MAX_DEPTH 48
+
+void bh_init(struct BHTree *tree, int n, double theta) {
+    tree->n = n;
+    tree->theta = theta;
+    tree->node_count = 0;
+    // A tree with leaves of BH_LEAF_SIZE rarely needs more nodes than n
+    tree->node_capacity = n + 4;
+    tree->nodes = malloc(sizeof(struct BHNode) * tree->node_capacity);
+    tree->order = malloc(sizeof(int) * n);
+    if (!tree->nodes || !tree->order) {
+        fprintf(stderr, "Error allocating Barnes-Hut tree\n");
+        exit(1);
+    }
+    for (int i = 0; i < n; i++) {
+        tree->order[i] = i;
+    }
+}
+
+void bh_free(struct BHTree *tree) {
+    free(tree->nodes);
+    free(tree->order);
+    tree->nodes = NULL;
+    tree->order = NULL;
+}
+
+// Takes count consecutive nodes from the pool and returns the first index.
+// The pool only grows, so later steps reuse the memory of earlier ones.
+static int allocate_nodes(struct BHTree *tree, int count) {
+    if (tree->node_count + count > tree->node_capacity) {
+        while (tree->node_count + count > tree->node_capacity) {
+            tree->node_capacity *= 2;
+        }
+        tree->nodes =
+            realloc(tree->nodes, sizeof(struct BHNode) * tree->node_capacity);
+        if (!tree->nodes) {
+            fprintf(stderr, "Error allocating Barnes-Hut tree\n");
+            exit(1);
+        }
+    }
+    int first = tree->node_count;
+    tree->node_count += count;
+    return first;
+}
+
+// Moves the particles whose coordinate is below split to the front of
+// order[begin, end) and returns where the second group starts
+static int partition(int *order, int begin, int end,
+                     const struct ParticleStore *particles, bool by_x,
+                     double split) {
+    const double *coordinates = by_x ? particles->x_pos : particles->y_pos;
+    int i = begin;
+    int j = end - 1;
+    while (i <= j) {
+        double coordinate = coordinates[order[i]];
+        if (coordinate < split) {
+            i++;
+        } else {
+            int tmp = order[i];
+            order[i] = order[j];
+            order[j] = tmp;
+            j--;
+        }
+    }
+    return i;
+}
+
+static void build_node(struct BHTree *tree,
+                       const struct ParticleStore *particles, int index,
+                       int depth) {
+    struct BHNode *node = &tree->nodes[index];
+    int begin = node->begin;
+    int end = node->end;
+    node->first_child = -1;
+
+    if (end - begin <= BH_LEAF_SIZE || depth >= BH_MAX_DEPTH) {
+        double mass = 0, x_com = 0, y_com = 0;
+        for (int k = begin; k < end; k++) {
+            int i = tree->order[k];
+            mass += particles->mass[i];
+            x_com += particles->mass[i] * particles->x_pos[i];
+            y_com += particles->mass[i] * particles->y_pos[i];
+        }
+        node->mass = mass;
+        node->x_com = mass > 0 ? x_com / mass : node->x_center;
+        node->y_com = mass > 0 ? y_com / mass : node->y_center;
+        return;
+    }
+
+    double xc = node->x_center;
+    double yc = node->y_center;
+    double quarter = node->half_size / 2;
+
+    // Split the range into the quadrants (x < xc, y < yc), (x >= xc, y < yc),
+    // (x < xc, y >= yc) and (x >= xc, y >= yc), in that order
+    int mid = partition(tree->order, begin, end, particles, false, yc);
+    int bounds[5] = {
+        begin, partition(tree->order, begin, mid, particles, true, xc), mid,
+        partition(tree->order, mid, end, particles, true, xc), end};
+
+    int first = allocate_nodes(tree, 4);
+    // The pool may have moved, so look the node up again
+    node = &tree->nodes[index];
+    node->first_child = first;
+
+    for (int q = 0; q < 4; q++) {
+        struct BHNode *child = &tree->nodes[first + q];
+        child->x_center = xc + ((q & 1) ? quarter : -quarter);
+        child->y_center = yc + ((q & 2) ? quarter : -quarter);
+        child->half_size = quarter;
+        child->begin = bounds[q];
+        child->end = bounds[q + 1];
+        build_node(tree, particles, first + q, depth + 1);
+    }
+
+    double mass = 0, x_com = 0, y_com = 0;
+    for (int q = 0; q < 4; q++) {
+        const struct BHNode *child = &tree->nodes[first + q];
+        mass += child->mass;
+        x_com += child->mass * child->x_com;
+        y_com += child->mass * child->y_com;
+    }
+    node = &tree->nodes[index];
+    node->mass = mass;
+    node->x_com = mass > 0 ? x_com / mass : xc;
+    node->y_com = mass > 0 ? y_com / mass : yc;
+}
+
+void bh_build(struct BHTree *tree, const struct ParticleStore *particles) {
+    int n = tree->n;
+    const double *x = particles->x_pos;
+    const double *y = particles->y_pos;
+    double x_min = x[0], x_max = x[0];
+    double y_min = y[0], y_max = y[0];
+    for (int i = 1; i < n; i++) {
+        x_min = fmin(x_min, x[i]);
+        x_max = fmax(x_max, x[i]);
+        y_min = fmin(y_min, y[i]);
+        y_max = fmax(y_max, y[i]);
+    }
+
+    tree->node_count = 0;
+    int root = allocate_nodes(tree, 1);
+    struct BHNode *node = &tree->nodes[root];
+    node->x_center = (x_min + x_max) / 2;
+    node->y_center = (y_min + y_max) / 2;
+    // Slightly enlarged so that the particles on the edge are inside
+    node->half_size = fmax(x_max - x_min, y_max - y_min) / 2 * (1 + 1e-9);
+    node->begin = 0;
+    node->end = n;
+    build_node(tree, particles, root, 0);
+}
+
+CPU_CLONES
+void bh_compute_forces(const struct BHTree *tree,
+                       const struct ParticleStore *particles, double G,
+                       double epsilon, double delta_time, int begin, int end,
+                       struct ParticleChange *changes) {
+    const double *x = particles->x_pos;
+    const double *y = particles->y_pos;
+    const double *m = particles->mass;
+    const struct BHNode *nodes = tree->nodes;
+    const int *order = tree->order;
+    const double theta = tree->theta;
+    int stack[4 * BH_MAX_DEPTH + 4];
+
+    for (int k = begin; k < end; k++) {
+        int i = order[k];
+        double x_i = x[i];
+        double y_i = y[i];
+        double accel_x = 0;
+        double accel_y = 0;
+
+        int top = 0;
+        stack[top++] = 0;
+        while (top > 0) {
+            const struct BHNode *node = &nodes[stack[--top]];
+            if (node->begin == node->end) {
+                continue;
+            }
+
+            // A cell far enough away acts as a single body at its centre of
+            // mass. Cells holding particle i itself are always opened.
+            if (k < node->begin || k >= node->end) {
+                double dx = x_i - node->x_com;
+                double dy = y_i - node->y_com;
+                double distance = sqrt(dx * dx + dy * dy);
+                if (2 * node->half_size < theta * distance) {
+                    double d = distance + epsilon;
+                    double force_multiplier = node->mass / (d * d * d);
+                    accel_x -= force_multiplier * dx;
+                    accel_y -= force_multiplier * dy;
+                    continue;
+                }
+            }
+
+            if (node->first_child < 0) {
+                for (int slot = node->begin; slot < node->end; slot++) {
+                    int j = order[slot];
+                    if (j == i) {
+                        continue;
+                    }
+                    double dx = x_i - x[j];
+                    double dy = y_i - y[j];
+                    double d = sqrt(dx * dx + dy * dy) + epsilon;
+                    double force_multiplier = m[j] / (d * d * d);
+                    accel_x -= force_multiplier * dx;
+                    accel_y -= force_multiplier * dy;
+                }
+            } else {
+                for (int q = 0; q < 4; q++) {
+                    stack[top++] = node->first_child + q;
+                }
+            }
+        }
+
+        changes->x_velocity[i] += delta_time * G * accel_x;
+        changes->y_velocity[i] += delta_time * G * accel_y;
+    }
+}
@@ -0,0 +1,43 @@
+#ifndef BH_H
+#define BH_H
+
+#include "galsim.h"
+
+// One cell of the Barnes-Hut quadtree. Children are stored as four
+// consecutive nodes in the pool, and every node owns the range
+// [begin, end) of the tree's particle order.
+struct BHNode {
+    double x_center;
+    double y_center;
+    double half_size;
+    double mass;
+    double x_com;
+    double y_com;
+    int first_child;
+    int begin;
+    int end;
+};
+
+struct BHTree {
+    struct BHNode *nodes;
+    int node_count;
+    int node_capacity;
+    int *order;
+    int n;
+    double theta;
+};
+
+void bh_init(struct BHTree *tree, int n, double theta);
+void bh_free(struct BHTree *tree);
+
+// Rebuilds the tree from the current particle positions, reusing the pool
+void bh_build(struct BHTree *tree, const struct ParticleStore *particles);
+
+// Adds delta_time * acceleration to changes[] for the particles at positions
+// [begin, end) of tree->order, so that callers can split the work in chunks
+void bh_compute_forces(const struct BHTree *tree,
+                       const struct ParticleStore *particles, double G,
+                       double epsilon, double delta_time, int begin, int end,
+                       struct ParticleChange *changes);
+
+#endif
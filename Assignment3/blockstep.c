@@ -0,0 +1,197 @@
+#include "blockstep.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "kernels.h"
+#include "pool.h"
+
+struct ActiveForces {
+    struct BlockStepper *stepper;
+    const struct ParticleStore *particles;
+    double G;
+    double epsilon;
+    int count;
+    int ntiles;
+};
+
+void block_init(struct BlockStepper *stepper, int n, int max_level,
+                double eta) {
+    stepper->n = n;
+    stepper->max_level = max_level;
+    stepper->eta = eta;
+    stepper->started = false;
+    stepper->level = calloc(n, sizeof(int));
+    stepper->next_tick = calloc(n, sizeof(long));
+    stepper->active = malloc(sizeof(int) * n);
+    stepper->x_accel = alloc_doubles(n);
+    stepper->y_accel = alloc_doubles(n);
+    stepper->active_x_accel = alloc_doubles(n);
+    stepper->active_y_accel = alloc_doubles(n);
+    stepper->flyby = alloc_doubles(n);
+    stepper->active_flyby = alloc_doubles(n);
+    stepper->level_count = calloc(max_level + 1, sizeof(int));
+    stepper->pair_evaluations = 0;
+    if (!stepper->level || !stepper->next_tick || !stepper->active ||
+        !stepper->level_count) {
+        fprintf(stderr, "Error allocating block time steps\n");
+        exit(1);
+    }
+}
+
+void block_reset(struct BlockStepper *stepper) {
+    stepper->started = false;
+    memset(stepper->level, 0, sizeof(int) * stepper->n);
+    memset(stepper->next_tick, 0, sizeof(long) * stepper->n);
+}
+
+void block_free(struct BlockStepper *stepper) {
+    free(stepper->level);
+    free(stepper->next_tick);
+    free(stepper->active);
+    free(stepper->x_accel);
+    free(stepper->y_accel);
+    free(stepper->active_x_accel);
+    free(stepper->active_y_accel);
+    free(stepper->flyby);
+    free(stepper->active_flyby);
+    free(stepper->level_count);
+}
+
+static int wanted_level(const struct BlockStepper *stepper, int i,
+                        double epsilon, double delta_time) {
+    double x_accel = stepper->x_accel[i];
+    double y_accel = stepper->y_accel[i];
+    double accel = sqrt(x_accel * x_accel + y_accel * y_accel);
+    double wanted = stepper->flyby[i];
+    if (accel > 0 && sqrt(epsilon / accel) < wanted) {
+        wanted = sqrt(epsilon / accel);
+    }
+    wanted *= stepper->eta;
+
+    int level = 0;
+    for (double step = delta_time; step > wanted && level < stepper->max_level;
+         step *= 0.5) {
+        level++;
+    }
+    return level;
+}
+
+static void active_tile(void *arg, int worker, int tile) {
+    (void)worker;
+    struct ActiveForces *forces = arg;
+    struct BlockStepper *stepper = forces->stepper;
+    int begin = (long)forces->count * tile / forces->ntiles;
+    int end = (long)forces->count * (tile + 1) / forces->ntiles;
+    accel_rows(forces->particles, stepper->active + begin, end - begin,
+               forces->G, forces->epsilon, stepper->active_x_accel + begin,
+               stepper->active_y_accel + begin, stepper->active_flyby + begin);
+}
+
+// Computes the accelerations of the particles whose step ends at tick and
+// returns how many there are
+static int update_active(struct BlockStepper *stepper,
+                         const struct ParticleStore *particles, double G,
+                         double epsilon, long tick) {
+    int count = 0;
+    for (int i = 0; i < stepper->n; i++) {
+        if (stepper->next_tick[i] == tick) {
+            stepper->active[count++] = i;
+        }
+    }
+    struct ActiveForces forces = {stepper, particles, G, epsilon, count,
+                                  16 * pool_threads()};
+    if (forces.ntiles > count) {
+        forces.ntiles = count;
+    }
+    pool_run(forces.ntiles, active_tile, &forces);
+    for (int k = 0; k < count; k++) {
+        stepper->x_accel[stepper->active[k]] = stepper->active_x_accel[k];
+        stepper->y_accel[stepper->active[k]] = stepper->active_y_accel[k];
+        stepper->flyby[stepper->active[k]] = stepper->active_flyby[k];
+    }
+    stepper->pair_evaluations += (long long)count * stepper->n;
+    return count;
+}
+
+static void half_kick(const struct BlockStepper *stepper,
+                      struct ParticleStore *particles, int i,
+                      double delta_time) {
+    double half_step = 0.5 * delta_time / (1L << stepper->level[i]);
+    particles->x_velocity[i] += stepper->x_accel[i] * half_step;
+    particles->y_velocity[i] += stepper->y_accel[i] * half_step;
+}
+
+// Picks the level of the next step of active particle i and opens it
+static void open_step(struct BlockStepper *stepper,
+                      struct ParticleStore *particles, int i, long tick,
+                      double epsilon, double delta_time) {
+    const long ticks = 1L << stepper->max_level;
+    int level = wanted_level(stepper, i, epsilon, delta_time);
+    // A coarser step has to start on one of its own ticks
+    while (level < stepper->level[i] && tick % (ticks >> level) != 0) {
+        level++;
+    }
+    stepper->level[i] = level;
+    stepper->next_tick[i] = tick + (ticks >> level);
+    half_kick(stepper, particles, i, delta_time);
+}
+
+void block_step(struct BlockStepper *stepper,
+                struct ParticleStore *particles, double G, double epsilon,
+                double delta_time) {
+    int n = stepper->n;
+    const long ticks = 1L << stepper->max_level;
+    const double tick_time = delta_time / ticks;
+
+    // All particles start a step here, with the accelerations from the end
+    // of the previous one
+    if (!stepper->started) {
+        update_active(stepper, particles, G, epsilon, 0);
+        stepper->started = true;
+    }
+    for (int i = 0; i < n; i++) {
+        open_step(stepper, particles, i, 0, epsilon, delta_time);
+    }
+
+    long tick = 0;
+    while (tick < ticks) {
+        long next = ticks;
+        for (int i = 0; i < n; i++) {
+            if (stepper->next_tick[i] < next) {
+                next = stepper->next_tick[i];
+            }
+        }
+        double drift = (next - tick) * tick_time;
+        double *restrict x_pos = particles->x_pos;
+        double *restrict y_pos = particles->y_pos;
+        const double *restrict x_velocity = particles->x_velocity;
+        const double *restrict y_velocity = particles->y_velocity;
+        for (int i = 0; i < n; i++) {
+            x_pos[i] += x_velocity[i] * drift;
+            y_pos[i] += y_velocity[i] * drift;
+        }
+        tick = next;
+
+        // Close the steps ending here and, inside the block step, open the
+        // next ones. At the end the velocities are left synchronised.
+        int count = update_active(stepper, particles, G, epsilon, tick);
+        for (int k = 0; k < count; k++) {
+            int i = stepper->active[k];
+            half_kick(stepper, particles, i, delta_time);
+            if (tick < ticks) {
+                open_step(stepper, particles, i, tick, epsilon, delta_time);
+            }
+        }
+    }
+
+    for (int level = 0; level <= stepper->max_level; level++) {
+        stepper->level_count[level] = 0;
+    }
+    for (int i = 0; i < n; i++) {
+        stepper->next_tick[i] = 0;
+        stepper->level_count[stepper->level[i]]++;
+    }
+}
@@ -0,0 +1,58 @@
+#ifndef BLOCKSTEP_H
+#define BLOCKSTEP_H
+
+#include <stdbool.h>
+
+#include "galsim.h"
+
+// Hierarchical block time steps with the leapfrog (kick-drift-kick)
+// scheme. Every particle has a level L and steps with delta_time / 2^L,
+// where delta_time is the largest step. Time inside one step of delta_time
+// is counted in ticks of the finest level, and the steps of level L end at
+// multiples of 2^(max_level - L) ticks. Only the particles whose steps end
+// get their forces computed, from the current positions of all particles;
+// all particles drift between such ticks.
+//
+// A particle's level is chosen when its step opens, from the shortest
+// flyby time over all other particles, (r + epsilon) / |v_i - v_j|, and
+// sqrt(epsilon / |a|), both scaled by eta. It may move to a coarser level
+// only where that level's steps start. At the end of each delta_time all
+// particles are synchronised.
+struct BlockStepper {
+    int n;
+    int max_level;
+    double eta;
+    bool started;
+    int *level;
+    // Tick at which the step of every particle ends
+    long *next_tick;
+    // Acceleration and shortest flyby time of every particle at the start
+    // of its current step
+    double *x_accel;
+    double *y_accel;
+    double *flyby;
+    // Particles whose step ends at the current tick, and their new
+    // accelerations and flyby times
+    int *active;
+    double *active_x_accel;
+    double *active_y_accel;
+    double *active_flyby;
+    // Pair evaluations so far, and particles per level after the last step
+    long long pair_evaluations;
+    int *level_count;
+};
+
+void block_init(struct BlockStepper *stepper, int n, int max_level,
+                double eta);
+void block_free(struct BlockStepper *stepper);
+
+// Forgets the levels and cached accelerations, for when the particles are
+// changed from outside. The pair evaluation count is kept.
+void block_reset(struct BlockStepper *stepper);
+
+// Advances all particles by delta_time
+void block_step(struct BlockStepper *stepper,
+                struct ParticleStore *particles, double G, double epsilon,
+                double delta_time);
+
+#endif
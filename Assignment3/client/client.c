@@ -0,0 +1,203 @@
+// Client of galsim --serve. Sends one command to the daemon and prints the
+// reply, or reads the particles the daemon publishes in shared memory.
+//
+//   client [-s SOCKET] COMMAND [ARGS...]   e.g. client step 10
+//   client -m NAME [-c COUNT]              header and the first COUNT
+//                                          particles of the shared state
+//   client -m NAME -r READS                time READS consistent reads of
+//                                          the whole state
+//
+// A read is consistent when the sequence number is even and unchanged
+// across the copy (see server.h); otherwise it is retried.
+
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../server.h"
+
+static void usage() {
+    printf("Usage: client [-s SOCKET] COMMAND [ARGS...]\n"
+           "       client -m NAME [-c COUNT] [-r READS]\n"
+           "  -s SOCKET  daemon socket (default galsim.sock)\n"
+           "  -m NAME    read the shared memory object NAME instead\n"
+           "  -c COUNT   particles to print from it (default 10)\n"
+           "  -r READS   time READS reads of the whole state\n"
+           "Commands: info, step [K], dt VALUE, query FIRST COUNT,\n"
+           "          snapshot PATH [v2], shutdown\n");
+}
+
+static double wall_time() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + 1e-9 * now.tv_nsec;
+}
+
+static int send_command(const char *socket_path, int argc, char **argv) {
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    if (strlen(socket_path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Socket path %s is too long\n", socket_path);
+        exit(1);
+    }
+    strcpy(address.sun_path, socket_path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 ||
+        connect(fd, (struct sockaddr *)&address, sizeof(address)) != 0) {
+        fprintf(stderr, "Error connecting to %s\n", socket_path);
+        exit(1);
+    }
+    FILE *stream = fdopen(fd, "r+");
+    for (int i = 0; i < argc; i++) {
+        fprintf(stream, "%s%s", i ? " " : "", argv[i]);
+    }
+    fprintf(stream, "\n");
+    fflush(stream);
+
+    // One line, and for query as many more as it announces
+    char line[SERVER_LINE];
+    if (!fgets(line, sizeof(line), stream)) {
+        fprintf(stderr, "The daemon closed the connection\n");
+        exit(1);
+    }
+    fputs(line, stdout);
+    int status = strncmp(line, "ok", 2) == 0 ? 0 : 1;
+    long more = 0;
+    if (strcmp(argv[0], "query") == 0 && strncmp(line, "ok ", 3) == 0) {
+        more = atol(line + 3);
+    }
+    for (long i = 0; i < more && fgets(line, sizeof(line), stream); i++) {
+        fputs(line, stdout);
+    }
+    fclose(stream);
+    return status;
+}
+
+// Copies the state into columns and returns the header it belongs to
+static struct SharedState read_state(const struct SharedState *shared,
+                                     double *columns, size_t count) {
+    const double *source = (const double *)(shared + 1);
+    for (;;) {
+        uint64_t before = atomic_load_explicit(
+            (_Atomic uint64_t *)&shared->sequence, memory_order_acquire);
+        if (before & 1) {
+            continue;
+        }
+        struct SharedState header;
+        memcpy(header.magic, shared->magic, sizeof(header.magic));
+        header.n = shared->n;
+        header.step = shared->step;
+        header.delta_time = shared->delta_time;
+        for (int c = 0; c < 6; c++) {
+            memcpy(columns + c * count, source + c * shared->n,
+                   sizeof(double) * count);
+        }
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit((_Atomic uint64_t *)&shared->sequence,
+                                 memory_order_relaxed) == before) {
+            atomic_init(&header.sequence, before);
+            return header;
+        }
+    }
+}
+
+static int read_shared(const char *name, long count, long reads) {
+    int fd = shm_open(name, O_RDONLY, 0);
+    struct stat status;
+    if (fd < 0 || fstat(fd, &status) != 0) {
+        fprintf(stderr, "Error opening shared memory %s\n", name);
+        exit(1);
+    }
+    const struct SharedState *shared =
+        mmap(NULL, status.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shared == MAP_FAILED ||
+        (size_t)status.st_size < sizeof(struct SharedState) ||
+        memcmp(shared->magic, SHARED_MAGIC, sizeof(shared->magic)) != 0 ||
+        shared->version != SHARED_VERSION ||
+        (size_t)status.st_size <
+            sizeof(struct SharedState) + 6 * sizeof(double) * shared->n) {
+        fprintf(stderr, "%s is not a galsim state\n", name);
+        exit(1);
+    }
+    const size_t n = shared->n;
+
+    if (reads > 0) {
+        double *columns = malloc(6 * sizeof(double) * n);
+        double start = wall_time();
+        struct SharedState header;
+        for (long r = 0; r < reads; r++) {
+            header = read_state(shared, columns, n);
+        }
+        double seconds = wall_time() - start;
+        printf("%ld reads of %zu particles at step %llu: %.1f reads/s, "
+               "%.2f GB/s\n",
+               reads, n, (unsigned long long)header.step, reads / seconds,
+               reads * 6 * sizeof(double) * n / seconds * 1e-9);
+        free(columns);
+        return 0;
+    }
+
+    if (count > (long)n) {
+        count = n;
+    }
+    double *columns = malloc(6 * sizeof(double) * (count ? count : 1));
+    struct SharedState header = read_state(shared, columns, count);
+    printf("n=%llu step=%llu dt=%.17g sequence=%llu\n",
+           (unsigned long long)header.n, (unsigned long long)header.step,
+           header.delta_time,
+           (unsigned long long)atomic_load(&header.sequence));
+    for (long i = 0; i < count; i++) {
+        printf("%.17g %.17g %.17g %.17g %.17g %.17g\n", columns[i],
+               columns[count + i], columns[2 * count + i],
+               columns[3 * count + i], columns[4 * count + i],
+               columns[5 * count + i]);
+    }
+    free(columns);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    const char *socket_path = "galsim.sock";
+    const char *shm_name = NULL;
+    long count = 10;
+    long reads = 0;
+    int option;
+    // + stops at the command, whose arguments are the daemon's to check
+    while ((option = getopt(argc, argv, "+s:m:c:r:h")) != -1) {
+        switch (option) {
+        case 's':
+            socket_path = optarg;
+            break;
+        case 'm':
+            shm_name = optarg;
+            break;
+        case 'c':
+            count = atol(optarg);
+            break;
+        case 'r':
+            reads = atol(optarg);
+            break;
+        default:
+            usage();
+            exit(option == 'h' ? 0 : 1);
+        }
+    }
+    if (shm_name) {
+        return read_shared(shm_name, count < 0 ? 0 : count, reads);
+    }
+    if (optind == argc) {
+        usage();
+        exit(1);
+    }
+    return send_command(socket_path, argc - optind, argv + optind);
+}
@@ -1,118 +1,440 @@
+// Compares two .gal files of N particles, in the legacy or v2 layout, and
+// reports the largest, RMS and relative differences of the positions and
+// velocities. The files are streamed in chunks of particles by a pool of
+// threads, so memory use does not grow with N.
+//
+//     compare_gal_files N file1.gal file2.gal [options]
+//
+// file2 is taken as the reference for the relative differences, which are
+// the RMS difference over the RMS value of file2. With tolerances given,
+// the exit status tells whether the files are within them.
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <math.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../galfile.h"
+
+// Particles handled together in the inner loops; independent accumulators
+// per lane let the compiler vectorise the reductions without reordering
+// additions
+#define LANES 8
+#define FIELDS 6
+
+// Values outside this range are taken as a sign of a broken run
+#define MIN_ALLOWED_VALUE -1e10
+#define MAX_ALLOWED_VALUE 1e10
+
+struct GalInput {
+    const char *name;
+    int fd;
+    enum GalFormat format;
+    // Byte offset of every field of particle 0, and the distance between
+    // consecutive particles of one field
+    off_t field_offset[FIELDS];
+};
+
+// Sums and maxima of one chunk, combined in chunk order at the end so that
+// the result does not depend on the number of threads
+struct Differences {
+    double pos_max2;
+    double pos_sum2;
+    double pos_reference2;
+    double vel_max2;
+    double vel_sum2;
+    double vel_reference2;
+    double mass_max;
+    double brightness_max;
+    long strange;
+};
+
+struct Comparison {
+    long n;
+    long chunk;
+    long chunks;
+    struct GalInput inputs[2];
+    struct Differences *results;
+    atomic_long next_chunk;
+    atomic_bool failed;
+};
+
+static void open_input(struct GalInput *input, const char *name, long n) {
+    input->name = name;
+    input->fd = open(name, O_RDONLY);
+    struct stat status;
+    if (input->fd < 0 || fstat(input->fd, &status) != 0) {
+        printf("Error: failed to open input file '%s'.\n", name);
+        exit(-1);
+    }
+    posix_fadvise(input->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    struct GalHeader header;
+    if (status.st_size >= (off_t)sizeof(header) &&
+        pread(input->fd, &header, sizeof(header), 0) == sizeof(header) &&
+        memcmp(header.magic, GAL_MAGIC, sizeof(header.magic)) == 0) {
+        input->format = GAL_V2;
+        if ((long)header.n != n || header.column_stride < n * sizeof(double) ||
+            (off_t)(header.header_size + FIELDS * header.column_stride) >
+                status.st_size) {
+            printf("Error: '%s' does not hold %ld particles.\n", name, n);
+            exit(-1);
+        }
+        for (int f = 0; f < FIELDS; f++) {
+            input->field_offset[f] =
+                header.header_size + f * header.column_stride;
+        }
+        return;
+    }
+
+    input->format = GAL_LEGACY;
+    if (status.st_size != (off_t)(n * sizeof(struct Particle))) {
+        printf("Error: size of input file '%s' does not match the given n.\n"
+               "For n = %ld the file size is expected to be %ld but the "
+               "actual file size is %ld.\n",
+               name, n, (long)(n * sizeof(struct Particle)),
+               (long)status.st_size);
+        exit(-1);
+    }
+    for (int f = 0; f < FIELDS; f++) {
+        input->field_offset[f] = f * sizeof(double);
+    }
+}
+
+static bool read_fully(int fd, void *buffer, size_t size, off_t offset) {
+    char *out = buffer;
+    while (size > 0) {
+        ssize_t got = pread(fd, out, size, offset);
+        if (got <= 0) {
+            return false;
+        }
+        out += got;
+        size -= got;
+        offset += got;
+    }
+    return true;
+}
+
+// Reads particles begin..begin+count-1 of input into one array per field.
+// Legacy records are read in one piece and split up; records is scratch
+// space for count records.
+static bool read_chunk(const struct GalInput *input, long begin, long count,
+                       double *fields[FIELDS], struct Particle *records) {
+    if (input->format == GAL_V2) {
+        for (int f = 0; f < FIELDS; f++) {
+            if (!read_fully(input->fd, fields[f], count * sizeof(double),
+                            input->field_offset[f] + begin * sizeof(double))) {
+                return false;
+            }
+        }
+        return true;
+    }
+    if (!read_fully(input->fd, records, count * sizeof(struct Particle),
+                    begin * sizeof(struct Particle))) {
+        return false;
+    }
+    for (long i = 0; i < count; i++) {
+        fields[0][i] = records[i].x_pos;
+        fields[1][i] = records[i].y_pos;
+        fields[2][i] = records[i].mass;
+        fields[3][i] = records[i].x_velocity;
+        fields[4][i] = records[i].y_velocity;
+        fields[5][i] = records[i].brightness;
+    }
+    return true;
+}
+
+static long count_strange(const double *values, long count) {
+    long strange[LANES] = {0};
+    long i = 0;
+    for (; i + LANES <= count; i += LANES) {
+        for (int l = 0; l < LANES; l++) {
+            double a = values[i + l];
+            strange[l] += !(a >= MIN_ALLOWED_VALUE && a <= MAX_ALLOWED_VALUE);
+        }
+    }
+    long total = 0;
+    for (; i < count; i++) {
+        total += !(values[i] >= MIN_ALLOWED_VALUE &&
+                   values[i] <= MAX_ALLOWED_VALUE);
+    }
+    for (int l = 0; l < LANES; l++) {
+        total += strange[l];
+    }
+    return total;
+}
+
+// Largest squared difference, sum of squared differences and sum of
+// squared reference values of the 2D vectors (x, y)
+static void compare_vectors(const double *x1, const double *y1,
+                            const double *x2, const double *y2, long count,
+                            double *max2, double *sum2, double *reference2) {
+    double lane_max[LANES] = {0};
+    double lane_sum[LANES] = {0};
+    double lane_reference[LANES] = {0};
+    long i = 0;
+    for (; i + LANES <= count; i += LANES) {
+        for (int l = 0; l < LANES; l++) {
+            double dx = x1[i + l] - x2[i + l];
+            double dy = y1[i + l] - y2[i + l];
+            double d2 = dx * dx + dy * dy;
+            lane_max[l] = d2 > lane_max[l] ? d2 : lane_max[l];
+            lane_sum[l] += d2;
+            lane_reference[l] += x2[i + l] * x2[i + l] + y2[i + l] * y2[i + l];
+        }
+    }
+    for (; i < count; i++) {
+        double dx = x1[i] - x2[i];
+        double dy = y1[i] - y2[i];
+        double d2 = dx * dx + dy * dy;
+        lane_max[0] = d2 > lane_max[0] ? d2 : lane_max[0];
+        lane_sum[0] += d2;
+        lane_reference[0] += x2[i] * x2[i] + y2[i] * y2[i];
+    }
+    for (int l = 0; l < LANES; l++) {
+        *max2 = lane_max[l] > *max2 ? lane_max[l] : *max2;
+        *sum2 += lane_sum[l];
+        *reference2 += lane_reference[l];
+    }
+}
 
-static void update_maxdiff(double dx, double dy, double* maxabsdiff) {
-  double absdiff = sqrt(dx*dx+dy*dy);
-  if(absdiff > *maxabsdiff)
-    *maxabsdiff = absdiff;
+static double max_abs_difference(const double *a, const double *b,
+                                 long count) {
+    double lane_max[LANES] = {0};
+    long i = 0;
+    for (; i + LANES <= count; i += LANES) {
+        for (int l = 0; l < LANES; l++) {
+            double d = fabs(a[i + l] - b[i + l]);
+            lane_max[l] = d > lane_max[l] ? d : lane_max[l];
+        }
+    }
+    for (; i < count; i++) {
+        double d = fabs(a[i] - b[i]);
+        lane_max[0] = d > lane_max[0] ? d : lane_max[0];
+    }
+    double largest = 0;
+    for (int l = 0; l < LANES; l++) {
+        largest = lane_max[l] > largest ? lane_max[l] : largest;
+    }
+    return largest;
 }
 
-int read_doubles_from_file(int n, double* p, const char* fileName) {
-  /* Open input file and determine its size. */
-  FILE* input_file = fopen(fileName, "rb");
-  if(!input_file) {
-    printf("read_doubles_from_file error: failed to open input file '%s'.\n", fileName);
-    return -1;
-  }
-  /* Get filesize using fseek() and ftell(). */
-  fseek(input_file, 0L, SEEK_END);
-  size_t fileSize = ftell(input_file);
-  /* Now use fseek() again to set file position back to beginning of the file. */
-  fseek(input_file, 0L, SEEK_SET);
-  if(fileSize != n * sizeof(double)) {
-    printf("read_doubles_from_file error: size of input file '%s' does not match the given n.\n", fileName);
-    printf("For n = %d the file size is expected to be (n * sizeof(double)) = %lu but the actual file size is %lu.\n",
-	   n, n * sizeof(double), fileSize);
-    return -1;
-  }
-  /* Read contents of input_file into buffer. */
-  size_t noOfItemsRead = fread(p, sizeof(char), fileSize, input_file);
-  if(noOfItemsRead != fileSize) {
-    printf("read_doubles_from_file error: failed to read file contents into buffer.\n");
-    return -1;
-  }
-  /* OK, now we have the file contents in the buffer.
-     Since we are finished with the input file, we can close it now. */
-  if(fclose(input_file) != 0) {
-    printf("read_doubles_from_file error: error closing input file.\n");
-    return -1;
-  }
-  /* Return 0 to indicate success. */
-  return 0;
+static void *compare_main(void *arg) {
+    struct Comparison *comparison = arg;
+    long chunk = comparison->chunk;
+    double *buffer = malloc(sizeof(double) * 2 * FIELDS * chunk);
+    struct Particle *records = malloc(sizeof(struct Particle) * chunk);
+    if (!buffer || !records) {
+        printf("Error: failed to allocate read buffers.\n");
+        exit(-1);
+    }
+    double *fields[2][FIELDS];
+    for (int file = 0; file < 2; file++) {
+        for (int f = 0; f < FIELDS; f++) {
+            fields[file][f] = buffer + (file * FIELDS + f) * chunk;
+        }
+    }
+
+    for (;;) {
+        long c = atomic_fetch_add(&comparison->next_chunk, 1);
+        if (c >= comparison->chunks || atomic_load(&comparison->failed)) {
+            break;
+        }
+        long begin = c * chunk;
+        long count = comparison->n - begin < chunk ? comparison->n - begin
+                                                   : chunk;
+        bool read = true;
+        for (int file = 0; file < 2 && read; file++) {
+            read = read_chunk(&comparison->inputs[file], begin, count,
+                              fields[file], records);
+            if (!read) {
+                printf("Error reading file '%s'\n",
+                       comparison->inputs[file].name);
+                atomic_store(&comparison->failed, true);
+            }
+        }
+        // A failed chunk is not reduced from the stale buffers
+        if (!read) {
+            continue;
+        }
+
+        struct Differences *result = &comparison->results[c];
+        memset(result, 0, sizeof(*result));
+        for (int file = 0; file < 2; file++) {
+            for (int f = 0; f < FIELDS; f++) {
+                result->strange += count_strange(fields[file][f], count);
+            }
+        }
+        double **a = fields[0];
+        double **b = fields[1];
+        compare_vectors(a[0], a[1], b[0], b[1], count, &result->pos_max2,
+                        &result->pos_sum2, &result->pos_reference2);
+        compare_vectors(a[3], a[4], b[3], b[4], count, &result->vel_max2,
+                        &result->vel_sum2, &result->vel_reference2);
+        result->mass_max = max_abs_difference(a[2], b[2], count);
+        result->brightness_max = max_abs_difference(a[5], b[5], count);
+    }
+    free(buffer);
+    free(records);
+    return NULL;
 }
 
-/* The idea with the check_that_numbers_seem_OK() function is to check
-   that there are no strange numbers like "nan" that may give problems
-   when we try to compare the numbers later. */
-int check_that_numbers_seem_OK(int n, double* buf) {
-  const double minAllowedValue = -1e10;
-  const double maxAllowedValue = 1e10;
-  int OKcount = 0;
-  int i;
-  for(i = 0; i < n; i++) {
-    double a = buf[i];
-    if(a >= minAllowedValue && a <= maxAllowedValue)
-      OKcount++;
-  }
-  if(OKcount == n)
-    return 0;
-  else
-    return -1;
+static void usage() {
+    printf("Usage: compare_gal_files N file1.gal file2.gal [options]\n"
+           "Options:\n"
+           "  --pos-tol=X     fail if pos_maxdiff exceeds X\n"
+           "  --vel-tol=X     fail if vel_maxdiff exceeds X\n"
+           "  --rel-tol=X     fail if pos_reldiff or vel_reldiff exceeds X\n"
+           "  --threads=T     reader threads (default: online CPUs)\n"
+           "  --chunk=P       particles per chunk (default 32768)\n");
 }
 
-int main(int argc, const char* argv[]) {
-  if(argc != 4) {
-    printf("Give 3 input args: N gal1.gal gal2.gal\n");
-    return -1;
-  }
-  int N = atoi(argv[1]);
-  const char* fileName1 = argv[2];
-  const char* fileName2 = argv[3];
-  printf("N = %d\n", N);
-  printf("fileName1 = '%s'\n", fileName1);
-  printf("fileName2 = '%s'\n", fileName2);
-  /* Read files. */
-  double buf1[6*N];
-  if(read_doubles_from_file(6*N, buf1, fileName1) != 0) {
-    printf("Error reading file '%s'\n", fileName1);
-    return -1;
-  }
-  if(check_that_numbers_seem_OK(6*N, buf1) != 0) {
-    printf("Error: strange numbers found in file '%s'.\n", fileName1);
-    return -1;
-  }
-  double buf2[6*N];
-  if(read_doubles_from_file(6*N, buf2, fileName2) != 0) {
-    printf("Error reading file '%s'\n", fileName2);
-    return -1;
-  }
-  if(check_that_numbers_seem_OK(6*N, buf2) != 0) {
-    printf("Error: strange numbers found in file '%s'.\n", fileName2);
-    return -1;
-  }
-  /* Compare positions and velocities. */
-  double pos_maxdiff = 0;
-  double vel_maxdiff = 0;
-  int i;
-  for(i = 0; i < N; i++) {
-    double pos_dx = buf1[i*6+0] - buf2[i*6+0];
-    double pos_dy = buf1[i*6+1] - buf2[i*6+1];
-    double m_diff = buf1[i*6+2] - buf2[i*6+2];
-    double vel_dx = buf1[i*6+3] - buf2[i*6+3];
-    double vel_dy = buf1[i*6+4] - buf2[i*6+4];
-    double b_diff = buf1[i*6+5] - buf2[i*6+5];
-    if(fabs(m_diff) > 1e-9) {
-      printf("ERROR: mass values do not match.\n");
-      return -1;
-    }
-    if(fabs(b_diff) > 1e-9) {
-      printf("ERROR: 'brightness' values do not match.\n");
-      return -1;
-    }
-    update_maxdiff(pos_dx, pos_dy, &pos_maxdiff);
-    update_maxdiff(vel_dx, vel_dy, &vel_maxdiff);
-  }
-  printf("pos_maxdiff = %16.12f\n", pos_maxdiff);
-  return 0;
+int main(int argc, char *argv[]) {
+    double pos_tolerance = -1;
+    double vel_tolerance = -1;
+    double rel_tolerance = -1;
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    long chunk = 32768;
+    static struct option options[] = {
+        {"pos-tol", required_argument, NULL, 'p'},
+        {"vel-tol", required_argument, NULL, 'v'},
+        {"rel-tol", required_argument, NULL, 'r'},
+        {"threads", required_argument, NULL, 't'},
+        {"chunk", required_argument, NULL, 'c'},
+        {NULL, 0, NULL, 0}};
+    int option;
+    while ((option = getopt_long(argc, argv, "", options, NULL)) != -1) {
+        switch (option) {
+        case 'p':
+            pos_tolerance = atof(optarg);
+            break;
+        case 'v':
+            vel_tolerance = atof(optarg);
+            break;
+        case 'r':
+            rel_tolerance = atof(optarg);
+            break;
+        case 't':
+            threads = atol(optarg);
+            break;
+        case 'c':
+            chunk = atol(optarg);
+            break;
+        default:
+            usage();
+            return -1;
+        }
+    }
+    if (argc - optind != 3 || threads < 1 || chunk < 1) {
+        usage();
+        return -1;
+    }
+
+    struct Comparison comparison;
+    comparison.n = atol(argv[optind]);
+    const char *fileName1 = argv[optind + 1];
+    const char *fileName2 = argv[optind + 2];
+    printf("N = %ld\n", comparison.n);
+    printf("fileName1 = '%s'\n", fileName1);
+    printf("fileName2 = '%s'\n", fileName2);
+    open_input(&comparison.inputs[0], fileName1, comparison.n);
+    open_input(&comparison.inputs[1], fileName2, comparison.n);
+
+    comparison.chunk = chunk;
+    comparison.chunks = (comparison.n + chunk - 1) / chunk;
+    comparison.results =
+        malloc(sizeof(struct Differences) * (comparison.chunks + 1));
+    atomic_init(&comparison.next_chunk, 0);
+    atomic_init(&comparison.failed, false);
+    if (threads > comparison.chunks) {
+        threads = comparison.chunks > 0 ? comparison.chunks : 1;
+    }
+    pthread_t *workers = malloc(sizeof(pthread_t) * threads);
+    for (long t = 1; t < threads; t++) {
+        if (pthread_create(&workers[t], NULL, compare_main, &comparison) !=
+            0) {
+            printf("Error: failed to start reader threads.\n");
+            return -1;
+        }
+    }
+    compare_main(&comparison);
+    for (long t = 1; t < threads; t++) {
+        pthread_join(workers[t], NULL);
+    }
+    free(workers);
+    if (atomic_load(&comparison.failed)) {
+        return -1;
+    }
+
+    struct Differences total = {0};
+    for (long c = 0; c < comparison.chunks; c++) {
+        const struct Differences *result = &comparison.results[c];
+        total.pos_max2 = fmax(total.pos_max2, result->pos_max2);
+        total.pos_sum2 += result->pos_sum2;
+        total.pos_reference2 += result->pos_reference2;
+        total.vel_max2 = fmax(total.vel_max2, result->vel_max2);
+        total.vel_sum2 += result->vel_sum2;
+        total.vel_reference2 += result->vel_reference2;
+        total.mass_max = fmax(total.mass_max, result->mass_max);
+        total.brightness_max =
+            fmax(total.brightness_max, result->brightness_max);
+        total.strange += result->strange;
+    }
+    free(comparison.results);
+
+    if (total.strange > 0) {
+        printf("Error: %ld strange numbers found in the files.\n",
+               total.strange);
+        return -1;
+    }
+    if (total.mass_max > 1e-9) {
+        printf("ERROR: mass values do not match.\n");
+        return -1;
+    }
+    if (total.brightness_max > 1e-9) {
+        printf("ERROR: 'brightness' values do not match.\n");
+        return -1;
+    }
+
+    double n = comparison.n > 0 ? comparison.n : 1;
+    double pos_maxdiff = sqrt(total.pos_max2);
+    double vel_maxdiff = sqrt(total.vel_max2);
+    double pos_rmsdiff = sqrt(total.pos_sum2 / n);
+    double vel_rmsdiff = sqrt(total.vel_sum2 / n);
+    double pos_reldiff = total.pos_reference2 > 0
+                             ? sqrt(total.pos_sum2 / total.pos_reference2)
+                             : pos_rmsdiff;
+    double vel_reldiff = total.vel_reference2 > 0
+                             ? sqrt(total.vel_sum2 / total.vel_reference2)
+                             : vel_rmsdiff;
+    printf("pos_maxdiff = %16.12f\n", pos_maxdiff);
+    printf("pos_rmsdiff = %16.12f\n", pos_rmsdiff);
+    printf("pos_reldiff = %16.12e\n", pos_reldiff);
+    printf("vel_maxdiff = %16.12f\n", vel_maxdiff);
+    printf("vel_rmsdiff = %16.12f\n", vel_rmsdiff);
+    printf("vel_reldiff = %16.12e\n", vel_reldiff);
+
+    bool pass = true;
+    if (pos_tolerance >= 0 && pos_maxdiff > pos_tolerance) {
+        printf("FAIL: pos_maxdiff exceeds %g\n", pos_tolerance);
+        pass = false;
+    }
+    if (vel_tolerance >= 0 && vel_maxdiff > vel_tolerance) {
+        printf("FAIL: vel_maxdiff exceeds %g\n", vel_tolerance);
+        pass = false;
+    }
+    if (rel_tolerance >= 0 &&
+        (pos_reldiff > rel_tolerance || vel_reldiff > rel_tolerance)) {
+        printf("FAIL: relative difference exceeds %g\n", rel_tolerance);
+        pass = false;
+    }
+    return pass ? 0 : 1;
 }
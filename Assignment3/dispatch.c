@@ -0,0 +1,114 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "kernels.h"
+
+static const struct KernelTable *active;
+
+static bool cpu_runs(enum KernelIsa isa) {
+    __builtin_cpu_init();
+    switch (isa) {
+    case ISA_AVX512:
+        return __builtin_cpu_supports("x86-64-v4");
+    case ISA_AVX2:
+        return __builtin_cpu_supports("x86-64-v3");
+    default:
+        return true;
+    }
+}
+
+void kernels_select(enum KernelIsa isa) {
+    if (isa == ISA_AUTO) {
+        isa = cpu_runs(ISA_AVX512) ? ISA_AVX512
+              : cpu_runs(ISA_AVX2) ? ISA_AVX2
+                                   : ISA_SSE2;
+    }
+    const struct KernelTable *tables[] = {NULL, &kernel_table_sse2,
+                                          &kernel_table_avx2,
+                                          &kernel_table_avx512};
+    if (!cpu_runs(isa)) {
+        fprintf(stderr, "This CPU does not support the %s kernels\n",
+                tables[isa]->name);
+        exit(1);
+    }
+    active = tables[isa];
+}
+
+static const struct KernelTable *kernels() {
+    if (!active) {
+        kernels_select(ISA_AUTO);
+    }
+    return active;
+}
+
+const char *kernels_name(void) { return kernels()->name; }
+
+void direct_rows(const struct ParticleStore *particles, int row_begin,
+                 int row_end, int tile, double G, double epsilon, double scale,
+                 struct ParticleChange *changes) {
+    kernels()->direct_rows_fn(particles, row_begin, row_end, tile, G, epsilon,
+                              scale, changes);
+}
+
+void float_store_alloc(struct FloatStore *store, int n) {
+    kernels()->float_store_alloc_fn(store, n);
+}
+
+void float_store_free(struct FloatStore *store) {
+    kernels()->float_store_free_fn(store);
+}
+
+void float_store_update(struct FloatStore *store,
+                        const struct ParticleStore *particles) {
+    kernels()->float_store_update_fn(store, particles);
+}
+
+void direct_rows_mixed(const struct FloatStore *particles, int row_begin,
+                       int row_end, int tile, double G, double epsilon,
+                       double scale, struct ParticleChange *changes) {
+    kernels()->direct_rows_mixed_fn(particles, row_begin, row_end, tile, G,
+                                    epsilon, scale, changes);
+}
+
+void integrate(struct ParticleStore *particles,
+               const struct ParticleChange *changes, double delta_time) {
+    kernels()->integrate_fn(particles, changes, delta_time);
+}
+
+void accel_rows(const struct ParticleStore *particles, const int *rows,
+                int count, double G, double epsilon, double *x_accel,
+                double *y_accel, double *flyby) {
+    kernels()->accel_rows_fn(particles, rows, count, G, epsilon, x_accel,
+                             y_accel, flyby);
+}
+
+void accel_block(const double *x_i, const double *y_i, int count_i,
+                 const double *x_j, const double *y_j, const double *m_j,
+                 int count_j, int tile, double factor, double epsilon,
+                 double *x_change, double *y_change) {
+    kernels()->accel_block_fn(x_i, y_i, count_i, x_j, y_j, m_j, count_j, tile,
+                              factor, epsilon, x_change, y_change);
+}
+
+void direct_rows_jerk(const struct ParticleStore *particles, int row_begin,
+                      int row_end, int tile, double G, double epsilon,
+                      struct ParticleChange *accel,
+                      struct ParticleChange *jerk) {
+    kernels()->direct_rows_jerk_fn(particles, row_begin, row_end, tile, G,
+                                   epsilon, accel, jerk);
+}
+
+void direct_rows_energy(const struct ParticleStore *particles, int row_begin,
+                        int row_end, int tile, double G, double epsilon,
+                        double scale, struct ParticleChange *changes,
+                        double *potential) {
+    kernels()->direct_rows_energy_fn(particles, row_begin, row_end, tile, G,
+                                     epsilon, scale, changes, potential);
+}
+
+void integrate_energy(struct ParticleStore *particles,
+                      const struct ParticleChange *changes, double delta_time,
+                      struct Conserved *totals) {
+    kernels()->integrate_energy_fn(particles, changes, delta_time, totals);
+}
@@ -0,0 +1,85 @@
+// Reads frames back out of a compressed .galz trajectory written by
+// galsim --snapshot=PATH.galz.
+//
+// Usage: extract_frame [--format=legacy|v2] TRAJECTORY K OUTPUT
+//        extract_frame --list TRAJECTORY
+
+#include <getopt.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "galfile.h"
+#include "galsim.h"
+#include "trajectory.h"
+
+static void usage() {
+    printf("Usage: extract_frame [--format=legacy|v2] TRAJECTORY K OUTPUT\n"
+           "       extract_frame --list TRAJECTORY\n"
+           "Writes frame K (counting from 0) of a .galz trajectory as a .gal "
+           "file,\n"
+           "or lists the frames.\n");
+}
+
+int main(int argc, char **argv) {
+    static struct option options[] = {
+        {"format", required_argument, NULL, 'F'},
+        {"list", no_argument, NULL, 'l'},
+        {NULL, 0, NULL, 0}};
+    enum GalFormat format = GAL_LEGACY;
+    bool list = false;
+    int option;
+    while ((option = getopt_long(argc, argv, "", options, NULL)) != -1) {
+        switch (option) {
+        case 'F':
+            if (strcmp(optarg, "legacy") == 0) {
+                format = GAL_LEGACY;
+            } else if (strcmp(optarg, "v2") == 0) {
+                format = GAL_V2;
+            } else {
+                fprintf(stderr, "Unknown format '%s'\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'l':
+            list = true;
+            break;
+        default:
+            usage();
+            exit(1);
+        }
+    }
+    if (argc - optind != (list ? 1 : 3)) {
+        usage();
+        exit(1);
+    }
+
+    struct TrajectoryReader reader;
+    trajectory_open(&reader, argv[optind]);
+    const struct TrajectoryHeader *header = &reader.header;
+    if (list) {
+        printf("%llu particles, delta_time %g, tolerance %g, %llu frames\n",
+               (unsigned long long)header->n, header->delta_time,
+               header->quantum / sqrt(2), (unsigned long long)header->frames);
+        for (uint64_t k = 0; k < header->frames; k++) {
+            const struct TrajectoryEntry *entry = &reader.entries[k];
+            printf("%6llu  step %8llu  %10llu bytes%s\n",
+                   (unsigned long long)k, (unsigned long long)entry->step,
+                   (unsigned long long)entry->size,
+                   entry->keyframe ? "  key" : "");
+        }
+        trajectory_close_reader(&reader);
+        return 0;
+    }
+
+    long k = atol(argv[optind + 1]);
+    struct ParticleStore particles;
+    store_alloc(&particles, header->n);
+    int step = trajectory_read(&reader, k, &particles);
+    gal_write(argv[optind + 2], format, &particles, step, header->delta_time);
+    store_free(&particles);
+    trajectory_close_reader(&reader);
+    return 0;
+}
@@ -0,0 +1,677 @@
+#include "fmm.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "kernels.h"
+#include "pool.h"
+
+// The deepest tree has about this many particles per leaf on average
+#define FMM_LEAF_SIZE 16
+#define FMM_MAX_LEVELS 10
+#define FMM_MAX_ORDER 16
+// Number of terms kept from the epsilon / r series of the softened kernel
+#define FMM_SOFTENING_TERMS 6
+// Leaf cells are kept at least this many softening lengths wide, so that the
+// epsilon / r series converges quickly between well-separated cells
+#define FMM_MIN_LEAF_WIDTH 8
+
+// Index of the coefficient of z^k * conj(z)^l, ordered by total degree
+static inline int term(int k, int l) {
+    int d = k + l;
+    return d * (d + 1) / 2 + l;
+}
+
+// Index of the first cell of a level when all levels are stored in sequence
+static inline int level_offset(int level) {
+    return ((1 << (2 * level)) - 1) / 3;
+}
+
+static double rising(double a, int k) {
+    double result = 1;
+    for (int i = 0; i < k; i++) {
+        result *= a + i;
+    }
+    return result;
+}
+
+static double factorial(int k) { return rising(1, k); }
+
+void fmm_init(struct FMM *fmm, int n, int order) {
+    if (order < 1 || order > FMM_MAX_ORDER) {
+        fprintf(stderr, "FMM order must be between 1 and %d\n", FMM_MAX_ORDER);
+        exit(1);
+    }
+    int p = order;
+    fmm->n = n;
+    fmm->order = p;
+    fmm->terms = (p + 1) * (p + 2) / 2;
+
+    fmm->max_levels = 0;
+    while (fmm->max_levels < FMM_MAX_LEVELS &&
+           (long)FMM_LEAF_SIZE << (2 * fmm->max_levels) < n) {
+        fmm->max_levels++;
+    }
+
+    int cells = level_offset(fmm->max_levels + 1);
+    int leaves = 1 << (2 * fmm->max_levels);
+    int terms = fmm->terms;
+    fmm->multipoles = malloc(sizeof(double complex) * cells * terms);
+    fmm->locals = malloc(sizeof(double complex) * cells * terms);
+    fmm->sorted = malloc(sizeof(int) * n);
+    fmm->sorted_x = alloc_doubles(n);
+    fmm->sorted_y = alloc_doubles(n);
+    fmm->sorted_mass = alloc_doubles(n);
+    fmm->leaf_of = malloc(sizeof(int) * n);
+    fmm->cell_count = malloc(sizeof(int) * cells);
+    fmm->cell_start = malloc(sizeof(int) * (leaves + 1));
+    fmm->m2l = calloc(fmm->max_levels + 1, sizeof(double complex *));
+    fmm->size = 0;
+    fmm->m2l_coefficients =
+        malloc(sizeof(double) * FMM_SOFTENING_TERMS * terms * terms);
+    fmm->binomial = malloc(sizeof(double) * (p + 1) * (p + 1));
+    if (!fmm->multipoles || !fmm->locals || !fmm->sorted || !fmm->leaf_of ||
+        !fmm->cell_count || !fmm->cell_start || !fmm->m2l || !fmm->m2l_coefficients ||
+        !fmm->binomial) {
+        fprintf(stderr, "Error allocating FMM tree\n");
+        exit(1);
+    }
+
+    for (int k = 0; k <= p; k++) {
+        for (int i = 0; i <= p; i++) {
+            fmm->binomial[k * (p + 1) + i] =
+                i <= k ? factorial(k) / (factorial(i) * factorial(k - i)) : 0;
+        }
+    }
+
+    // For the potential r^-2a with a = (s + 1) / 2, the multipole expansion
+    // of z^-a has the coefficients (a)_k / k!, and the k-th derivative of
+    // z^-(a + k) is (-1)^k (a + k)_k z^-(a + 2k). Their products are the
+    // distance-independent parts of the M2L operator.
+    for (int s = 0; s < FMM_SOFTENING_TERMS; s++) {
+        double a = (s + 1) / 2.0;
+        double *table = &fmm->m2l_coefficients[s * terms * terms];
+        for (int ta = 0; ta <= p; ta++) {
+            for (int tb = 0; ta + tb <= p; tb++) {
+                for (int k = 0; k <= p; k++) {
+                    for (int l = 0; k + l <= p; l++) {
+                        double sign = (ta + tb) % 2 ? -1 : 1;
+                        table[term(ta, tb) * terms + term(k, l)] =
+                            sign * rising(a, k) / factorial(k) *
+                            rising(a, l) / factorial(l) * rising(a + k, ta) *
+                            rising(a + l, tb) / (factorial(ta) * factorial(tb));
+                    }
+                }
+            }
+        }
+    }
+}
+
+void fmm_free(struct FMM *fmm) {
+    free(fmm->multipoles);
+    free(fmm->locals);
+    free(fmm->sorted);
+    free(fmm->sorted_x);
+    free(fmm->sorted_y);
+    free(fmm->sorted_mass);
+    free(fmm->leaf_of);
+    free(fmm->cell_count);
+    free(fmm->cell_start);
+    for (int level = 0; level <= fmm->max_levels; level++) {
+        free(fmm->m2l[level]);
+    }
+    free(fmm->m2l);
+    free(fmm->m2l_coefficients);
+    free(fmm->binomial);
+}
+
+// State shared by the phases of one force evaluation
+struct FMMJob {
+    struct FMM *fmm;
+    const struct ParticleStore *particles;
+    struct ParticleChange *changes;
+    double factor;
+    double epsilon;
+    int level;
+    int ntiles;
+};
+
+static void cell_center(const struct FMM *fmm, int level, int cell, double *x,
+                        double *y) {
+    int side = 1 << level;
+    double width = fmm->size / side;
+    *x = fmm->x_min + (cell % side + 0.5) * width;
+    *y = fmm->y_min + (cell / side + 0.5) * width;
+}
+
+static inline int cell_count(const struct FMM *fmm, int level, int cell) {
+    return fmm->cell_count[level_offset(level) + cell];
+}
+
+static void tile_range(const struct FMMJob *job, int count, int tile,
+                       int *begin, int *end) {
+    *begin = (long)count * tile / job->ntiles;
+    *end = (long)count * (tile + 1) / job->ntiles;
+}
+
+// Multipole expansions of the leaves from their particles
+static void p2m_tile(void *arg, int worker, int tile) {
+    (void)worker;
+    const struct FMMJob *job = arg;
+    struct FMM *fmm = job->fmm;
+    const struct ParticleStore *particles = job->particles;
+    const int p = fmm->order;
+    const int levels = fmm->levels;
+    int begin, end;
+    tile_range(job, 1 << (2 * levels), tile, &begin, &end);
+
+    double complex powers[FMM_MAX_ORDER + 1];
+    for (int leaf = begin; leaf < end; leaf++) {
+        double complex *M =
+            &fmm->multipoles[(level_offset(levels) + leaf) * fmm->terms];
+        memset(M, 0, sizeof(double complex) * fmm->terms);
+        double x_center, y_center;
+        cell_center(fmm, levels, leaf, &x_center, &y_center);
+
+        for (int slot = fmm->cell_start[leaf]; slot < fmm->cell_start[leaf + 1];
+             slot++) {
+            int i = fmm->sorted[slot];
+            double complex u = (particles->x_pos[i] - x_center) +
+                               (particles->y_pos[i] - y_center) * I;
+            powers[0] = particles->mass[i];
+            for (int k = 1; k <= p; k++) {
+                powers[k] = powers[k - 1] * u;
+            }
+            double complex conj_u = conj(u);
+            for (int k = 0; k <= p; k++) {
+                double complex value = powers[k];
+                for (int l = 0; k + l <= p; l++) {
+                    M[term(k, l)] += value;
+                    value *= conj_u;
+                }
+            }
+        }
+    }
+}
+
+// Powers s^0 .. s^p of a shift and of its conjugate
+static void shift_powers(double complex s, int p, double complex *powers,
+                         double complex *conj_powers) {
+    powers[0] = 1;
+    conj_powers[0] = 1;
+    for (int k = 1; k <= p; k++) {
+        powers[k] = powers[k - 1] * s;
+        conj_powers[k] = conj(powers[k]);
+    }
+}
+
+// Multipole expansions of the cells of job->level from their children
+static void m2m_tile(void *arg, int worker, int tile) {
+    (void)worker;
+    const struct FMMJob *job = arg;
+    struct FMM *fmm = job->fmm;
+    const int p = fmm->order;
+    const int terms = fmm->terms;
+    const int level = job->level;
+    const int side = 1 << level;
+    const double child_width = fmm->size / (2 * side);
+    int begin, end;
+    tile_range(job, side * side, tile, &begin, &end);
+
+    double complex powers[FMM_MAX_ORDER + 1];
+    double complex conj_powers[FMM_MAX_ORDER + 1];
+    for (int cell = begin; cell < end; cell++) {
+        double complex *M =
+            &fmm->multipoles[(level_offset(level) + cell) * terms];
+        memset(M, 0, sizeof(double complex) * terms);
+        int px = cell % side;
+        int py = cell / side;
+        for (int q = 0; q < 4; q++) {
+            int child = (2 * py + (q >> 1)) * (2 * side) + 2 * px + (q & 1);
+            if (cell_count(fmm, level + 1, child) == 0) {
+                continue;
+            }
+            const double complex *C =
+                &fmm->multipoles[(level_offset(level + 1) + child) * terms];
+            // Offset of the parent centre as seen from the child centre
+            double complex s = ((q & 1) - 0.5) * child_width +
+                               ((q >> 1) - 0.5) * child_width * I;
+            shift_powers(s, p, powers, conj_powers);
+            for (int k = 0; k <= p; k++) {
+                for (int l = 0; k + l <= p; l++) {
+                    double complex sum = 0;
+                    for (int i = 0; i <= k; i++) {
+                        for (int j = 0; j <= l; j++) {
+                            sum += fmm->binomial[k * (p + 1) + i] *
+                                   fmm->binomial[l * (p + 1) + j] *
+                                   powers[k - i] * conj_powers[l - j] *
+                                   C[term(i, j)];
+                        }
+                    }
+                    M[term(k, l)] += sum;
+                }
+            }
+        }
+    }
+}
+
+// Builds the M2L operators of a level for all offsets target - source in
+// [-3, 3] x [-3, 3] cells, unless they are still valid
+static void build_m2l(struct FMM *fmm, int level, double epsilon) {
+    const int p = fmm->order;
+    const int terms = fmm->terms;
+    const double width = fmm->size / (1 << level);
+    if (fmm->m2l[level]) {
+        return;
+    }
+    fmm->m2l[level] = malloc(sizeof(double complex) * 49 * terms * terms);
+    if (!fmm->m2l[level]) {
+        fprintf(stderr, "Error allocating FMM tree\n");
+        exit(1);
+    }
+
+    double weights[FMM_SOFTENING_TERMS];
+    double complex inverse_powers[2 * FMM_MAX_ORDER + 1];
+    double complex conj_inverse_powers[2 * FMM_MAX_ORDER + 1];
+
+    for (int oy = -3; oy <= 3; oy++) {
+        for (int ox = -3; ox <= 3; ox++) {
+            if (abs(ox) < 2 && abs(oy) < 2) {
+                continue;
+            }
+            double complex *K =
+                &fmm->m2l[level][((oy + 3) * 7 + ox + 3) * terms * terms];
+            double complex R = ox * width + oy * width * I;
+            double r = cabs(R);
+
+            // w_s * r^-(s + 1) with w_s = (-1)^s (s + 2) / 2 * epsilon^s
+            double epsilon_power = 1;
+            for (int s = 0; s < FMM_SOFTENING_TERMS; s++) {
+                double sign = s % 2 ? -1 : 1;
+                weights[s] = sign * (s + 2) / 2.0 * epsilon_power *
+                             pow(r, -(s + 1));
+                epsilon_power *= epsilon;
+            }
+            inverse_powers[0] = 1;
+            conj_inverse_powers[0] = 1;
+            for (int q = 1; q <= 2 * p; q++) {
+                inverse_powers[q] = inverse_powers[q - 1] / R;
+                conj_inverse_powers[q] = conj(inverse_powers[q]);
+            }
+
+            for (int ta = 0; ta <= p; ta++) {
+                for (int tb = 0; ta + tb <= p; tb++) {
+                    int row = term(ta, tb) * terms;
+                    for (int k = 0; k <= p; k++) {
+                        for (int l = 0; k + l <= p; l++) {
+                            int column = term(k, l);
+                            double coefficient = 0;
+                            for (int s = 0; s < FMM_SOFTENING_TERMS; s++) {
+                                coefficient +=
+                                    weights[s] *
+                                    fmm->m2l_coefficients[s * terms * terms +
+                                                          row + column];
+                            }
+                            K[row + column] = coefficient *
+                                              inverse_powers[k + ta] *
+                                              conj_inverse_powers[l + tb];
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+// Local expansions of the cells of job->level from their interaction lists:
+// the children of the parent's neighbours that are not neighbours themselves
+CPU_CLONES
+static void m2l_tile(void *arg, int worker, int tile) {
+    (void)worker;
+    const struct FMMJob *job = arg;
+    struct FMM *fmm = job->fmm;
+    const int terms = fmm->terms;
+    const int level = job->level;
+    const int side = 1 << level;
+    int begin, end;
+    tile_range(job, side * side, tile, &begin, &end);
+
+    for (int cell = begin; cell < end; cell++) {
+        if (cell_count(fmm, level, cell) == 0) {
+            continue;
+        }
+        double complex *L = &fmm->locals[(level_offset(level) + cell) * terms];
+        int ix = cell % side;
+        int iy = cell / side;
+        int px = ix / 2;
+        int py = iy / 2;
+        for (int jy = 2 * py - 2; jy <= 2 * py + 3; jy++) {
+            for (int jx = 2 * px - 2; jx <= 2 * px + 3; jx++) {
+                if (jx < 0 || jy < 0 || jx >= side || jy >= side ||
+                    (abs(jx - ix) < 2 && abs(jy - iy) < 2) ||
+                    cell_count(fmm, level, jy * side + jx) == 0) {
+                    continue;
+                }
+                const double complex *M =
+                    &fmm->multipoles[(level_offset(level) + jy * side + jx) *
+                                     terms];
+                const double complex *K =
+                    &fmm->m2l[level][((iy - jy + 3) * 7 + ix - jx + 3) *
+                                     terms * terms];
+                for (int row = 0; row < terms; row++) {
+                    double complex sum = 0;
+                    for (int column = 0; column < terms; column++) {
+                        sum += K[row * terms + column] * M[column];
+                    }
+                    L[row] += sum;
+                }
+            }
+        }
+    }
+}
+
+// Shifts the local expansions of job->level into their children
+static void l2l_tile(void *arg, int worker, int tile) {
+    (void)worker;
+    const struct FMMJob *job = arg;
+    struct FMM *fmm = job->fmm;
+    const int p = fmm->order;
+    const int terms = fmm->terms;
+    const int level = job->level;
+    const int side = 1 << level;
+    const double child_width = fmm->size / (2 * side);
+    int begin, end;
+    tile_range(job, 4 * side * side, tile, &begin, &end);
+
+    double complex powers[FMM_MAX_ORDER + 1];
+    double complex conj_powers[FMM_MAX_ORDER + 1];
+    for (int child = begin; child < end; child++) {
+        int cx = child % (2 * side);
+        int cy = child / (2 * side);
+        int parent = (cy / 2) * side + cx / 2;
+        if (cell_count(fmm, level + 1, child) == 0) {
+            continue;
+        }
+        double complex *L =
+            &fmm->locals[(level_offset(level + 1) + child) * terms];
+        const double complex *P =
+            &fmm->locals[(level_offset(level) + parent) * terms];
+        // Offset of the child centre as seen from the parent centre
+        double complex s =
+            ((cx & 1) - 0.5) * child_width + ((cy & 1) - 0.5) * child_width * I;
+        shift_powers(s, p, powers, conj_powers);
+        for (int c = 0; c <= p; c++) {
+            for (int d = 0; c + d <= p; d++) {
+                double complex sum = 0;
+                for (int a = c; a <= p; a++) {
+                    for (int b = d; a + b <= p; b++) {
+                        sum += fmm->binomial[a * (p + 1) + c] *
+                               fmm->binomial[b * (p + 1) + d] *
+                               powers[a - c] * conj_powers[b - d] *
+                               P[term(a, b)];
+                    }
+                }
+                L[term(c, d)] += sum;
+            }
+        }
+    }
+}
+
+// Far field from the local expansions plus the direct near field of the
+// neighbouring leaves, for all particles of a range of leaves
+CPU_CLONES
+static void leaf_tile(void *arg, int worker, int tile) {
+    (void)worker;
+    const struct FMMJob *job = arg;
+    struct FMM *fmm = job->fmm;
+    const struct ParticleStore *particles = job->particles;
+    const double *x = particles->x_pos;
+    const double *y = particles->y_pos;
+    const double *restrict sorted_x = fmm->sorted_x;
+    const double *restrict sorted_y = fmm->sorted_y;
+    const double *restrict sorted_mass = fmm->sorted_mass;
+    const double epsilon = job->epsilon;
+    const int p = fmm->order;
+    const int levels = fmm->levels;
+    const int side = 1 << levels;
+    int begin, end;
+    tile_range(job, side * side, tile, &begin, &end);
+
+    double complex powers[FMM_MAX_ORDER + 1];
+    for (int leaf = begin; leaf < end; leaf++) {
+        const double complex *L =
+            &fmm->locals[(level_offset(levels) + leaf) * fmm->terms];
+        double x_center, y_center;
+        cell_center(fmm, levels, leaf, &x_center, &y_center);
+        int ix = leaf % side;
+        int iy = leaf / side;
+
+        for (int slot = fmm->cell_start[leaf]; slot < fmm->cell_start[leaf + 1];
+             slot++) {
+            int i = fmm->sorted[slot];
+            double accel_x = 0;
+            double accel_y = 0;
+
+            if (levels >= 2) {
+                // d/dx + i d/dy of the real potential is 2 d/dconj(t)
+                double complex t = (x[i] - x_center) + (y[i] - y_center) * I;
+                powers[0] = 1;
+                for (int k = 1; k <= p; k++) {
+                    powers[k] = powers[k - 1] * t;
+                }
+                double complex gradient = 0;
+                for (int a = 0; a < p; a++) {
+                    for (int b = 1; a + b <= p; b++) {
+                        gradient +=
+                            b * L[term(a, b)] * powers[a] * conj(powers[b - 1]);
+                    }
+                }
+                accel_x = 2 * creal(gradient);
+                accel_y = 2 * cimag(gradient);
+            }
+
+            // Particle i itself is in the range, but with dx = dy = 0 it
+            // adds nothing, which keeps the loop free of branches
+            const double x_i = x[i];
+            const double y_i = y[i];
+            int jx_begin = ix > 0 ? ix - 1 : 0;
+            int jx_end = ix < side - 1 ? ix + 1 : side - 1;
+            for (int jy = iy - 1; jy <= iy + 1; jy++) {
+                if (jy < 0 || jy >= side) {
+                    continue;
+                }
+                int other_end = fmm->cell_start[jy * side + jx_end + 1];
+                double near_x = 0;
+                double near_y = 0;
+                for (int other = fmm->cell_start[jy * side + jx_begin];
+                     other < other_end; other++) {
+                    double dx = x_i - sorted_x[other];
+                    double dy = y_i - sorted_y[other];
+                    double d = sqrt(dx * dx + dy * dy) + epsilon;
+                    double force_multiplier = sorted_mass[other] / (d * d * d);
+                    near_x -= force_multiplier * dx;
+                    near_y -= force_multiplier * dy;
+                }
+                accel_x += near_x;
+                accel_y += near_y;
+            }
+
+            job->changes->x_velocity[i] += job->factor * accel_x;
+            job->changes->y_velocity[i] += job->factor * accel_y;
+        }
+    }
+}
+
+// Counts the particles in every cell of the deepest tree the root box allows
+static void count_particles(struct FMM *fmm,
+                            const struct ParticleStore *particles) {
+    const int levels = fmm->max_levels;
+    const int side = 1 << levels;
+    const double width = fmm->size / side;
+    memset(fmm->cell_count, 0, sizeof(int) * level_offset(levels + 1));
+
+    int *leaf_count = &fmm->cell_count[level_offset(levels)];
+    for (int i = 0; i < fmm->n; i++) {
+        int ix = (int)((particles->x_pos[i] - fmm->x_min) / width);
+        int iy = (int)((particles->y_pos[i] - fmm->y_min) / width);
+        ix = ix < 0 ? 0 : (ix >= side ? side - 1 : ix);
+        iy = iy < 0 ? 0 : (iy >= side ? side - 1 : iy);
+        fmm->leaf_of[i] = iy * side + ix;
+        leaf_count[fmm->leaf_of[i]]++;
+    }
+    for (int level = levels - 1; level >= 0; level--) {
+        int level_side = 1 << level;
+        for (int child = 0; child < 4 * level_side * level_side; child++) {
+            int cx = child % (2 * level_side);
+            int cy = child / (2 * level_side);
+            fmm->cell_count[level_offset(level) + (cy / 2) * level_side +
+                            cx / 2] += cell_count(fmm, level + 1, child);
+        }
+    }
+}
+
+// Picks the depth with the lowest estimated cost. A deeper tree has fewer
+// direct pairs between neighbouring leaves but more M2L products, each of
+// which costs about terms^2 complex multiply-adds.
+static int choose_levels(const struct FMM *fmm, double epsilon) {
+    const double m2l_cost = 0.4 * fmm->terms * fmm->terms;
+    double best_cost = (double)fmm->n * fmm->n;
+    int best = 0;
+    double far_cost = 0;
+    for (int level = 2; level <= fmm->max_levels; level++) {
+        int side = 1 << level;
+        // Leaves narrower than FMM_MIN_LEAF_WIDTH softening lengths are
+        // avoided, so the epsilon / r series stays accurate
+        if (fmm->size / side < FMM_MIN_LEAF_WIDTH * epsilon) {
+            break;
+        }
+        double pairs = 0;
+        for (int cell = 0; cell < side * side; cell++) {
+            int count = cell_count(fmm, level, cell);
+            if (count == 0) {
+                continue;
+            }
+            int ix = cell % side;
+            int iy = cell / side;
+            int neighbours = 0;
+            for (int jy = iy - 1; jy <= iy + 1; jy++) {
+                for (int jx = ix - 1; jx <= ix + 1; jx++) {
+                    if (jx >= 0 && jy >= 0 && jx < side && jy < side) {
+                        neighbours += cell_count(fmm, level, jy * side + jx);
+                    }
+                }
+            }
+            pairs += (double)count * neighbours;
+            far_cost += 27 * m2l_cost;
+        }
+        double cost = pairs + far_cost + (double)fmm->n * fmm->terms;
+        if (cost < best_cost) {
+            best_cost = cost;
+            best = level;
+        }
+    }
+    return best;
+}
+
+// Sorts the particles into the leaves of the chosen tree
+static void bin_particles(struct FMM *fmm,
+                          const struct ParticleStore *particles) {
+    const int n = fmm->n;
+    const int side = 1 << fmm->levels;
+    const int max_side = 1 << fmm->max_levels;
+    const int shift = fmm->max_levels - fmm->levels;
+    int *cell_start = fmm->cell_start;
+
+    cell_start[0] = 0;
+    for (int c = 0; c < side * side; c++) {
+        cell_start[c + 1] = cell_start[c] + cell_count(fmm, fmm->levels, c);
+    }
+    for (int i = 0; i < n; i++) {
+        int leaf = ((fmm->leaf_of[i] / max_side) >> shift) * side +
+                   ((fmm->leaf_of[i] % max_side) >> shift);
+        int slot = cell_start[leaf]++;
+        fmm->sorted[slot] = i;
+        fmm->sorted_x[slot] = particles->x_pos[i];
+        fmm->sorted_y[slot] = particles->y_pos[i];
+        fmm->sorted_mass[slot] = particles->mass[i];
+    }
+    // The placement loop advanced every start to the next leaf; shift back
+    for (int c = side * side; c > 0; c--) {
+        cell_start[c] = cell_start[c - 1];
+    }
+    cell_start[0] = 0;
+}
+
+static int tiles_for(int count) {
+    int ntiles = 16 * pool_threads();
+    return count < ntiles ? count : ntiles;
+}
+
+void fmm_compute_forces(struct FMM *fmm, const struct ParticleStore *particles,
+                        double G, double epsilon, double scale,
+                        struct ParticleChange *changes) {
+    const int n = fmm->n;
+    const double *x = particles->x_pos;
+    const double *y = particles->y_pos;
+    double x_min = x[0], x_max = x[0];
+    double y_min = y[0], y_max = y[0];
+    for (int i = 1; i < n; i++) {
+        x_min = fmin(x_min, x[i]);
+        x_max = fmax(x_max, x[i]);
+        y_min = fmin(y_min, y[i]);
+        y_max = fmax(y_max, y[i]);
+    }
+    // Keep the root box while it holds all particles and is less than twice
+    // as large as needed, otherwise recentre it with a margin of 10%
+    double needed = fmax(fmax(x_max - x_min, y_max - y_min), 1e-300);
+    if (x_min < fmm->x_min || y_min < fmm->y_min ||
+        x_max >= fmm->x_min + fmm->size || y_max >= fmm->y_min + fmm->size ||
+        needed < fmm->size / 2 || epsilon != fmm->m2l_epsilon) {
+        fmm->size = needed * 1.1;
+        fmm->x_min = (x_min + x_max - fmm->size) / 2;
+        fmm->y_min = (y_min + y_max - fmm->size) / 2;
+        fmm->m2l_epsilon = epsilon;
+        for (int level = 0; level <= fmm->max_levels; level++) {
+            free(fmm->m2l[level]);
+            fmm->m2l[level] = NULL;
+        }
+    }
+
+    // Without two levels nothing is well separated, so the alternative to a
+    // deeper tree is a single leaf where everything is near field
+    count_particles(fmm, particles);
+    fmm->levels = choose_levels(fmm, epsilon);
+    const int levels = fmm->levels;
+    bin_particles(fmm, particles);
+
+    struct FMMJob job = {fmm, particles, changes, G * scale, epsilon, 0, 0};
+
+    if (levels >= 2) {
+        job.ntiles = tiles_for(1 << (2 * levels));
+        pool_run(job.ntiles, p2m_tile, &job);
+
+        for (int level = levels - 1; level >= 2; level--) {
+            job.level = level;
+            job.ntiles = tiles_for(1 << (2 * level));
+            pool_run(job.ntiles, m2m_tile, &job);
+        }
+
+        memset(fmm->locals, 0,
+               sizeof(double complex) * level_offset(levels + 1) * fmm->terms);
+        for (int level = 2; level <= levels; level++) {
+            build_m2l(fmm, level, epsilon);
+            job.level = level;
+            job.ntiles = tiles_for(1 << (2 * level));
+            pool_run(job.ntiles, m2l_tile, &job);
+            if (level < levels) {
+                job.ntiles = tiles_for(1 << (2 * (level + 1)));
+                pool_run(job.ntiles, l2l_tile, &job);
+            }
+        }
+    }
+
+    job.ntiles = tiles_for(1 << (2 * levels));
+    pool_run(job.ntiles, leaf_tile, &job);
+}
@@ -0,0 +1,62 @@
+#ifndef FMM_H
+#define FMM_H
+
+#include <complex.h>
+
+#include "galsim.h"
+
+// Fast multipole solver on a uniform quadtree.
+//
+// The pair kernel m * d / (r + epsilon)^3 is the gradient of a sum of
+// potentials m * w_s * r^-(s+1), s = 0, 1, ..., obtained by expanding the
+// softening in powers of epsilon / r. Each r^-2a = z^-a * conj(z)^-a is
+// separable in complex arithmetic, so multipole and local expansions are
+// bivariate polynomials in z and conj(z) truncated at total degree `order`.
+// Cells that are not well separated interact directly with the exact
+// softened kernel. The depth of the tree is chosen every step from the
+// particle distribution, trading near-field pairs against M2L work. The
+// root box is only moved when particles leave it or it becomes much too
+// large, so the cell sizes and the M2L operators can be reused.
+struct FMM {
+    int n;
+    int order;
+    int terms;
+    int max_levels;
+    int levels;
+    double x_min;
+    double y_min;
+    double size;
+    // Expansion coefficients of all cells, level by level
+    double complex *multipoles;
+    double complex *locals;
+    // Particles sorted by leaf cell; the particles of leaf c are
+    // sorted[cell_start[c], cell_start[c + 1])
+    int *sorted;
+    int *cell_start;
+    // Positions and masses gathered in that order, so that the near field of
+    // a row of three neighbouring leaves is one contiguous range
+    double *sorted_x;
+    double *sorted_y;
+    double *sorted_mass;
+    // Cell of every particle on the deepest level, and the number of
+    // particles in every cell of all levels
+    int *leaf_of;
+    int *cell_count;
+    // M2L operators for the 7 x 7 cell offsets of every level, built when a
+    // level is first used and kept as long as the root box does not change
+    double complex **m2l;
+    double m2l_epsilon;
+    // Coefficients of the M2L operators, one table per softening term
+    double *m2l_coefficients;
+    double *binomial;
+};
+
+void fmm_init(struct FMM *fmm, int n, int order);
+void fmm_free(struct FMM *fmm);
+
+// Adds scale * acceleration of every particle to changes
+void fmm_compute_forces(struct FMM *fmm, const struct ParticleStore *particles,
+                        double G, double epsilon, double scale,
+                        struct ParticleChange *changes);
+
+#endif
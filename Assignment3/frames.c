@@ -0,0 +1,144 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "frames.h"
+
+struct Band {
+    struct FrameWriter *writer;
+    int slot;
+    unsigned row_begin;
+    unsigned row_end;
+    pthread_t thread;
+};
+
+static void *draw_band(void *arg) {
+    struct Band *band = arg;
+    struct FrameWriter *writer = band->writer;
+    raster_band(&writer->frame, band->row_begin, band->row_end, writer->n,
+                writer->x_pos[band->slot], writer->y_pos[band->slot],
+                writer->mass, writer->brightness, writer->largest_particle,
+                writer->brightest);
+    return NULL;
+}
+
+static void render(struct FrameWriter *writer, int slot) {
+    // Every band clears and fills its own rows, so the bands share nothing
+    // but the read-only particle arrays
+    struct Band bands[writer->bands];
+    unsigned height = writer->frame.height;
+    for (int b = 0; b < writer->bands; b++) {
+        bands[b] = (struct Band){writer, slot, height * b / writer->bands,
+                                 height * (b + 1) / writer->bands, 0};
+    }
+    for (int b = 1; b < writer->bands; b++) {
+        if (pthread_create(&bands[b].thread, NULL, draw_band, &bands[b]) !=
+            0) {
+            fprintf(stderr, "Error creating render thread\n");
+            exit(1);
+        }
+    }
+    draw_band(&bands[0]);
+    for (int b = 1; b < writer->bands; b++) {
+        pthread_join(bands[b].thread, NULL);
+    }
+
+    int size = snprintf(NULL, 0, writer->pattern, writer->steps[slot]) + 1;
+    char *name = malloc(size);
+    snprintf(name, size, writer->pattern, writer->steps[slot]);
+    raster_write(&writer->frame, name);
+    free(name);
+}
+
+static void *render_main(void *arg) {
+    struct FrameWriter *writer = arg;
+    pthread_mutex_lock(&writer->lock);
+    for (;;) {
+        while (writer->queued == 0 && !writer->closing) {
+            pthread_cond_wait(&writer->filled, &writer->lock);
+        }
+        if (writer->queued == 0) {
+            break;
+        }
+        int slot = writer->head;
+        pthread_mutex_unlock(&writer->lock);
+
+        render(writer, slot);
+
+        pthread_mutex_lock(&writer->lock);
+        writer->head = (writer->head + 1) % FRAME_BUFFERS;
+        writer->queued--;
+        pthread_cond_signal(&writer->emptied);
+    }
+    pthread_mutex_unlock(&writer->lock);
+    return NULL;
+}
+
+void frames_open(struct FrameWriter *writer, const char *pattern,
+                 unsigned size, int bands,
+                 const struct ParticleStore *particles,
+                 double largest_particle, double brightest) {
+    int n = particles->n;
+    writer->pattern = pattern;
+    writer->n = n;
+    writer->bands = bands < 1 ? 1 : bands;
+    writer->largest_particle = largest_particle;
+    writer->brightest = brightest;
+    writer->mass = alloc_doubles(n);
+    writer->brightness = alloc_doubles(n);
+    memcpy(writer->mass, particles->mass, sizeof(double) * n);
+    memcpy(writer->brightness, particles->brightness, sizeof(double) * n);
+    for (int b = 0; b < FRAME_BUFFERS; b++) {
+        writer->x_pos[b] = alloc_doubles(n);
+        writer->y_pos[b] = alloc_doubles(n);
+    }
+    framebuffer_alloc(&writer->frame, size, size);
+    writer->head = 0;
+    writer->queued = 0;
+    writer->closing = false;
+    pthread_mutex_init(&writer->lock, NULL);
+    pthread_cond_init(&writer->filled, NULL);
+    pthread_cond_init(&writer->emptied, NULL);
+    if (pthread_create(&writer->thread, NULL, render_main, writer) != 0) {
+        fprintf(stderr, "Error creating render thread\n");
+        exit(1);
+    }
+}
+
+void frames_push(struct FrameWriter *writer,
+                 const struct ParticleStore *particles, int step) {
+    pthread_mutex_lock(&writer->lock);
+    while (writer->queued == FRAME_BUFFERS) {
+        pthread_cond_wait(&writer->emptied, &writer->lock);
+    }
+    int slot = (writer->head + writer->queued) % FRAME_BUFFERS;
+    pthread_mutex_unlock(&writer->lock);
+
+    memcpy(writer->x_pos[slot], particles->x_pos, sizeof(double) * writer->n);
+    memcpy(writer->y_pos[slot], particles->y_pos, sizeof(double) * writer->n);
+
+    pthread_mutex_lock(&writer->lock);
+    writer->steps[slot] = step;
+    writer->queued++;
+    pthread_cond_signal(&writer->filled);
+    pthread_mutex_unlock(&writer->lock);
+}
+
+void frames_close(struct FrameWriter *writer) {
+    pthread_mutex_lock(&writer->lock);
+    writer->closing = true;
+    pthread_cond_signal(&writer->filled);
+    pthread_mutex_unlock(&writer->lock);
+    pthread_join(writer->thread, NULL);
+
+    framebuffer_free(&writer->frame);
+    for (int b = 0; b < FRAME_BUFFERS; b++) {
+        free(writer->x_pos[b]);
+        free(writer->y_pos[b]);
+    }
+    free(writer->mass);
+    free(writer->brightness);
+    pthread_mutex_destroy(&writer->lock);
+    pthread_cond_destroy(&writer->filled);
+    pthread_cond_destroy(&writer->emptied);
+}
@@ -0,0 +1,54 @@
+#ifndef FRAMES_H
+#define FRAMES_H
+
+#include <pthread.h>
+#include <stdbool.h>
+
+#include "galsim.h"
+#include "raster.h"
+
+#define FRAME_BUFFERS 2
+
+// Headless renderer. The simulation copies the particle positions into one
+// of FRAME_BUFFERS buffers and continues, while a render thread draws the
+// queued positions into a framebuffer in horizontal bands, one thread per
+// band, and writes the image. Files are named by a pattern with one integer
+// conversion such as frame_%05d.png (see step_conversions()), numbered by
+// step.
+struct FrameWriter {
+    const char *pattern;
+    int n;
+    int bands;
+    double largest_particle;
+    double brightest;
+    // Masses and brightness do not change and are copied once
+    double *mass;
+    double *brightness;
+    double *x_pos[FRAME_BUFFERS];
+    double *y_pos[FRAME_BUFFERS];
+    int steps[FRAME_BUFFERS];
+    struct Framebuffer frame;
+    // Buffers head, ..., head + queued - 1 (mod FRAME_BUFFERS) wait for the
+    // render thread, the rest are free
+    int head;
+    int queued;
+    bool closing;
+    pthread_mutex_t lock;
+    pthread_cond_t filled;
+    pthread_cond_t emptied;
+    pthread_t thread;
+};
+
+void frames_open(struct FrameWriter *writer, const char *pattern,
+                 unsigned size, int bands,
+                 const struct ParticleStore *particles,
+                 double largest_particle, double brightest);
+
+// Queues the current positions as the frame after the given step
+void frames_push(struct FrameWriter *writer,
+                 const struct ParticleStore *particles, int step);
+
+// Renders the queued frames and stops the render thread
+void frames_close(struct FrameWriter *writer);
+
+#endif
@@ -0,0 +1,284 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "galfile.h"
+
+#define GAL_COLUMNS 6
+
+_Static_assert(sizeof(struct GalHeader) == 64, "v2 header must be 64 bytes");
+
+static bool verify_checksums = false;
+
+void gal_configure(bool verify) { verify_checksums = verify; }
+
+static uint64_t column_stride(int n) {
+    return ((sizeof(double) * (uint64_t)n + 63) / 64) * 64;
+}
+
+// FNV-style hash over 64-bit words in four independent lanes, so the load
+// check runs at memory speed. size must be a multiple of 32 bytes.
+static uint64_t checksum(const void *data, uint64_t size) {
+    const uint64_t prime = 0x100000001b3ULL;
+    uint64_t lane[4] = {0xcbf29ce484222325ULL, 0x84222325cbf29ce4ULL,
+                        0x9ce484222325cbf2ULL, 0x2325cbf29ce48422ULL};
+    const uint64_t *words = data;
+    for (uint64_t i = 0; i < size / 8; i += 4) {
+        for (int k = 0; k < 4; k++) {
+            lane[k] = (lane[k] ^ words[i + k]) * prime;
+        }
+    }
+    uint64_t hash = lane[0];
+    for (int k = 1; k < 4; k++) {
+        hash = (hash ^ lane[k]) * prime;
+    }
+    return hash;
+}
+
+// Formats why a file cannot be loaded into reason and returns false
+static bool fail(char *reason, size_t size, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    vsnprintf(reason, size, format, args);
+    va_end(args);
+    return false;
+}
+
+static bool read_legacy(const char *filename, int fd, off_t file_size, int n,
+                        struct ParticleStore *store, char *reason,
+                        size_t size) {
+    if (file_size != (off_t)sizeof(struct Particle) * n) {
+        return fail(reason, size, "%s holds %lld bytes, expected %d particles",
+                    filename, (long long)file_size, n);
+    }
+    struct Particle *records = malloc(sizeof(struct Particle) * n);
+    if (!records) {
+        return fail(reason, size, "Error allocating %d particles for %s", n,
+                    filename);
+    }
+    size_t bytes = sizeof(struct Particle) * n;
+    size_t done = 0;
+    while (done < bytes) {
+        ssize_t got = read(fd, (char *)records + done, bytes - done);
+        if (got <= 0) {
+            free(records);
+            return fail(reason, size, "Error reading %s", filename);
+        }
+        done += got;
+    }
+    store_alloc(store, n);
+    store_from_records(store, records);
+    free(records);
+    return true;
+}
+
+static bool read_v2(const char *filename, int fd, off_t file_size, int n,
+                    struct ParticleStore *store, char *reason, size_t size) {
+    struct GalHeader header;
+    if (file_size < (off_t)sizeof(header) ||
+        pread(fd, &header, sizeof(header), 0) != sizeof(header)) {
+        return fail(reason, size, "Error reading header of %s", filename);
+    }
+    if (header.version != GAL_VERSION ||
+        header.header_size != sizeof(header)) {
+        return fail(reason, size, "%s has unsupported layout version %u",
+                    filename, header.version);
+    }
+    if (header.n != (uint64_t)n) {
+        return fail(reason, size, "%s holds %llu particles, expected %d",
+                    filename, (unsigned long long)header.n, n);
+    }
+    uint64_t stride = column_stride(n);
+    uint64_t data_size = GAL_COLUMNS * stride;
+    if (header.column_stride != stride ||
+        (uint64_t)file_size != sizeof(header) + data_size) {
+        return fail(reason, size, "%s is truncated or has a bad column layout",
+                    filename);
+    }
+
+    // A private writable mapping: the simulator updates the arrays in place,
+    // pages are read on first touch and copied only when written
+    char *mapping = mmap(NULL, file_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                         fd, 0);
+    if (mapping == MAP_FAILED) {
+        return fail(reason, size, "Error mapping %s", filename);
+    }
+    char *columns = mapping + sizeof(header);
+    if (verify_checksums) {
+        madvise(mapping, file_size, MADV_SEQUENTIAL);
+        if (checksum(columns, data_size) != header.checksum) {
+            munmap(mapping, file_size);
+            return fail(reason, size, "%s fails its checksum", filename);
+        }
+        madvise(mapping, file_size, MADV_NORMAL);
+    }
+
+    store->n = n;
+    store->x_pos = (double *)(columns + 0 * stride);
+    store->y_pos = (double *)(columns + 1 * stride);
+    store->mass = (double *)(columns + 2 * stride);
+    store->x_velocity = (double *)(columns + 3 * stride);
+    store->y_velocity = (double *)(columns + 4 * stride);
+    store->brightness = (double *)(columns + 5 * stride);
+    store->mapping = mapping;
+    store->mapping_size = file_size;
+    return true;
+}
+
+bool gal_load(const char *filename, int n, struct ParticleStore *store,
+              char *reason, size_t size) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        return fail(reason, size, "Error opening %s", filename);
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0) {
+        close(fd);
+        return fail(reason, size, "Error reading %s", filename);
+    }
+
+    char magic[8] = {0};
+    bool loaded;
+    if (info.st_size >= (off_t)sizeof(magic) &&
+        pread(fd, magic, sizeof(magic), 0) == sizeof(magic) &&
+        memcmp(magic, GAL_MAGIC, sizeof(magic)) == 0) {
+        loaded = read_v2(filename, fd, info.st_size, n, store, reason, size);
+    } else {
+        loaded =
+            read_legacy(filename, fd, info.st_size, n, store, reason, size);
+    }
+    close(fd);
+    return loaded;
+}
+
+void gal_read(const char *filename, int n, struct ParticleStore *store) {
+    char reason[8192];
+    if (!gal_load(filename, n, store, reason, sizeof(reason))) {
+        fprintf(stderr, "%s\n", reason);
+        exit(1);
+    }
+}
+
+static bool write_legacy(FILE *file, const struct ParticleStore *store,
+                         char *reason, size_t size) {
+    struct Particle *records = malloc(sizeof(struct Particle) * store->n);
+    if (!records && store->n) {
+        return fail(reason, size, "Error allocating output buffer");
+    }
+    store_to_records(store, records);
+    bool written = fwrite(records, sizeof(struct Particle), store->n,
+                          file) == (size_t)store->n;
+    if (!written) {
+        fail(reason, size, "Error writing file: %s", strerror(errno));
+    }
+    free(records);
+    return written;
+}
+
+static bool write_v2(FILE *file, const struct ParticleStore *store, int steps,
+                     double delta_time, char *reason, size_t size) {
+    int n = store->n;
+    uint64_t stride = column_stride(n);
+    const double *columns[GAL_COLUMNS] = {
+        store->x_pos,      store->y_pos,      store->mass,
+        store->x_velocity, store->y_velocity, store->brightness};
+
+    // Columns are staged with their zero padding, which is part of the
+    // checksum
+    char *data = calloc(GAL_COLUMNS, stride);
+    if (!data && stride) {
+        return fail(reason, size, "Error allocating output buffer");
+    }
+    for (int c = 0; c < GAL_COLUMNS; c++) {
+        memcpy(data + c * stride, columns[c], sizeof(double) * n);
+    }
+
+    struct GalHeader header = {0};
+    memcpy(header.magic, GAL_MAGIC, sizeof(header.magic));
+    header.version = GAL_VERSION;
+    header.header_size = sizeof(header);
+    header.n = n;
+    header.steps = steps;
+    header.delta_time = delta_time;
+    header.column_stride = stride;
+    header.checksum = checksum(data, GAL_COLUMNS * stride);
+
+    bool written = fwrite(&header, sizeof(header), 1, file) == 1 &&
+                   fwrite(data, stride, GAL_COLUMNS, file) == GAL_COLUMNS;
+    if (!written) {
+        fail(reason, size, "Error writing file: %s", strerror(errno));
+    }
+    free(data);
+    return written;
+}
+
+static bool write_frame(FILE *file, enum GalFormat format,
+                        const struct ParticleStore *store, int steps,
+                        double delta_time, char *reason, size_t size) {
+    if (format == GAL_V2) {
+        return write_v2(file, store, steps, delta_time, reason, size);
+    }
+    return write_legacy(file, store, reason, size);
+}
+
+void gal_write_frame(FILE *file, enum GalFormat format,
+                     const struct ParticleStore *store, int steps,
+                     double delta_time) {
+    char reason[256];
+    if (!write_frame(file, format, store, steps, delta_time, reason,
+                     sizeof(reason))) {
+        fprintf(stderr, "%s\n", reason);
+        exit(1);
+    }
+}
+
+bool gal_save(const char *filename, enum GalFormat format,
+              const struct ParticleStore *store, int steps, double delta_time,
+              char *reason, size_t size) {
+    // The output may be the mapped input file, so it is written under a
+    // temporary name and renamed over the old file when complete
+    char *temporary = malloc(strlen(filename) + 5);
+    if (!temporary) {
+        return fail(reason, size, "Error allocating output buffer");
+    }
+    sprintf(temporary, "%s.tmp", filename);
+    FILE *file = fopen(temporary, "w");
+    if (!file) {
+        fail(reason, size, "Error opening %s: %s", temporary,
+             strerror(errno));
+        free(temporary);
+        return false;
+    }
+    bool saved =
+        write_frame(file, format, store, steps, delta_time, reason, size);
+    if (fclose(file) != 0 && saved) {
+        saved = fail(reason, size, "Error writing %s: %s", temporary,
+                     strerror(errno));
+    }
+    if (saved && rename(temporary, filename) != 0) {
+        saved = fail(reason, size, "Error renaming %s to %s: %s", temporary,
+                     filename, strerror(errno));
+    }
+    if (!saved) {
+        remove(temporary);
+    }
+    free(temporary);
+    return saved;
+}
+
+void gal_write(const char *filename, enum GalFormat format,
+               const struct ParticleStore *store, int steps,
+               double delta_time) {
+    char reason[8192];
+    if (!gal_save(filename, format, store, steps, delta_time, reason,
+                  sizeof(reason))) {
+        fprintf(stderr, "%s\n", reason);
+        exit(1);
+    }
+}
@@ -0,0 +1,65 @@
+#ifndef GALFILE_H
+#define GALFILE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "galsim.h"
+
+#define GAL_MAGIC "GALSIMv2"
+#define GAL_VERSION 2
+
+// A v2 .gal file is this 64-byte header followed by the six columns x_pos,
+// y_pos, mass, x_velocity, y_velocity and brightness. Every column starts on
+// a 64-byte boundary, column_stride bytes after the previous one, so that a
+// private mapping of the file can be used as the working arrays directly.
+// The checksum covers the column data including the padding. Checking it
+// reads the whole file, so it is only done when asked for.
+struct GalHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint64_t n;
+    uint64_t steps;
+    double delta_time;
+    uint64_t column_stride;
+    uint64_t checksum;
+    uint64_t reserved;
+};
+
+enum GalFormat { GAL_LEGACY, GAL_V2 };
+
+// Whether gal_read() checks the checksum of v2 files (default false)
+void gal_configure(bool verify);
+
+// Loads a .gal file of either format with n particles into store, or exits
+// if the file does not hold exactly n particles. A v2 file is mapped and the
+// store arrays point into the mapping, so unless it is verified, pages are
+// only read when touched.
+void gal_read(const char *filename, int n, struct ParticleStore *store);
+
+// Like gal_read(), but instead of exiting returns false with the reason in
+// reason, a buffer of size bytes
+bool gal_load(const char *filename, int n, struct ParticleStore *store,
+              char *reason, size_t size);
+
+// Writes store to filename. steps and delta_time are recorded in the v2
+// header and ignored by the legacy format.
+void gal_write(const char *filename, enum GalFormat format,
+               const struct ParticleStore *store, int steps,
+               double delta_time);
+
+// Like gal_write(), but instead of exiting returns false with the reason in
+// reason, a buffer of size bytes, and leaves no temporary file behind
+bool gal_save(const char *filename, enum GalFormat format,
+              const struct ParticleStore *store, int steps, double delta_time,
+              char *reason, size_t size);
+
+// Appends store to an open file in the given layout. A trajectory file is a
+// sequence of such frames.
+void gal_write_frame(FILE *file, enum GalFormat format,
+                     const struct ParticleStore *store, int steps,
+                     double delta_time);
+
+#endif
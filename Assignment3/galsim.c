@@ -1,13 +1,32 @@
 #include <X11/Xlib.h>
 #include <X11/keysym.h>
+#include <getopt.h>
 #include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
-#define NUMCOLORS 512
+#include "batch.h"
+#include "bh.h"
+#include "blockstep.h"
+#include "fmm.h"
+#include "frames.h"
+#include "galfile.h"
+#include "instrument.h"
+#include "integrator.h"
+#include "galsim.h"
+#include "kernels.h"
+#include "memory.h"
+#include "pool.h"
+#include "raster.h"
+#include "reorder.h"
+#include "triple_buffer.h"
+#include "server.h"
+#include "snapshot.h"
 
 Display *global_display_ptr;
 
@@ -23,78 +42,602 @@ float caxis[2];
 #define min(a, b) (a) < (b) ? (a) : (b)
 #define max(a, b) (a) > (b) ? (a) : (b)
 
-struct Particle {
-    double x_pos;
-    double y_pos;
-    double mass;
-    double x_velocity;
-    double y_velocity;
-    double brightness;
-};
-
-struct ParticleChange {
-    double x_velocity;
-    double y_velocity;
-};
+enum Solver { SOLVER_DIRECT, SOLVER_BARNES_HUT, SOLVER_FMM };
+enum Precision { PRECISION_DOUBLE, PRECISION_MIXED };
 
-struct Particle *particles;
-struct ParticleChange *temp_particles;
+struct ParticleStore particles;
+struct ParticleChange temp_particles;
 
 int n;
 char *filename;
 int nsteps;
 double delta_time;
 bool graphics;
+char *output_filename = "results.gal";
+enum GalFormat output_format = GAL_LEGACY;
+bool verify_input = false;
+int snapshot_every = 0;
+char *snapshot_path = "trajectory.gal";
+double snapshot_tolerance = 0;
+int compress_threads = 2;
+struct SnapshotWriter snapshots;
+char *step_times_path = NULL;
+bool profile = false;
+char *profile_json_path = NULL;
+bool profile_counters = false;
+int frames_every = 0;
+char *frames_pattern = "frame_%05d.ppm";
+int frame_size = 800;
+int render_threads = 2;
+struct FrameWriter frames;
+// The X11 window is drawn by its own thread from display_buffer
+struct TripleBuffer display_buffer;
+pthread_t display_thread;
+atomic_bool display_closing;
+const double frame_rate = 1.0 / 60.0;
+char *batch_manifest = NULL;
+int block_levels = 0;
+double block_eta = 0.2;
+struct BlockStepper stepper;
+enum IntegratorKind integrator_kind = INTEGRATOR_EULER;
+struct Integrator integrator;
+enum Curve reorder_curve = CURVE_NONE;
+int reorder_every = 0;
+struct Reorder reorder;
+// The particles in input order, for writing files after reordering
+struct ParticleStore unordered;
+enum KernelIsa kernel_isa = ISA_AUTO;
+enum PagePolicy page_policy = PAGES_HUGE;
+enum NumaPolicy numa_policy = NUMA_LOCAL;
+int diagnostics_every = 0;
+char *serve_path = NULL;
+char *shm_name = "/galsim";
+struct Server server;
+struct Conserved initial_totals;
+double largest_drift = 0;
+
+enum Solver solver = SOLVER_DIRECT;
+double theta = 0.5;
+struct BHTree tree;
+int fmm_order = 8;
+struct FMM fmm;
+
+int tile_size = DEFAULT_TILE;
+enum Precision precision = PRECISION_DOUBLE;
+bool check_precision = false;
+struct FloatStore float_particles;
+int nthreads = 1;
+// Private accumulation buffers of the workers, summed up after each step
+struct ParticleChange *worker_changes;
+struct ParticleChange *worker_jerks;
+// Potential energy of each worker's pairs, one cache line apart
+double *worker_potentials;
+int rows_per_block;
+int row_blocks;
 
 double largest_particle = 0;
 double brightest = 0;
 
 const double epsilon = 0.001;
 
-void read_arguments(char *argv[]) {
-    n = atoi(argv[1]);
-    filename = argv[2];
-    nsteps = atoi(argv[3]);
-    delta_time = atof(argv[4]);
-    graphics = atoi(argv[5]);
+void usage() {
+    printf("Usage: ./galsim N filename nsteps delta_time graphics [options]\n"
+           "       ./galsim --batch=MANIFEST [--threads=T] [--tile=B] "
+           "[--format=F]\n"
+           "Options:\n"
+           "  --solver=direct|bh|fmm    force solver (default direct)\n"
+           "  --theta=VALUE             Barnes-Hut opening angle "
+           "(default 0.5)\n"
+           "  --fmm-order=P             FMM expansion order (default 8)\n"
+           "  --threads=T               number of worker threads "
+           "(default 1)\n"
+           "  --tile=B                  block size of the direct pair loop "
+           "(default %d)\n"
+           "  --precision=double|mixed  float32 pair math with float64 "
+           "accumulation\n"
+           "                            (direct solver only)\n"
+           "  --check-precision         with mixed precision, rerun in double "
+           "precision and\n"
+           "                            report pos_maxdiff\n"
+           "  --output=FILE             result file (default results.gal)\n"
+           "  --format=legacy|v2        layout of the result file "
+           "(default legacy)\n"
+           "  --verify                  check the checksum of a v2 input "
+           "file\n"
+           "  --snapshot-every=K        save the particles every K steps\n"
+           "  --snapshot=PATH           trajectory file, or a pattern such as "
+           "snap_%%05d.gal\n"
+           "                            for numbered files "
+           "(default trajectory.gal);\n"
+           "                            a .galz file is compressed\n"
+           "  --snapshot-tolerance=T    distance allowed between a .galz "
+           "position or\n"
+           "                            velocity and the true one\n"
+           "                            (default 0, lossless)\n"
+           "  --compress-threads=C      threads compressing each .galz "
+           "frame (default 2)\n"
+           "  --step-times=FILE         write the wall time of every step, "
+           "one per line\n"
+           "  --profile                 print time per phase at exit\n"
+           "  --profile-json=FILE       write time per phase as JSON\n"
+           "  --counters                add hardware counters to the "
+           "profile\n"
+           "                            (profiling needs make "
+           "INSTRUMENT=1)\n"
+           "  --frames-every=K          render an image every K steps "
+           "without X11\n"
+           "  --frames=PATTERN          image names, .png or .ppm "
+           "(default frame_%%05d.ppm)\n"
+           "  --frame-size=PIXELS       image width and height "
+           "(default 800)\n"
+           "  --render-threads=R        threads drawing each image "
+           "(default 2)\n"
+           "  --batch=MANIFEST          run the jobs 'file N nsteps dt "
+           "[output]' of\n"
+           "                            MANIFEST with the direct solver; "
+           "of the other\n"
+           "                            options only --threads, --tile, "
+           "--format,\n"
+           "                            --verify, --isa, --pages and --numa "
+           "apply\n"
+           "  --block-levels=L          individual steps down to "
+           "delta_time / 2^L\n"
+           "                            (direct solver only); saves work "
+           "only with a\n"
+           "                            delta_time several times the global "
+           "step needed\n"
+           "  --block-eta=ETA           accuracy of the block steps "
+           "(default 0.2)\n"
+           "  --integrator=NAME         euler, leapfrog, yoshida or hermite "
+           "(default euler;\n"
+           "                            hermite needs the direct solver)\n"
+           "  --reorder=morton|hilbert  sort the particles along a "
+           "space-filling curve\n"
+           "                            at load; files keep the input "
+           "order\n"
+           "  --reorder-every=K         sort them again every K steps\n"
+           "  --isa=auto|sse2|avx2|avx512\n"
+           "                            force kernels to run (default the "
+           "widest the\n"
+           "                            CPU supports)\n"
+           "  --pages=huge|small        page size of the particle arrays "
+           "(default huge,\n"
+           "                            falling back to small)\n"
+           "  --numa=local|interleave   place the pages next to the threads "
+           "using them,\n"
+           "                            or spread them over all nodes\n"
+           "  --diagnostics-every=K     report energy and momentum every K "
+           "steps\n"
+           "                            (direct solver and euler "
+           "integrator)\n"
+           "  --serve=SOCKET            after nsteps, stay resident and take "
+           "commands on\n"
+           "                            the Unix socket SOCKET (see "
+           "server.h)\n"
+           "  --shm=NAME                shared memory object the daemon "
+           "publishes the\n"
+           "                            particles in (default /galsim)\n",
+           DEFAULT_TILE);
 }
 
-void read_file() {
-    particles = malloc(sizeof(struct Particle) * n);
-    temp_particles = malloc(sizeof(struct ParticleChange) * n);
-
-    FILE *file = fopen(filename, "r");
+void read_arguments(int argc, char *argv[]) {
+    static struct option options[] = {
+        {"solver", required_argument, NULL, 's'},
+        {"theta", required_argument, NULL, 't'},
+        {"fmm-order", required_argument, NULL, 'p'},
+        {"threads", required_argument, NULL, 'j'},
+        {"tile", required_argument, NULL, 'b'},
+        {"precision", required_argument, NULL, 'f'},
+        {"check-precision", no_argument, NULL, 'c'},
+        {"output", required_argument, NULL, 'o'},
+        {"format", required_argument, NULL, 'F'},
+        {"verify", no_argument, NULL, 'y'},
+        {"snapshot-every", required_argument, NULL, 'k'},
+        {"snapshot", required_argument, NULL, 'S'},
+        {"snapshot-tolerance", required_argument, NULL, 'q'},
+        {"compress-threads", required_argument, NULL, 'Z'},
+        {"step-times", required_argument, NULL, 'T'},
+        {"profile", no_argument, NULL, 'R'},
+        {"profile-json", required_argument, NULL, 'J'},
+        {"counters", no_argument, NULL, 'C'},
+        {"frames-every", required_argument, NULL, 'e'},
+        {"frames", required_argument, NULL, 'm'},
+        {"frame-size", required_argument, NULL, 'z'},
+        {"render-threads", required_argument, NULL, 'r'},
+        {"batch", required_argument, NULL, 'M'},
+        {"block-levels", required_argument, NULL, 'l'},
+        {"block-eta", required_argument, NULL, 'E'},
+        {"integrator", required_argument, NULL, 'I'},
+        {"reorder", required_argument, NULL, 'O'},
+        {"reorder-every", required_argument, NULL, 'K'},
+        {"isa", required_argument, NULL, 'i'},
+        {"pages", required_argument, NULL, 'g'},
+        {"numa", required_argument, NULL, 'N'},
+        {"diagnostics-every", required_argument, NULL, 'D'},
+        {"serve", required_argument, NULL, 'V'},
+        {"shm", required_argument, NULL, 'H'},
+        {NULL, 0, NULL, 0}};
+
+    // Batch mode runs the jobs with its own loop, which only these options
+    // (as their short codes) affect
+    const char *batch_options = "MjbFyigN";
+    const char *unsupported_in_batch = NULL;
+    int option;
+    int index;
+    while ((option = getopt_long(argc, argv, "", options, &index)) != -1) {
+        if (option != '?' && !strchr(batch_options, option)) {
+            unsupported_in_batch = options[index].name;
+        }
+        switch (option) {
+        case 's':
+            if (strcmp(optarg, "direct") == 0) {
+                solver = SOLVER_DIRECT;
+            } else if (strcmp(optarg, "bh") == 0) {
+                solver = SOLVER_BARNES_HUT;
+            } else if (strcmp(optarg, "fmm") == 0) {
+                solver = SOLVER_FMM;
+            } else {
+                fprintf(stderr, "Unknown solver '%s'\n", optarg);
+                exit(1);
+            }
+            break;
+        case 't':
+            theta = atof(optarg);
+            if (theta < 0) {
+                fprintf(stderr, "theta must be non-negative\n");
+                exit(1);
+            }
+            break;
+        case 'p':
+            fmm_order = atoi(optarg);
+            break;
+        case 'j':
+            nthreads = atoi(optarg);
+            if (nthreads < 1) {
+                fprintf(stderr, "threads must be at least 1\n");
+                exit(1);
+            }
+            break;
+        case 'b':
+            tile_size = atoi(optarg);
+            if (tile_size < 1) {
+                fprintf(stderr, "tile must be at least 1\n");
+                exit(1);
+            }
+            break;
+        case 'f':
+            if (strcmp(optarg, "double") == 0) {
+                precision = PRECISION_DOUBLE;
+            } else if (strcmp(optarg, "mixed") == 0) {
+                precision = PRECISION_MIXED;
+            } else {
+                fprintf(stderr, "Unknown precision '%s'\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'c':
+            check_precision = true;
+            break;
+        case 'o':
+            output_filename = optarg;
+            break;
+        case 'F':
+            if (strcmp(optarg, "legacy") == 0) {
+                output_format = GAL_LEGACY;
+            } else if (strcmp(optarg, "v2") == 0) {
+                output_format = GAL_V2;
+            } else {
+                fprintf(stderr, "Unknown format '%s'\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'y':
+            verify_input = true;
+            break;
+        case 'k':
+            snapshot_every = atoi(optarg);
+            if (snapshot_every < 1) {
+                fprintf(stderr, "snapshot-every must be at least 1\n");
+                exit(1);
+            }
+            break;
+        case 'S':
+            snapshot_path = optarg;
+            break;
+        case 'q':
+            snapshot_tolerance = atof(optarg);
+            if (!(snapshot_tolerance >= 0)) {
+                fprintf(stderr, "snapshot-tolerance must not be negative\n");
+                exit(1);
+            }
+            break;
+        case 'Z':
+            compress_threads = atoi(optarg);
+            if (compress_threads < 1) {
+                fprintf(stderr, "compress-threads must be at least 1\n");
+                exit(1);
+            }
+            break;
+        case 'T':
+            step_times_path = optarg;
+            break;
+        case 'R':
+            profile = true;
+            break;
+        case 'J':
+            profile = true;
+            profile_json_path = optarg;
+            break;
+        case 'C':
+            profile = true;
+            profile_counters = true;
+            break;
+        case 'e':
+            frames_every = atoi(optarg);
+            if (frames_every < 1) {
+                fprintf(stderr, "frames-every must be at least 1\n");
+                exit(1);
+            }
+            break;
+        case 'm':
+            frames_pattern = optarg;
+            break;
+        case 'z':
+            frame_size = atoi(optarg);
+            if (frame_size < 1) {
+                fprintf(stderr, "frame-size must be at least 1\n");
+                exit(1);
+            }
+            break;
+        case 'r':
+            render_threads = atoi(optarg);
+            if (render_threads < 1) {
+                fprintf(stderr, "render-threads must be at least 1\n");
+                exit(1);
+            }
+            break;
+        case 'M':
+            batch_manifest = optarg;
+            break;
+        case 'l':
+            block_levels = atoi(optarg);
+            if (block_levels < 0 || block_levels > 30) {
+                fprintf(stderr, "block-levels must be within 0..30\n");
+                exit(1);
+            }
+            break;
+        case 'E':
+            block_eta = atof(optarg);
+            if (block_eta <= 0) {
+                fprintf(stderr, "block-eta must be positive\n");
+                exit(1);
+            }
+            break;
+        case 'I':
+            if (strcmp(optarg, "euler") == 0) {
+                integrator_kind = INTEGRATOR_EULER;
+            } else if (strcmp(optarg, "leapfrog") == 0) {
+                integrator_kind = INTEGRATOR_LEAPFROG;
+            } else if (strcmp(optarg, "yoshida") == 0) {
+                integrator_kind = INTEGRATOR_YOSHIDA;
+            } else if (strcmp(optarg, "hermite") == 0) {
+                integrator_kind = INTEGRATOR_HERMITE;
+            } else {
+                fprintf(stderr, "Unknown integrator '%s'\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'O':
+            if (strcmp(optarg, "morton") == 0) {
+                reorder_curve = CURVE_MORTON;
+            } else if (strcmp(optarg, "hilbert") == 0) {
+                reorder_curve = CURVE_HILBERT;
+            } else {
+                fprintf(stderr, "Unknown curve '%s'\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'K':
+            reorder_every = atoi(optarg);
+            if (reorder_every < 1) {
+                fprintf(stderr, "reorder-every must be positive\n");
+                exit(1);
+            }
+            break;
+        case 'i':
+            if (strcmp(optarg, "auto") == 0) {
+                kernel_isa = ISA_AUTO;
+            } else if (strcmp(optarg, "sse2") == 0) {
+                kernel_isa = ISA_SSE2;
+            } else if (strcmp(optarg, "avx2") == 0) {
+                kernel_isa = ISA_AVX2;
+            } else if (strcmp(optarg, "avx512") == 0) {
+                kernel_isa = ISA_AVX512;
+            } else {
+                fprintf(stderr, "Unknown instruction set '%s'\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'g':
+            if (strcmp(optarg, "huge") == 0) {
+                page_policy = PAGES_HUGE;
+            } else if (strcmp(optarg, "small") == 0) {
+                page_policy = PAGES_SMALL;
+            } else {
+                fprintf(stderr, "Unknown page size '%s'\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'N':
+            if (strcmp(optarg, "local") == 0) {
+                numa_policy = NUMA_LOCAL;
+            } else if (strcmp(optarg, "interleave") == 0) {
+                numa_policy = NUMA_INTERLEAVE;
+            } else {
+                fprintf(stderr, "Unknown NUMA policy '%s'\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'D':
+            diagnostics_every = atoi(optarg);
+            if (diagnostics_every < 1) {
+                fprintf(stderr, "diagnostics-every must be positive\n");
+                exit(1);
+            }
+            break;
+        case 'V':
+            serve_path = optarg;
+            break;
+        case 'H':
+            shm_name = optarg;
+            break;
+        default:
+            usage();
+            exit(1);
+        }
+    }
 
-    if (!file) {
-        fprintf(stderr, "Error opening file\n");
+    if (batch_manifest) {
+        if (argc != optind) {
+            fprintf(stderr, "Batch mode takes no positional arguments\n");
+            exit(1);
+        }
+        if (unsupported_in_batch) {
+            fprintf(stderr, "--%s is not supported with --batch\n",
+                    unsupported_in_batch);
+            exit(1);
+        }
+        return;
+    }
+    if (argc - optind != 5) {
+        usage();
+        exit(1);
+    }
+#ifndef GALSIM_INSTRUMENT
+    if (profile) {
+        fprintf(stderr, "Profiling needs a build with make INSTRUMENT=1\n");
         exit(1);
     }
+#endif
+    if (precision == PRECISION_MIXED && solver != SOLVER_DIRECT) {
+        fprintf(stderr, "Mixed precision needs the direct solver\n");
+        exit(1);
+    }
+    if (block_levels > 0 &&
+        (solver != SOLVER_DIRECT || precision != PRECISION_DOUBLE)) {
+        fprintf(stderr, "Block steps need the direct solver in double "
+                        "precision\n");
+        exit(1);
+    }
+    if (block_levels > 0 && integrator_kind != INTEGRATOR_EULER) {
+        fprintf(stderr, "Block steps come with their own leapfrog "
+                        "integrator\n");
+        exit(1);
+    }
+    if (integrator_kind == INTEGRATOR_HERMITE &&
+        (solver != SOLVER_DIRECT || precision != PRECISION_DOUBLE)) {
+        fprintf(stderr, "Hermite needs the direct solver in double "
+                        "precision\n");
+        exit(1);
+    }
+    // The potential comes out of the direct pair loop, the kinetic energy out
+    // of the Euler update
+    if (diagnostics_every &&
+        (solver != SOLVER_DIRECT || precision != PRECISION_DOUBLE ||
+         block_levels > 0 || integrator_kind != INTEGRATOR_EULER)) {
+        fprintf(stderr, "Diagnostics need the direct solver in double "
+                        "precision with the euler integrator\n");
+        exit(1);
+    }
+    // In double precision the rerun would repeat the run itself
+    if (check_precision && precision != PRECISION_MIXED) {
+        fprintf(stderr, "check-precision needs --precision=mixed\n");
+        exit(1);
+    }
+    // The rerun covers nsteps, not the steps clients ask the daemon for
+    if (check_precision && serve_path) {
+        fprintf(stderr, "check-precision cannot be combined with serve\n");
+        exit(1);
+    }
+    // A numbered snapshot path is a printf pattern with the step as its
+    // argument; any other path is used as it is
+    int snapshot_conversions = step_conversions(snapshot_path);
+    if (snapshot_conversions < 0 || snapshot_conversions > 1) {
+        fprintf(stderr, "snapshot path may have at most one integer "
+                        "conversion such as %%05d, and %%%% for a %%\n");
+        exit(1);
+    }
+    if (snapshot_conversions == 0 && strchr(snapshot_path, '%')) {
+        fprintf(stderr, "snapshot path may only contain %% in a pattern "
+                        "numbered by %%d\n");
+        exit(1);
+    }
+    if (step_conversions(frames_pattern) != 1) {
+        fprintf(stderr, "frames needs one integer conversion such as %%05d, "
+                        "and %%%% for a %%\n");
+        exit(1);
+    }
+    if (reorder_every && reorder_curve == CURVE_NONE) {
+        fprintf(stderr, "reorder-every needs --reorder\n");
+        exit(1);
+    }
+    n = atoi(argv[optind]);
+    filename = argv[optind + 1];
+    nsteps = atoi(argv[optind + 2]);
+    delta_time = atof(argv[optind + 3]);
+    graphics = atoi(argv[optind + 4]);
+    // The display thread reads the masses while drawing older snapshots
+    if (graphics && reorder_every) {
+        fprintf(stderr, "reorder-every cannot be combined with graphics\n");
+        exit(1);
+    }
+}
+
+void read_file() {
+    gal_read(filename, n, &particles);
+    changes_alloc(&temp_particles, n);
 
     for (int i = 0; i < n; i++) {
-        size_t bytes_read =
-            fread(&particles[i], sizeof(struct Particle), 1, file);
-        if (!bytes_read) {
-            fprintf(stderr, "Error reading file\n");
-            exit(1);
-        }
-        if (particles[i].mass > largest_particle) {
-            largest_particle = particles[i].mass;
+        if (particles.mass[i] > largest_particle) {
+            largest_particle = particles.mass[i];
         }
-        if (particles[i].brightness > brightest) {
-            brightest = particles[i].brightness;
+        if (particles.brightness[i] > brightest) {
+            brightest = particles.brightness[i];
         }
     }
-    fclose(file);
+}
+
+// The particles in input order
+const struct ParticleStore *output_particles() {
+    if (reorder_curve == CURVE_NONE) {
+        return &particles;
+    }
+    reorder_restore(&reorder, &particles, &unordered);
+    return &unordered;
 }
 
 void write_file() {
-    FILE *file = fopen("results.gal", "w");
-    if (!file) {
-        fprintf(stderr, "Error opening file\n");
-        exit(1);
+    gal_write(output_filename, output_format, output_particles(), nsteps,
+              delta_time);
+}
+
+// Sorts the particles again and moves the per-particle state of the
+// integrators along, so that no forces have to be recomputed
+void reorder_all() {
+    reorder_particles(&reorder, &particles);
+    if (integrator_kind != INTEGRATOR_EULER && integrator.started) {
+        reorder_permute(&reorder, integrator.accel.x_velocity);
+        reorder_permute(&reorder, integrator.accel.y_velocity);
+        if (integrator_kind == INTEGRATOR_HERMITE) {
+            reorder_permute(&reorder, integrator.jerk.x_velocity);
+            reorder_permute(&reorder, integrator.jerk.y_velocity);
+        }
+    }
+    if (block_levels > 0 && stepper.started) {
+        reorder_permute(&reorder, stepper.x_accel);
+        reorder_permute(&reorder, stepper.y_accel);
+        reorder_permute(&reorder, stepper.flyby);
     }
-    fwrite(particles, sizeof(struct Particle), n, file);
-    fclose(file);
 }
 
 Window create_simple_window(Display *display, int width, int height, int x,
@@ -168,7 +711,7 @@ void InitializeGraphics(char *command, int windowWidth, int windowHeight) {
 
     XColor color;
     for (int i = 0; i < NUMCOLORS; i++) {
-        color.red = ((double)(NUMCOLORS - i) / (double)NUMCOLORS) * 0xFFFF;
+        color.red = color_level(i) * 0xFFFF;
         color.blue = color.red;
         color.green = color.red;
         XAllocColor(global_display_ptr, screen_colormap, &color);
@@ -188,21 +731,12 @@ void ClearScreen(void) {
 }
 
 void DrawCircle(float x, float y, float W, float H, float radius, float color) {
-    int i = (int)((x - radius) / W * width);
-    int j = height - (int)((y + radius) / H * height);
-    int arcrad = 2 * (int)(radius / W * width);
-    int icolor;
-
-    if (color >= caxis[1])
-        icolor = NUMCOLORS - 1;
-    else if (color < caxis[0])
-        icolor = 0;
-    else
-        icolor = (int)((color - caxis[0]) / (caxis[1] - caxis[0]) *
-                       (float)NUMCOLORS);
+    struct Splat splat =
+        splat_circle(x, y, W, H, radius, color, width, height, caxis);
 
-    XSetForeground(global_display_ptr, gc, colors[icolor]);
-    XFillArc(global_display_ptr, pixmap, gc, i, j, arcrad, arcrad, 0, 64 * 360);
+    XSetForeground(global_display_ptr, gc, colors[splat.color]);
+    XFillArc(global_display_ptr, pixmap, gc, splat.left, splat.top,
+             splat.diameter, splat.diameter, 0, 64 * 360);
 }
 
 void FlushDisplay() { XFlush(global_display_ptr); }
@@ -212,115 +746,596 @@ void CloseDisplay() {
     XCloseDisplay(global_display_ptr);
 }
 
-const double frame_rate = 1.0 / 60.0;
-struct timespec last_frame;
-
-void draw_galaxy() {
-    double time_spent;
-    // If the last frame was less than framerate seconds ago, wait to draw it
-    do {
-        struct timespec current_time;
-        clock_gettime(CLOCK_MONOTONIC, &current_time);
-        time_spent = (current_time.tv_sec - last_frame.tv_sec) +
-                     (current_time.tv_nsec - last_frame.tv_nsec) / 1000000000.0;
-    } while (time_spent < frame_rate);
-
+// Draws a snapshot of the positions; only the display thread calls this
+void draw_galaxy(const double *x_pos, const double *y_pos) {
     ClearScreen();
     for (int i = 0; i < n; i++) {
-        double x = particles[i].x_pos;
-        double y = particles[i].y_pos;
-        double r = max(0.002, 0.1 / n * particles[i].mass / largest_particle);
-        double color = 1.0 - particles[i].brightness / brightest;
+        double x = x_pos[i];
+        double y = y_pos[i];
+        double r = particle_radius(n, particles.mass[i], largest_particle);
+        double color = particle_color(particles.brightness[i], brightest);
         DrawCircle(x * 1, y * 1, 1, 1, r, color);
     }
     Refresh();
-    clock_gettime(CLOCK_MONOTONIC, &last_frame);
 }
 
-void step() {
-    // Reset the temp_particles
-    memset(temp_particles, 0, sizeof(struct ParticleChange) * n);
+// Force computation into accel, and jerk if not NULL, with the
+// accelerations scaled by scale
+struct ForceJob {
+    double G;
+    double scale;
+    struct ParticleChange *accel;
+    struct ParticleChange *jerk;
+    // Adds the potential energy here if not NULL
+    double *potential;
+    int ntiles;
+};
 
-    const double G = 100.0 / n;
+void direct_tile(void *arg, int worker, int tile) {
+    struct ForceJob *job = arg;
+    // Rows at the top of the triangle cost more than those at the bottom, so
+    // neighbouring tiles pair an expensive row block with a cheap one
+    int block = tile % 2 == 0 ? tile / 2 : row_blocks - 1 - tile / 2;
+    int row_begin = block * rows_per_block;
+    int row_end = row_begin + rows_per_block < n ? row_begin + rows_per_block
+                                                  : n;
+    if (job->jerk) {
+        direct_rows_jerk(&particles, row_begin, row_end, tile_size, job->G,
+                         epsilon, &worker_changes[worker],
+                         &worker_jerks[worker]);
+    } else if (precision == PRECISION_MIXED) {
+        direct_rows_mixed(&float_particles, row_begin, row_end, tile_size,
+                          job->G, epsilon, job->scale,
+                          &worker_changes[worker]);
+    } else if (job->potential) {
+        direct_rows_energy(&particles, row_begin, row_end, tile_size, job->G,
+                           epsilon, job->scale, &worker_changes[worker],
+                           &worker_potentials[8 * worker]);
+    } else {
+        direct_rows(&particles, row_begin, row_end, tile_size, job->G,
+                    epsilon, job->scale, &worker_changes[worker]);
+    }
+}
 
-    for (int i = 0; i < n; i++) {
-        double mass_i = particles[i].mass;
+void reduce_buffers(struct ParticleChange *buffers, struct ParticleChange *out,
+                    int begin, int end) {
+    for (int i = begin; i < end; i++) {
+        double x_velocity = 0;
+        double y_velocity = 0;
+        for (int w = 0; w < nthreads; w++) {
+            x_velocity += buffers[w].x_velocity[i];
+            y_velocity += buffers[w].y_velocity[i];
+            // Leave the buffers cleared for the next step
+            buffers[w].x_velocity[i] = 0;
+            buffers[w].y_velocity[i] = 0;
+        }
+        out->x_velocity[i] = x_velocity;
+        out->y_velocity[i] = y_velocity;
+    }
+}
 
-        // Using Newtons third law, we can save about 50% of all iterations
-        for (int j = i + 1; j < n; j++) {
-            double mass_j = particles[j].mass;
+void reduce_tile(void *arg, int worker, int tile) {
+    (void)worker;
+    struct ForceJob *job = arg;
+    int begin = (long)n * tile / job->ntiles;
+    int end = (long)n * (tile + 1) / job->ntiles;
+    reduce_buffers(worker_changes, job->accel, begin, end);
+    if (job->jerk) {
+        reduce_buffers(worker_jerks, job->jerk, begin, end);
+    }
+}
+
+void compute_direct_threaded(struct ForceJob *job) {
+    pool_run(row_blocks, direct_tile, job);
+    if (job->potential) {
+        for (int w = 0; w < nthreads; w++) {
+            *job->potential += worker_potentials[8 * w];
+            worker_potentials[8 * w] = 0;
+        }
+    }
+    job->ntiles = 4 * nthreads;
+    pool_run(job->ntiles, reduce_tile, job);
+}
+
+void bh_tile(void *arg, int worker, int tile) {
+    (void)worker;
+    struct ForceJob *job = arg;
+    int ntiles = 16 * nthreads;
+    // Each particle is written by exactly one tile, so all workers can
+    // accumulate straight into the output
+    bh_compute_forces(&tree, &particles, job->G, epsilon, job->scale,
+                      (long)n * tile / ntiles, (long)n * (tile + 1) / ntiles,
+                      job->accel);
+}
+
+void init_threads() {
+    pool_init(nthreads);
+    worker_changes = malloc(sizeof(struct ParticleChange) * nthreads);
+    for (int w = 0; w < nthreads; w++) {
+        changes_alloc(&worker_changes[w], n);
+    }
+    if (integrator_kind == INTEGRATOR_HERMITE) {
+        worker_jerks = malloc(sizeof(struct ParticleChange) * nthreads);
+        for (int w = 0; w < nthreads; w++) {
+            changes_alloc(&worker_jerks[w], n);
+        }
+    }
+    worker_potentials = calloc(8 * nthreads, sizeof(double));
+    // Enough row blocks for the workers to balance the triangle by stealing,
+    // but no larger than a cache tile of the pair loop
+    rows_per_block = n / (32 * nthreads);
+    if (rows_per_block > tile_size) {
+        rows_per_block = tile_size;
+    }
+    if (rows_per_block < 16) {
+        rows_per_block = 16;
+    }
+    row_blocks = (n + rows_per_block - 1) / rows_per_block;
+}
 
-            double dx = particles[i].x_pos - particles[j].x_pos;
-            double dy = particles[i].y_pos - particles[j].y_pos;
+void free_threads() {
+    pool_destroy();
+    for (int w = 0; w < nthreads; w++) {
+        changes_free(&worker_changes[w]);
+    }
+    free(worker_changes);
+    if (integrator_kind == INTEGRATOR_HERMITE) {
+        for (int w = 0; w < nthreads; w++) {
+            changes_free(&worker_jerks[w]);
+        }
+        free(worker_jerks);
+    }
+    free(worker_potentials);
+}
 
-            double distance = sqrt(dx * dx + dy * dy);
+// Sets accel to scale times the acceleration of every particle from the
+// selected solver, and jerk to the jerk if it is not NULL. If potential is
+// not NULL, the direct solver adds the potential energy to it.
+void compute_forces(double scale, struct ParticleChange *accel,
+                    struct ParticleChange *jerk, double *potential) {
+    PHASE_BEGIN(PHASE_CLEAR);
+    memset(accel->x_velocity, 0, sizeof(double) * n);
+    memset(accel->y_velocity, 0, sizeof(double) * n);
+    if (jerk) {
+        memset(jerk->x_velocity, 0, sizeof(double) * n);
+        memset(jerk->y_velocity, 0, sizeof(double) * n);
+    }
+    PHASE_END(PHASE_CLEAR);
 
-            double force_multiplier = G / pow(distance + epsilon, 3);
+    struct ForceJob job = {100.0 / n, scale, accel, jerk, potential, 0};
 
-            double force_x = force_multiplier * dx;
-            double force_y = force_multiplier * dy;
+    PHASE_BEGIN(PHASE_FORCES);
+    switch (solver) {
+    case SOLVER_DIRECT:
+        if (precision == PRECISION_MIXED) {
+            float_store_update(&float_particles, &particles);
+        }
+        if (nthreads > 1) {
+            compute_direct_threaded(&job);
+        } else if (jerk) {
+            direct_rows_jerk(&particles, 0, n, tile_size, job.G, epsilon,
+                             accel, jerk);
+        } else if (precision == PRECISION_MIXED) {
+            direct_rows_mixed(&float_particles, 0, n, tile_size, job.G,
+                              epsilon, scale, accel);
+        } else if (potential) {
+            direct_rows_energy(&particles, 0, n, tile_size, job.G, epsilon,
+                               scale, accel, potential);
+        } else {
+            direct_rows(&particles, 0, n, tile_size, job.G, epsilon, scale,
+                        accel);
+        }
+        break;
+    case SOLVER_BARNES_HUT:
+        bh_build(&tree, &particles);
+        if (nthreads > 1) {
+            pool_run(16 * nthreads, bh_tile, &job);
+        } else {
+            bh_compute_forces(&tree, &particles, job.G, epsilon, scale, 0, n,
+                              accel);
+        }
+        break;
+    case SOLVER_FMM:
+        fmm_compute_forces(&fmm, &particles, job.G, epsilon, scale, accel);
+        break;
+    }
+    PHASE_END(PHASE_FORCES);
+}
 
-            double accel_i_x = -force_x * mass_j;
-            double accel_i_y = -force_y * mass_j;
+void integrator_forces(void *arg, struct ParticleChange *accel,
+                       struct ParticleChange *jerk) {
+    (void)arg;
+    compute_forces(1.0, accel, jerk, NULL);
+}
 
-            double accel_j_x = force_x * mass_i;
-            double accel_j_y = force_y * mass_i;
+// Advances the particles by one step. If totals is not NULL, it receives
+// the energy and momentum at the start of the step, measured in the same
+// passes.
+void step(struct Conserved *totals) {
+    if (block_levels > 0) {
+        PHASE_BEGIN(PHASE_FORCES);
+        block_step(&stepper, &particles, 100.0 / n, epsilon, delta_time);
+        PHASE_END(PHASE_FORCES);
+    } else if (integrator_kind != INTEGRATOR_EULER) {
+        integrator_step(&integrator, &particles, delta_time,
+                        integrator_forces, NULL);
+    } else {
+        // The velocity changes of the step, then update all velocities and
+        // positions in one go
+        if (totals) {
+            *totals = (struct Conserved){0};
+            compute_forces(delta_time, &temp_particles, NULL,
+                           &totals->potential);
+            PHASE_BEGIN(PHASE_INTEGRATE);
+            integrate_energy(&particles, &temp_particles, delta_time, totals);
+            PHASE_END(PHASE_INTEGRATE);
+        } else {
+            compute_forces(delta_time, &temp_particles, NULL, NULL);
+            PHASE_BEGIN(PHASE_INTEGRATE);
+            integrate(&particles, &temp_particles, delta_time);
+            PHASE_END(PHASE_INTEGRATE);
+        }
+    }
 
-            temp_particles[i].x_velocity += delta_time * accel_i_x;
-            temp_particles[i].y_velocity += delta_time * accel_i_y;
+    if (graphics) {
+        PHASE_BEGIN(PHASE_DRAW);
+        triple_buffer_push(&display_buffer, particles.x_pos,
+                           particles.y_pos);
+        PHASE_END(PHASE_DRAW);
+    }
+}
 
-            temp_particles[j].x_velocity += delta_time * accel_j_x;
-            temp_particles[j].y_velocity += delta_time * accel_j_y;
+// Steps for the daemon's clients; diagnostics, snapshots and frames only
+// cover the first nsteps
+void serve_steps(void *arg, int steps) {
+    (void)arg;
+    for (int i = 0; i < steps; i++) {
+        step(NULL);
+        if (reorder_every && (server.step + i + 1) % reorder_every == 0) {
+            reorder_all();
         }
     }
+}
+
+const struct ParticleStore *serve_state(void *arg) {
+    (void)arg;
+    return output_particles();
+}
 
-    // Update all velocities and positions in one go
+// Prints the totals at the start of step, and the energy drift since step 0
+void report_diagnostics(int step, const struct Conserved *totals) {
+    double energy = totals->kinetic + totals->potential;
+    if (step == 0) {
+        initial_totals = *totals;
+    }
+    double initial_energy = initial_totals.kinetic + initial_totals.potential;
+    double drift = (energy - initial_energy) / fabs(initial_energy);
+    if (fabs(drift) > largest_drift) {
+        largest_drift = fabs(drift);
+    }
+    printf("step %d: energy %.12e kinetic %.12e potential %.12e "
+           "momentum %.6e %.6e drift %.3e\n",
+           step, energy, totals->kinetic, totals->potential,
+           totals->x_momentum, totals->y_momentum, drift);
+}
+
+// Runs the simulation once more in double precision from the initial state
+// and prints the largest position difference, measured like
+// compare_gal_files does. The particles are left at the mixed result.
+void report_precision_error(const struct ParticleStore *initial) {
+    // Compare in input order, as the rerun does not reorder
+    struct ParticleStore result;
+    store_alloc(&result, n);
+    store_copy(&result, output_particles());
+    if (reorder_curve != CURVE_NONE) {
+        reorder_reset(&reorder);
+    }
+
+    store_copy(&particles, initial);
+    enum Precision used_precision = precision;
+    bool used_graphics = graphics;
+    precision = PRECISION_DOUBLE;
+    graphics = false;
+    integrator_reset(&integrator);
+    long long pair_evaluations = stepper.pair_evaluations;
+    if (block_levels > 0) {
+        block_reset(&stepper);
+    }
+    for (int i = 0; i < nsteps; i++) {
+        step(NULL);
+    }
+    stepper.pair_evaluations = pair_evaluations;
+
+    double pos_maxdiff = 0;
     for (int i = 0; i < n; i++) {
-        particles[i].x_velocity += temp_particles[i].x_velocity;
-        particles[i].y_velocity += temp_particles[i].y_velocity;
+        double dx = result.x_pos[i] - particles.x_pos[i];
+        double dy = result.y_pos[i] - particles.y_pos[i];
+        double diff = sqrt(dx * dx + dy * dy);
+        if (diff > pos_maxdiff) {
+            pos_maxdiff = diff;
+        }
+    }
+    printf("pos_maxdiff vs double precision = %16.12f\n", pos_maxdiff);
+
+    store_copy(&particles, &result);
+    precision = used_precision;
+    graphics = used_graphics;
+    store_free(&result);
+}
+
+double wall_time() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec / 1000000000.0;
+}
+
+void write_step_times(const double *step_times) {
+    FILE *file = fopen(step_times_path, "w");
+    if (!file) {
+        fprintf(stderr, "Error opening %s\n", step_times_path);
+        exit(1);
+    }
+    for (int i = 0; i < nsteps; i++) {
+        fprintf(file, "%.9e\n", step_times[i]);
+    }
+    fclose(file);
+}
+
+void sleep_seconds(double seconds) {
+    struct timespec time;
+    time.tv_sec = (time_t)seconds;
+    time.tv_nsec = (long)((seconds - time.tv_sec) * 1000000000.0);
+    nanosleep(&time, NULL);
+}
 
-        particles[i].x_pos += particles[i].x_velocity * delta_time;
-        particles[i].y_pos += particles[i].y_velocity * delta_time;
+// Shows the newest snapshot at most frame_rate times per second and sleeps
+// in between, so the display neither spins nor holds up the simulation
+void *display_main(void *arg) {
+    (void)arg;
+    double next_frame = wall_time();
+    for (;;) {
+        bool closing = atomic_load(&display_closing);
+        int slot = triple_buffer_acquire_newest(&display_buffer);
+        if (slot >= 0) {
+            draw_galaxy(display_buffer.x_pos[slot],
+                        display_buffer.y_pos[slot]);
+        } else if (closing) {
+            break;
+        }
+        next_frame += frame_rate;
+        double now = wall_time();
+        if (next_frame > now) {
+            sleep_seconds(next_frame - now);
+        } else {
+            next_frame = now;
+        }
     }
+    return NULL;
+}
 
-    if (graphics) {
-        draw_galaxy();
+void start_display(char *command) {
+    InitializeGraphics(command, 800, 800);
+    triple_buffer_alloc(&display_buffer, n);
+    atomic_init(&display_closing, false);
+    triple_buffer_push(&display_buffer, particles.x_pos, particles.y_pos);
+    if (pthread_create(&display_thread, NULL, display_main, NULL) != 0) {
+        fprintf(stderr, "Error creating display thread\n");
+        exit(1);
     }
 }
 
+// Hands the final state to the display thread, which shows it and exits
+void stop_display() {
+    triple_buffer_push(&display_buffer, particles.x_pos, particles.y_pos);
+    atomic_store(&display_closing, true);
+    pthread_join(display_thread, NULL);
+    printf("display: %d snapshots replaced before they were shown\n",
+           display_buffer.dropped);
+    triple_buffer_free(&display_buffer);
+    FlushDisplay();
+    CloseDisplay();
+}
+
 int main(int argc, char **argv) {
-    if (argc != 6) {
-        printf("Usage: ./galsim N filename nsteps delta_time graphics");
-        return 1;
+    read_arguments(argc, argv);
+    // Before any worker thread can reach a kernel
+    kernels_select(kernel_isa);
+    memory_configure(page_policy, numa_policy);
+    gal_configure(verify_input);
+    if (batch_manifest) {
+        if (nthreads > 1) {
+            pool_init(nthreads);
+        }
+        int failed =
+            run_batch(batch_manifest, output_format, tile_size, epsilon);
+        pool_destroy();
+        return failed ? 1 : 0;
+    }
+    if (profile) {
+        instrument_init(profile_counters);
+    }
+    // The workers first-touch the particle arrays as they are allocated
+    if (nthreads > 1) {
+        init_threads();
     }
-    read_arguments(argv);
+    PHASE_BEGIN(PHASE_READ);
     read_file();
+    PHASE_END(PHASE_READ);
+
+    if (solver == SOLVER_BARNES_HUT) {
+        bh_init(&tree, n, theta);
+    }
+    if (solver == SOLVER_FMM) {
+        fmm_init(&fmm, n, fmm_order);
+    }
+    if (block_levels > 0) {
+        block_init(&stepper, n, block_levels, block_eta);
+    }
+    if (integrator_kind != INTEGRATOR_EULER) {
+        integrator_init(&integrator, integrator_kind, n);
+    }
+    if (precision == PRECISION_MIXED) {
+        float_store_alloc(&float_particles, n);
+    }
+    struct ParticleStore initial;
+    if (check_precision) {
+        store_alloc(&initial, n);
+        store_copy(&initial, &particles);
+    }
+    if (reorder_curve != CURVE_NONE) {
+        reorder_init(&reorder, n, reorder_curve);
+        store_alloc(&unordered, n);
+        PHASE_BEGIN(PHASE_REORDER);
+        reorder_all();
+        PHASE_END(PHASE_REORDER);
+    }
 
     if (graphics) {
-        InitializeGraphics(argv[0], 800, 800);
+        start_display(argv[0]);
     }
 
-    struct timespec start_time;
-    clock_gettime(CLOCK_MONOTONIC, &start_time);
-    double start = start_time.tv_sec + start_time.tv_nsec / 1000000000.0;
+    double *step_times = NULL;
+    if (step_times_path) {
+        step_times = malloc(sizeof(double) * (nsteps > 0 ? nsteps : 1));
+    }
 
+    double start = wall_time();
+
+    if (frames_every) {
+        // In input order, like the snapshots: the writer keeps the masses
+        // and brightness from here, which later reorders would not move
+        frames_open(&frames, frames_pattern, frame_size, render_threads,
+                    output_particles(), largest_particle, brightest);
+        PHASE_BEGIN(PHASE_DRAW);
+        frames_push(&frames, output_particles(), 0);
+        PHASE_END(PHASE_DRAW);
+    }
+    if (snapshot_every) {
+        snapshot_open(&snapshots, snapshot_path, output_format, n, delta_time,
+                      snapshot_tolerance, compress_threads);
+        PHASE_BEGIN(PHASE_SNAPSHOT);
+        snapshot_push(&snapshots, output_particles(), 0);
+        PHASE_END(PHASE_SNAPSHOT);
+    }
     for (int i = 0; i < nsteps; i++) {
-        step();
+        double step_start = step_times ? wall_time() : 0;
+        if (diagnostics_every && i % diagnostics_every == 0) {
+            struct Conserved totals;
+            step(&totals);
+            report_diagnostics(i, &totals);
+        } else {
+            step(NULL);
+        }
+        if (reorder_every && (i + 1) % reorder_every == 0) {
+            PHASE_BEGIN(PHASE_REORDER);
+            reorder_all();
+            PHASE_END(PHASE_REORDER);
+        }
+        if (step_times) {
+            step_times[i] = wall_time() - step_start;
+        }
+        if (snapshot_every && (i + 1) % snapshot_every == 0) {
+            PHASE_BEGIN(PHASE_SNAPSHOT);
+            snapshot_push(&snapshots, output_particles(), i + 1);
+            PHASE_END(PHASE_SNAPSHOT);
+        }
+        if (frames_every && (i + 1) % frames_every == 0) {
+            PHASE_BEGIN(PHASE_DRAW);
+            frames_push(&frames, output_particles(), i + 1);
+            PHASE_END(PHASE_DRAW);
+        }
     }
 
-    struct timespec end_time;
-    clock_gettime(CLOCK_MONOTONIC, &end_time);
-    double end = end_time.tv_sec + end_time.tv_nsec / 1000000000.0;
+    double end = wall_time();
 
     printf("wall seconds: %.15lf \n", end - start);
 
+    if (serve_path) {
+        server_open(&server, serve_path, shm_name, n, nsteps, &delta_time,
+                    serve_steps, serve_state, NULL);
+        printf("serving on %s, particles in shared memory %s\n", serve_path,
+               shm_name);
+        fflush(stdout);
+        server_run(&server);
+        server_close(&server);
+    }
+
+    if (step_times) {
+        write_step_times(step_times);
+        free(step_times);
+    }
+    if (block_levels > 0) {
+        printf("block steps: %.4e pair evaluations, particles per level:",
+               (double)stepper.pair_evaluations);
+        for (int level = 0; level <= block_levels; level++) {
+            printf(" %d", stepper.level_count[level]);
+        }
+        printf("\n");
+    }
+    if (integrator_kind != INTEGRATOR_EULER) {
+        printf("force evaluations: %ld\n", integrator.force_evaluations);
+    }
+    if (diagnostics_every) {
+        printf("largest energy drift: %.3e\n", largest_drift);
+    }
+
+    if (snapshot_every) {
+        snapshot_close(&snapshots);
+    }
+    if (frames_every) {
+        frames_close(&frames);
+    }
     if (graphics) {
-        FlushDisplay();
-        CloseDisplay();
+        stop_display();
+    }
+
+    if (check_precision) {
+        report_precision_error(&initial);
+        store_free(&initial);
+    }
+
+    // The daemon's clients save what they need with the snapshot command
+    if (!serve_path) {
+        PHASE_BEGIN(PHASE_WRITE);
+        write_file();
+        PHASE_END(PHASE_WRITE);
     }
 
-    write_file();
+    if (profile_json_path) {
+        FILE *file = fopen(profile_json_path, "w");
+        if (!file) {
+            fprintf(stderr, "Error opening %s\n", profile_json_path);
+            exit(1);
+        }
+        instrument_report_json(file);
+        fclose(file);
+    } else if (profile) {
+        instrument_report(stdout);
+    }
+
+    if (solver == SOLVER_BARNES_HUT) {
+        bh_free(&tree);
+    }
+    if (solver == SOLVER_FMM) {
+        fmm_free(&fmm);
+    }
+    if (nthreads > 1) {
+        free_threads();
+    }
+    if (block_levels > 0) {
+        block_free(&stepper);
+    }
+    if (integrator_kind != INTEGRATOR_EULER) {
+        integrator_free(&integrator);
+    }
+    if (reorder_curve != CURVE_NONE) {
+        reorder_free(&reorder);
+        store_free(&unordered);
+    }
+    if (precision == PRECISION_MIXED) {
+        float_store_free(&float_particles);
+    }
 
-    free(particles);
-    free(temp_particles);
+    store_free(&particles);
+    changes_free(&temp_particles);
 }
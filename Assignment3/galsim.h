@@ -0,0 +1,57 @@
+#ifndef GALSIM_H
+#define GALSIM_H
+
+#include <stddef.h>
+
+// On-disk record of one particle in a .gal file
+struct Particle {
+    double x_pos;
+    double y_pos;
+    double mass;
+    double x_velocity;
+    double y_velocity;
+    double brightness;
+};
+
+// Working layout of the simulator, one 64-byte aligned array per field.
+// The force kernels only touch the hot fields x_pos, y_pos and mass, while
+// brightness is only read for drawing. The .gal records are converted to and
+// from this layout when a file is loaded or saved. store_alloc() maps the
+// arrays together and places their pages as memory.h describes; a store
+// loaded from a v2 file has its arrays in a private mapping of the file
+// instead.
+struct ParticleStore {
+    int n;
+    double *x_pos;
+    double *y_pos;
+    double *mass;
+    double *x_velocity;
+    double *y_velocity;
+    double *brightness;
+    void *mapping;
+    size_t mapping_size;
+};
+
+// Velocity changes accumulated during a step, in the same layout
+struct ParticleChange {
+    double *x_velocity;
+    double *y_velocity;
+};
+
+// Allocates a 64-byte aligned array of n doubles, or exits on failure
+double *alloc_doubles(int n);
+
+void store_alloc(struct ParticleStore *store, int n);
+void store_free(struct ParticleStore *store);
+void store_copy(struct ParticleStore *destination,
+                const struct ParticleStore *source);
+void store_from_records(struct ParticleStore *store,
+                        const struct Particle *records);
+void store_to_records(const struct ParticleStore *store,
+                      struct Particle *records);
+
+// Allocates a zeroed change buffer for n particles
+void changes_alloc(struct ParticleChange *changes, int n);
+void changes_free(struct ParticleChange *changes);
+
+#endif
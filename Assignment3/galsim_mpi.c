@@ -0,0 +1,389 @@
+// Distributed-memory galsim for N beyond one node. The particles are split
+// into one contiguous block per rank. Every step the position and mass
+// blocks travel once around a ring of ranks: while a rank computes the
+// forces of the block it holds on its own particles, it already passes
+// that block on to the next rank and receives the following one, so the
+// transfers overlap the pair loop. Each rank then advances its own
+// particles with the same symplectic Euler update as galsim.
+//
+// Only the root rank reads and writes .gal files, except for large legacy
+// files, where every rank reads and writes its own block through MPI-IO.
+//
+//     mpirun -np K ./galsim_mpi N filename nsteps delta_time [options]
+
+#include <getopt.h>
+#include <mpi.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "galfile.h"
+#include "galsim.h"
+#include "kernels.h"
+
+// Legacy files from this size on are read and written with MPI-IO
+#define PARALLEL_IO_BYTES (64L << 20)
+
+enum IoMode { IO_AUTO, IO_ROOT, IO_PARALLEL };
+
+struct Options {
+    int n;
+    char *filename;
+    int nsteps;
+    double delta_time;
+    char *output;
+    enum GalFormat format;
+    int tile;
+    enum IoMode io;
+};
+
+static int rank;
+static int ranks;
+static const double epsilon = 0.001;
+
+static void fail(const char *message, const char *detail) {
+    fprintf(stderr, "rank %d: %s%s\n", rank, message, detail ? detail : "");
+    MPI_Abort(MPI_COMM_WORLD, 1);
+}
+
+static void usage() {
+    if (rank == 0) {
+        printf("Usage: mpirun -np K ./galsim_mpi N filename nsteps "
+               "delta_time [options]\n"
+               "Options:\n"
+               "  --output=FILE             result file (default "
+               "results.gal)\n"
+               "  --format=legacy|v2        layout of the result file "
+               "(default legacy)\n"
+               "  --tile=B                  j-block size of the pair loop "
+               "(default 4096)\n"
+               "  --io=auto|root|mpi        file access; auto uses MPI-IO "
+               "for legacy\n"
+               "                            files of %ld MB and more\n",
+               PARALLEL_IO_BYTES >> 20);
+    }
+}
+
+static void read_arguments(struct Options *options, int argc, char **argv) {
+    *options = (struct Options){.output = "results.gal",
+                                .format = GAL_LEGACY,
+                                .tile = 4096,
+                                .io = IO_AUTO};
+    static struct option long_options[] = {
+        {"output", required_argument, NULL, 'o'},
+        {"format", required_argument, NULL, 'f'},
+        {"tile", required_argument, NULL, 'b'},
+        {"io", required_argument, NULL, 'i'},
+        {NULL, 0, NULL, 0}};
+    int option;
+    while ((option = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+        switch (option) {
+        case 'o':
+            options->output = optarg;
+            break;
+        case 'f':
+            if (strcmp(optarg, "legacy") == 0) {
+                options->format = GAL_LEGACY;
+            } else if (strcmp(optarg, "v2") == 0) {
+                options->format = GAL_V2;
+            } else {
+                fail("Unknown format ", optarg);
+            }
+            break;
+        case 'b':
+            options->tile = atoi(optarg);
+            if (options->tile < 1) {
+                fail("tile must be positive", NULL);
+            }
+            break;
+        case 'i':
+            if (strcmp(optarg, "auto") == 0) {
+                options->io = IO_AUTO;
+            } else if (strcmp(optarg, "root") == 0) {
+                options->io = IO_ROOT;
+            } else if (strcmp(optarg, "mpi") == 0) {
+                options->io = IO_PARALLEL;
+            } else {
+                fail("Unknown I/O mode ", optarg);
+            }
+            break;
+        default:
+            usage();
+            MPI_Finalize();
+            exit(1);
+        }
+    }
+    if (argc - optind != 4) {
+        usage();
+        MPI_Finalize();
+        exit(1);
+    }
+    options->n = atoi(argv[optind]);
+    options->filename = argv[optind + 1];
+    options->nsteps = atoi(argv[optind + 2]);
+    options->delta_time = atof(argv[optind + 3]);
+    if (options->n < ranks) {
+        fail("Need at least one particle per rank", NULL);
+    }
+}
+
+static int block_begin(int n, int r) { return (long)n * r / ranks; }
+
+static int block_count(int n, int r) {
+    return block_begin(n, r + 1) - block_begin(n, r);
+}
+
+static double *store_field(const struct ParticleStore *store, int field) {
+    double *fields[6] = {store->x_pos,      store->y_pos,
+                         store->mass,       store->x_velocity,
+                         store->y_velocity, store->brightness};
+    return fields[field];
+}
+
+// Whether the input is read with MPI-IO, decided on the root from the
+// magic and size of the file
+static bool parallel_input(const struct Options *options) {
+    int parallel = 0;
+    if (rank == 0 && options->io != IO_ROOT) {
+        FILE *file = fopen(options->filename, "rb");
+        if (!file) {
+            fail("Error opening ", options->filename);
+        }
+        char magic[8] = {0};
+        size_t got = fread(magic, 1, sizeof(magic), file);
+        fclose(file);
+        bool legacy = got < sizeof(magic) ||
+                      memcmp(magic, GAL_MAGIC, sizeof(magic)) != 0;
+        parallel = legacy && (options->io == IO_PARALLEL ||
+                              (long)options->n * (long)sizeof(struct Particle) >=
+                                  PARALLEL_IO_BYTES);
+    }
+    MPI_Bcast(&parallel, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    return parallel;
+}
+
+static bool parallel_output(const struct Options *options) {
+    return options->format == GAL_LEGACY &&
+           (options->io == IO_PARALLEL ||
+            (options->io == IO_AUTO &&
+             (long)options->n * (long)sizeof(struct Particle) >=
+                 PARALLEL_IO_BYTES));
+}
+
+// Every rank reads the records of its own block in one collective call
+static void read_parallel(const struct Options *options,
+                          struct ParticleStore *local) {
+    MPI_File file;
+    if (MPI_File_open(MPI_COMM_WORLD, options->filename, MPI_MODE_RDONLY,
+                      MPI_INFO_NULL, &file) != MPI_SUCCESS) {
+        fail("Error opening ", options->filename);
+    }
+    MPI_Offset size;
+    MPI_File_get_size(file, &size);
+    if (size != (MPI_Offset)options->n * (MPI_Offset)sizeof(struct Particle)) {
+        fail("Input size does not match N in ", options->filename);
+    }
+    struct Particle *records = malloc(sizeof(struct Particle) * local->n);
+    if (!records) {
+        fail("Error allocating read buffer", NULL);
+    }
+    MPI_Offset offset = (MPI_Offset)block_begin(options->n, rank) *
+                        (MPI_Offset)sizeof(struct Particle);
+    MPI_Status status;
+    if (MPI_File_read_at_all(file, offset, records, 6 * local->n, MPI_DOUBLE,
+                             &status) != MPI_SUCCESS) {
+        fail("Error reading ", options->filename);
+    }
+    MPI_File_close(&file);
+    store_from_records(local, records);
+    free(records);
+}
+
+// The root loads the whole file and hands every rank its block
+static void read_root(const struct Options *options,
+                      struct ParticleStore *local) {
+    int *counts = malloc(sizeof(int) * ranks);
+    int *displacements = malloc(sizeof(int) * ranks);
+    for (int r = 0; r < ranks; r++) {
+        counts[r] = block_count(options->n, r);
+        displacements[r] = block_begin(options->n, r);
+    }
+    struct ParticleStore all;
+    if (rank == 0) {
+        gal_read(options->filename, options->n, &all);
+    }
+    for (int field = 0; field < 6; field++) {
+        MPI_Scatterv(rank == 0 ? store_field(&all, field) : NULL, counts,
+                     displacements, MPI_DOUBLE, store_field(local, field),
+                     local->n, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+    }
+    if (rank == 0) {
+        store_free(&all);
+    }
+    free(counts);
+    free(displacements);
+}
+
+// Writes the records of every block at its offset into <output>.tmp, and
+// the root renames the file once all ranks are done, like gal_write()
+static void write_parallel(const struct Options *options,
+                           const struct ParticleStore *local) {
+    char temporary[4096];
+    snprintf(temporary, sizeof(temporary), "%s.tmp", options->output);
+    MPI_File file;
+    if (MPI_File_open(MPI_COMM_WORLD, temporary,
+                      MPI_MODE_WRONLY | MPI_MODE_CREATE, MPI_INFO_NULL,
+                      &file) != MPI_SUCCESS) {
+        fail("Error opening ", temporary);
+    }
+    MPI_File_set_size(file, (MPI_Offset)options->n *
+                                (MPI_Offset)sizeof(struct Particle));
+    struct Particle *records = malloc(sizeof(struct Particle) * local->n);
+    if (!records) {
+        fail("Error allocating write buffer", NULL);
+    }
+    store_to_records(local, records);
+    MPI_Offset offset = (MPI_Offset)block_begin(options->n, rank) *
+                        (MPI_Offset)sizeof(struct Particle);
+    MPI_Status status;
+    if (MPI_File_write_at_all(file, offset, records, 6 * local->n, MPI_DOUBLE,
+                              &status) != MPI_SUCCESS) {
+        fail("Error writing ", temporary);
+    }
+    MPI_File_close(&file);
+    free(records);
+    if (rank == 0 && rename(temporary, options->output) != 0) {
+        fail("Error renaming ", temporary);
+    }
+}
+
+static void write_root(const struct Options *options,
+                       const struct ParticleStore *local) {
+    int *counts = malloc(sizeof(int) * ranks);
+    int *displacements = malloc(sizeof(int) * ranks);
+    for (int r = 0; r < ranks; r++) {
+        counts[r] = block_count(options->n, r);
+        displacements[r] = block_begin(options->n, r);
+    }
+    struct ParticleStore all;
+    if (rank == 0) {
+        store_alloc(&all, options->n);
+    }
+    for (int field = 0; field < 6; field++) {
+        MPI_Gatherv(store_field(local, field), local->n, MPI_DOUBLE,
+                    rank == 0 ? store_field(&all, field) : NULL, counts,
+                    displacements, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+    }
+    if (rank == 0) {
+        gal_write(options->output, options->format, &all, options->nsteps,
+                  options->delta_time);
+        store_free(&all);
+    }
+    free(counts);
+    free(displacements);
+}
+
+// The circulating j-block, packed as x, y and mass of capacity particles
+// each so that it travels in one message
+struct RingBlock {
+    double *data;
+    int capacity;
+};
+
+static void ring_block_alloc(struct RingBlock *block, int capacity) {
+    block->capacity = capacity;
+    block->data = alloc_doubles(3 * capacity);
+}
+
+static void step(const struct Options *options, struct ParticleStore *local,
+                 struct ParticleChange *changes, struct RingBlock blocks[2]) {
+    const int n = options->n;
+    const int capacity = blocks[0].capacity;
+    const int left = (rank - 1 + ranks) % ranks;
+    const int right = (rank + 1) % ranks;
+    const double factor = 100.0 / n * options->delta_time;
+
+    memset(changes->x_velocity, 0, sizeof(double) * local->n);
+    memset(changes->y_velocity, 0, sizeof(double) * local->n);
+
+    struct RingBlock *current = &blocks[0];
+    struct RingBlock *next = &blocks[1];
+    memcpy(current->data, local->x_pos, sizeof(double) * local->n);
+    memcpy(current->data + capacity, local->y_pos, sizeof(double) * local->n);
+    memcpy(current->data + 2 * capacity, local->mass,
+           sizeof(double) * local->n);
+
+    // After s stages this rank holds the block of rank - s
+    for (int stage = 0; stage < ranks; stage++) {
+        MPI_Request requests[2];
+        int pending = 0;
+        if (stage + 1 < ranks) {
+            MPI_Irecv(next->data, 3 * capacity, MPI_DOUBLE, left, stage,
+                      MPI_COMM_WORLD, &requests[pending++]);
+            MPI_Isend(current->data, 3 * capacity, MPI_DOUBLE, right, stage,
+                      MPI_COMM_WORLD, &requests[pending++]);
+        }
+        int owner = (rank - stage + ranks) % ranks;
+        accel_block(local->x_pos, local->y_pos, local->n, current->data,
+                    current->data + capacity, current->data + 2 * capacity,
+                    block_count(n, owner), options->tile, factor, epsilon,
+                    changes->x_velocity, changes->y_velocity);
+        MPI_Waitall(pending, requests, MPI_STATUSES_IGNORE);
+
+        struct RingBlock *swap = current;
+        current = next;
+        next = swap;
+    }
+
+    integrate(local, changes, options->delta_time);
+}
+
+int main(int argc, char **argv) {
+    MPI_Init(&argc, &argv);
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &ranks);
+
+    struct Options options;
+    read_arguments(&options, argc, argv);
+
+    struct ParticleStore local;
+    store_alloc(&local, block_count(options.n, rank));
+    if (parallel_input(&options)) {
+        read_parallel(&options, &local);
+    } else {
+        read_root(&options, &local);
+    }
+
+    struct ParticleChange changes;
+    changes_alloc(&changes, local.n);
+    struct RingBlock blocks[2];
+    // Block sizes differ by at most one particle
+    int capacity = block_count(options.n, 0) + 1;
+    ring_block_alloc(&blocks[0], capacity);
+    ring_block_alloc(&blocks[1], capacity);
+
+    MPI_Barrier(MPI_COMM_WORLD);
+    double start = MPI_Wtime();
+    for (int i = 0; i < options.nsteps; i++) {
+        step(&options, &local, &changes, blocks);
+    }
+    MPI_Barrier(MPI_COMM_WORLD);
+    double end = MPI_Wtime();
+    if (rank == 0) {
+        printf("wall seconds: %.15lf \n", end - start);
+    }
+
+    if (parallel_output(&options)) {
+        write_parallel(&options, &local);
+    } else {
+        write_root(&options, &local);
+    }
+
+    free(blocks[0].data);
+    free(blocks[1].data);
+    changes_free(&changes);
+    store_free(&local);
+    MPI_Finalize();
+    return 0;
+}
@@ -0,0 +1,342 @@
+// Writes synthetic initial conditions as legacy .gal files of six-double
+// particle records, for runs beyond the ellipse inputs in input_data.
+//
+// Every random number is a hash of the seed, the particle index and the
+// number of the draw for that particle, so particle i comes out the same
+// whatever the thread count or chunk size. Worker threads take chunks of
+// particles in turn, fill a private buffer and pwrite it to its place in
+// the file, so memory stays at threads * chunk records for any N.
+//
+// The systems sit around (0.5, 0.5) like the ellipse inputs, with masses of
+// order one, and velocities for galsim's G = 100 / N.
+
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../galsim.h"
+
+#define PI 3.14159265358979323846
+
+enum Model { MODEL_ELLIPSE, MODEL_PLUMMER, MODEL_DISK, MODEL_COLLISION };
+
+struct Options {
+    enum Model model;
+    long n;
+    const char *output;
+    uint64_t seed;
+    double radius;
+    double separation;
+    double impact;
+    int threads;
+    long chunk;
+};
+
+struct Generator {
+    const struct Options *options;
+    int fd;
+    long chunks;
+    atomic_long next_chunk;
+    atomic_bool failed;
+};
+
+// The random numbers of one particle: draw counts up from zero
+struct Stream {
+    uint64_t key;
+    uint64_t particle;
+    uint64_t draw;
+};
+
+static const char *model_names[] = {"ellipse", "plummer", "disk",
+                                    "collision"};
+
+static void usage() {
+    printf("Usage: generate [options] N output.gal\n"
+           "  -m MODEL     ellipse, plummer, disk or collision "
+           "(default ellipse)\n"
+           "  -s SEED      random seed (default 1)\n"
+           "  -r RADIUS    scale radius of each galaxy (default 0.05)\n"
+           "  -d DISTANCE  start distance of the collision galaxies "
+           "(default 0.3)\n"
+           "  -b OFFSET    impact parameter of the collision "
+           "(default 0.05)\n"
+           "  -t THREADS   worker threads (default all cores)\n"
+           "  -c CHUNK     particles per write (default 65536)\n");
+}
+
+static void read_options(struct Options *options, int argc, char **argv) {
+    *options = (struct Options){.model = MODEL_ELLIPSE,
+                                .seed = 1,
+                                .radius = 0.05,
+                                .separation = 0.3,
+                                .impact = 0.05,
+                                .threads = sysconf(_SC_NPROCESSORS_ONLN),
+                                .chunk = 65536};
+    int option;
+    while ((option = getopt(argc, argv, "m:s:r:d:b:t:c:h")) != -1) {
+        switch (option) {
+        case 'm': {
+            int m = 0;
+            while (m < 4 && strcmp(optarg, model_names[m]) != 0) {
+                m++;
+            }
+            if (m == 4) {
+                fprintf(stderr, "Unknown model '%s'\n", optarg);
+                exit(1);
+            }
+            options->model = m;
+            break;
+        }
+        case 's':
+            options->seed = strtoull(optarg, NULL, 0);
+            break;
+        case 'r':
+            options->radius = atof(optarg);
+            break;
+        case 'd':
+            options->separation = atof(optarg);
+            break;
+        case 'b':
+            options->impact = atof(optarg);
+            break;
+        case 't':
+            options->threads = atoi(optarg);
+            break;
+        case 'c':
+            options->chunk = atol(optarg);
+            break;
+        default:
+            usage();
+            exit(option == 'h' ? 0 : 1);
+        }
+    }
+    if (argc - optind != 2) {
+        usage();
+        exit(1);
+    }
+    options->n = atol(argv[optind]);
+    options->output = argv[optind + 1];
+    if (options->n < 1 || options->n > INT32_MAX) {
+        fprintf(stderr, "N must be between 1 and %d\n", INT32_MAX);
+        exit(1);
+    }
+    if (options->radius <= 0 || options->threads < 1 || options->chunk < 1) {
+        fprintf(stderr, "Radius, threads and chunk must be positive\n");
+        exit(1);
+    }
+}
+
+// SplitMix64 finaliser
+static uint64_t mix(uint64_t z) {
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+// Uniform in the open interval (0, 1)
+static double uniform(struct Stream *stream) {
+    uint64_t bits = mix(stream->key ^
+                        mix(stream->particle * 0x9e3779b97f4a7c15ULL +
+                            stream->draw++));
+    return ((bits >> 11) + 0.5) * 0x1.0p-53;
+}
+
+static double normal(struct Stream *stream) {
+    double u = uniform(stream);
+    double v = uniform(stream);
+    return sqrt(-2 * log(u)) * cos(2 * PI * v);
+}
+
+// Unit vector in a random direction in space, projected onto the plane
+static void projected_direction(struct Stream *stream, double *x, double *y) {
+    double z = 2 * uniform(stream) - 1;
+    double phi = 2 * PI * uniform(stream);
+    *x = sqrt(1 - z * z) * cos(phi);
+    *y = sqrt(1 - z * z) * sin(phi);
+}
+
+// A flattened rotating cloud like the ellipse inputs: uniform in a disk
+// squashed to a quarter of its width, speed 50 times the distance from the
+// centre, perpendicular to it
+static void ellipse(struct Stream *stream, struct Particle *p) {
+    double r = 0.25 * sqrt(uniform(stream));
+    double angle = 2 * PI * uniform(stream);
+    double dx = r * cos(angle);
+    double dy = 0.25 * r * sin(angle);
+    p->x_pos = dx;
+    p->y_pos = dy;
+    p->mass = 0.7 + 0.8 * uniform(stream);
+    p->x_velocity = -50 * dy;
+    p->y_velocity = 50 * dx;
+}
+
+// A Plummer sphere of scale radius a and mass GM / G, seen from above:
+// positions and isotropic velocities are drawn in three dimensions (Aarseth,
+// Henon & Wielen 1974) and projected onto the plane. Radii beyond 20 a are
+// drawn again.
+static void plummer(struct Stream *stream, double a, double gm,
+                    struct Particle *p) {
+    double r;
+    do {
+        double u = uniform(stream);
+        r = a / sqrt(1 / cbrt(u * u) - 1);
+    } while (r > 20 * a);
+    double x, y;
+    projected_direction(stream, &x, &y);
+    p->x_pos = r * x;
+    p->y_pos = r * y;
+
+    // Speed as a fraction q of the escape speed, from g(q) ~ q^2 (1-q^2)^3.5
+    double q;
+    for (;;) {
+        q = uniform(stream);
+        double s = 1 - q * q;
+        if (0.1 * uniform(stream) < q * q * s * s * s * sqrt(s)) {
+            break;
+        }
+    }
+    double speed = q * sqrt(2 * gm / sqrt(r * r + a * a));
+    projected_direction(stream, &x, &y);
+    p->x_velocity = speed * x;
+    p->y_velocity = speed * y;
+    p->mass = 1;
+}
+
+// An exponential disk of scale length a and mass GM / G on circular orbits
+// about the mass inside each radius, with a velocity dispersion of a tenth
+// of the circular speed. The radius of a surface density exp(-R / a) is a
+// Gamma(2) variable, the sum of two exponential ones.
+static void disk(struct Stream *stream, double a, double gm,
+                 struct Particle *p) {
+    double r = -a * (log(uniform(stream)) + log(uniform(stream)));
+    double angle = 2 * PI * uniform(stream);
+    double x = r / a;
+    double inside = 1 - (1 + x) * exp(-x);
+    double speed = sqrt(gm * inside / r);
+    p->x_pos = r * cos(angle);
+    p->y_pos = r * sin(angle);
+    p->x_velocity = -speed * sin(angle) + 0.1 * speed * normal(stream);
+    p->y_velocity = speed * cos(angle) + 0.1 * speed * normal(stream);
+    p->mass = 1;
+}
+
+static void generate_particle(const struct Options *options, long i,
+                              struct Particle *p) {
+    struct Stream stream = {mix(options->seed), (uint64_t)i, 0};
+    // galsim uses G = 100 / N; with unit masses G M = 100
+    const double gm = 100;
+    switch (options->model) {
+    case MODEL_ELLIPSE:
+        ellipse(&stream, p);
+        break;
+    case MODEL_PLUMMER:
+        plummer(&stream, options->radius, gm, p);
+        break;
+    case MODEL_DISK:
+        disk(&stream, options->radius, gm, p);
+        break;
+    case MODEL_COLLISION: {
+        // The first half and the second half of the particles make two
+        // disks, falling towards each other on a parabolic orbit
+        bool second = i >= options->n / 2;
+        disk(&stream, options->radius, gm / 2, p);
+        double d = options->separation;
+        double approach = sqrt(2 * gm / d) / 2;
+        double side = second ? 1 : -1;
+        p->x_pos += side * d / 2;
+        p->y_pos += side * options->impact / 2;
+        p->x_velocity -= side * approach;
+        break;
+    }
+    }
+    p->x_pos += 0.5;
+    p->y_pos += 0.5;
+    p->brightness = 1.5 + 3.5 * uniform(&stream);
+}
+
+static void *generate_chunks(void *arg) {
+    struct Generator *generator = arg;
+    const struct Options *options = generator->options;
+    struct Particle *records = malloc(sizeof(struct Particle) * options->chunk);
+    if (!records) {
+        atomic_store(&generator->failed, true);
+        return NULL;
+    }
+    for (;;) {
+        long c = atomic_fetch_add(&generator->next_chunk, 1);
+        if (c >= generator->chunks || atomic_load(&generator->failed)) {
+            break;
+        }
+        long begin = c * options->chunk;
+        long end = begin + options->chunk < options->n ? begin + options->chunk
+                                                       : options->n;
+        for (long i = begin; i < end; i++) {
+            generate_particle(options, i, &records[i - begin]);
+        }
+        size_t size = sizeof(struct Particle) * (end - begin);
+        off_t offset = sizeof(struct Particle) * begin;
+        size_t done = 0;
+        while (done < size) {
+            ssize_t put = pwrite(generator->fd, (char *)records + done,
+                                 size - done, offset + done);
+            if (put <= 0) {
+                atomic_store(&generator->failed, true);
+                break;
+            }
+            done += put;
+        }
+    }
+    free(records);
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    struct Options options;
+    read_options(&options, argc, argv);
+
+    struct timespec start, finish;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    struct Generator generator = {.options = &options};
+    generator.fd = open(options.output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (generator.fd < 0) {
+        fprintf(stderr, "Error opening %s\n", options.output);
+        exit(1);
+    }
+    generator.chunks = (options.n + options.chunk - 1) / options.chunk;
+    atomic_init(&generator.next_chunk, 0);
+    atomic_init(&generator.failed, false);
+
+    pthread_t *workers = malloc(sizeof(pthread_t) * options.threads);
+    for (int t = 1; t < options.threads; t++) {
+        if (pthread_create(&workers[t], NULL, generate_chunks, &generator) !=
+            0) {
+            fprintf(stderr, "Error creating worker thread\n");
+            exit(1);
+        }
+    }
+    generate_chunks(&generator);
+    for (int t = 1; t < options.threads; t++) {
+        pthread_join(workers[t], NULL);
+    }
+    free(workers);
+    if (close(generator.fd) != 0 || atomic_load(&generator.failed)) {
+        fprintf(stderr, "Error writing %s\n", options.output);
+        exit(1);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &finish);
+    printf("%ld %s particles written to %s in %.2f s\n", options.n,
+           model_names[options.model], options.output,
+           (finish.tv_sec - start.tv_sec) +
+               1e-9 * (finish.tv_nsec - start.tv_nsec));
+    return 0;
+}
@@ -0,0 +1,194 @@
+#include "instrument.h"
+
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_COUNTERS 5
+
+struct Counter {
+    const char *name;
+    uint32_t type;
+    uint64_t config;
+};
+
+// FP arithmetic uses the Intel FP_ARITH_INST_RETIRED event with all unit
+// masks, which counts scalar and packed instructions rather than flops. It
+// does not open on other vendors and is then left out.
+static const struct Counter counter_events[MAX_COUNTERS] = {
+    {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {"l1d_read_misses", PERF_TYPE_HW_CACHE,
+     PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+         (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+    {"llc_read_misses", PERF_TYPE_HW_CACHE,
+     PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+         (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+    {"fp_arith_instructions", PERF_TYPE_RAW, 0xffc7},
+};
+
+static const char *phase_names[PHASE_COUNT] = {
+    "read",     "clear", "forces", "integrate", "draw",
+    "snapshot", "write", "reorder"};
+
+struct PhaseTotals {
+    long calls;
+    double seconds;
+    uint64_t counts[MAX_COUNTERS];
+};
+
+static bool enabled;
+static struct PhaseTotals totals[PHASE_COUNT];
+static double phase_start;
+static uint64_t counts_start[MAX_COUNTERS];
+
+// Counters that opened, in the order they are returned by a group read
+static int group_fd = -1;
+static int opened[MAX_COUNTERS];
+static int opened_count;
+
+static double now() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec / 1000000000.0;
+}
+
+static int open_counter(const struct Counter *counter, int leader,
+                        bool inherit) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = counter->type;
+    attr.config = counter->config;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP;
+    attr.inherit = inherit;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, leader, 0);
+}
+
+static void read_counters(uint64_t *counts) {
+    uint64_t buffer[1 + MAX_COUNTERS];
+    if (group_fd < 0 ||
+        read(group_fd, buffer, sizeof(buffer)) < (ssize_t)sizeof(uint64_t)) {
+        return;
+    }
+    for (int c = 0; c < opened_count; c++) {
+        counts[opened[c]] = buffer[1 + c];
+    }
+}
+
+void instrument_init(bool counters) {
+    enabled = true;
+    memset(totals, 0, sizeof(totals));
+    if (!counters) {
+        return;
+    }
+    // Inherited counters also count the threads started afterwards, such as
+    // the pool workers. Kernels before 4.13 refuse them in a group read.
+    bool inherit = true;
+    for (int c = 0; c < MAX_COUNTERS; c++) {
+        int fd = open_counter(&counter_events[c], group_fd, inherit);
+        if (fd < 0 && inherit && group_fd < 0 && errno == EINVAL) {
+            inherit = false;
+            fd = open_counter(&counter_events[c], group_fd, inherit);
+        }
+        if (fd < 0) {
+            continue;
+        }
+        if (group_fd < 0) {
+            group_fd = fd;
+        }
+        opened[opened_count++] = c;
+    }
+    if (group_fd < 0) {
+        fprintf(stderr, "instrument: hardware counters are not available, "
+                        "timing only\n");
+    } else if (!inherit) {
+        fprintf(stderr, "instrument: hardware counters only count the main "
+                        "thread\n");
+    }
+}
+
+void instrument_begin(enum Phase phase) {
+    (void)phase;
+    if (!enabled) {
+        return;
+    }
+    read_counters(counts_start);
+    phase_start = now();
+}
+
+void instrument_end(enum Phase phase) {
+    if (!enabled) {
+        return;
+    }
+    double end = now();
+    uint64_t counts[MAX_COUNTERS] = {0};
+    read_counters(counts);
+    struct PhaseTotals *total = &totals[phase];
+    total->calls++;
+    total->seconds += end - phase_start;
+    for (int c = 0; c < opened_count; c++) {
+        int event = opened[c];
+        total->counts[event] += counts[event] - counts_start[event];
+    }
+}
+
+static double total_seconds() {
+    double sum = 0;
+    for (int p = 0; p < PHASE_COUNT; p++) {
+        sum += totals[p].seconds;
+    }
+    return sum;
+}
+
+void instrument_report(FILE *out) {
+    double sum = total_seconds();
+    fprintf(out, "%-10s %8s %12s %12s %7s", "phase", "calls", "seconds",
+            "us/call", "share");
+    for (int c = 0; c < opened_count; c++) {
+        fprintf(out, " %22s", counter_events[opened[c]].name);
+    }
+    fprintf(out, "\n");
+    for (int p = 0; p < PHASE_COUNT; p++) {
+        const struct PhaseTotals *total = &totals[p];
+        if (total->calls == 0) {
+            continue;
+        }
+        fprintf(out, "%-10s %8ld %12.6f %12.3f %6.1f%%", phase_names[p],
+                total->calls, total->seconds,
+                1e6 * total->seconds / total->calls,
+                sum > 0 ? 100 * total->seconds / sum : 0);
+        for (int c = 0; c < opened_count; c++) {
+            fprintf(out, " %22llu",
+                    (unsigned long long)total->counts[opened[c]]);
+        }
+        fprintf(out, "\n");
+    }
+}
+
+void instrument_report_json(FILE *out) {
+    fprintf(out, "{\n  \"phases\": {\n");
+    bool first = true;
+    for (int p = 0; p < PHASE_COUNT; p++) {
+        const struct PhaseTotals *total = &totals[p];
+        if (total->calls == 0) {
+            continue;
+        }
+        fprintf(out, "%s    \"%s\": {\"calls\": %ld, \"seconds\": %.9e",
+                first ? "" : ",\n", phase_names[p], total->calls,
+                total->seconds);
+        for (int c = 0; c < opened_count; c++) {
+            fprintf(out, ", \"%s\": %llu", counter_events[opened[c]].name,
+                    (unsigned long long)total->counts[opened[c]]);
+        }
+        fprintf(out, "}");
+        first = false;
+    }
+    fprintf(out, "\n  },\n  \"total_seconds\": %.9e\n}\n", total_seconds());
+}
@@ -0,0 +1,46 @@
+#ifndef INSTRUMENT_H
+#define INSTRUMENT_H
+
+#include <stdbool.h>
+#include <stdio.h>
+
+// Per-phase timers and hardware counters for galsim. The PHASE_BEGIN and
+// PHASE_END markers expand to nothing unless the program is built with
+// GALSIM_INSTRUMENT defined (make INSTRUMENT=1), so release builds pay
+// nothing. Phases must not nest.
+enum Phase {
+    PHASE_READ,
+    PHASE_CLEAR,
+    PHASE_FORCES,
+    PHASE_INTEGRATE,
+    PHASE_DRAW,
+    PHASE_SNAPSHOT,
+    PHASE_WRITE,
+    PHASE_REORDER,
+    PHASE_COUNT
+};
+
+#ifdef GALSIM_INSTRUMENT
+#define PHASE_BEGIN(phase) instrument_begin(phase)
+#define PHASE_END(phase) instrument_end(phase)
+#else
+#define PHASE_BEGIN(phase) ((void)0)
+#define PHASE_END(phase) ((void)0)
+#endif
+
+// Starts collecting. With counters, cycles, instructions, L1D and LLC read
+// misses and FP arithmetic instructions are read through perf_event_open for
+// the calling thread and every thread it starts afterwards, so call this
+// before the thread pool starts. A phase is charged with what all threads
+// counted while it ran, background writers included. Events the kernel or
+// CPU refuses are left out.
+void instrument_init(bool counters);
+
+void instrument_begin(enum Phase phase);
+void instrument_end(enum Phase phase);
+
+// Prints a table of all phases, or writes them as a JSON object
+void instrument_report(FILE *out);
+void instrument_report_json(FILE *out);
+
+#endif
@@ -0,0 +1,201 @@
+#include "integrator.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Kick and drift coefficients of a kick-drift-kick composition: kick[0],
+// drift[0], kick[1], ..., drift[stages - 1], kick[stages], as fractions of
+// delta_time
+struct Scheme {
+    int stages;
+    double kick[4];
+    double drift[3];
+};
+
+static struct Scheme leapfrog_scheme() {
+    return (struct Scheme){1, {0.5, 0.5}, {1.0}};
+}
+
+// Yoshida (1990): leapfrog steps of w1, w0, w1 times delta_time, with the
+// negative middle step cancelling the third order error of the outer ones
+static struct Scheme yoshida_scheme() {
+    double cube_root = cbrt(2.0);
+    double w1 = 1.0 / (2.0 - cube_root);
+    double w0 = -cube_root * w1;
+    return (struct Scheme){3,
+                           {0.5 * w1, 0.5 * (w0 + w1), 0.5 * (w0 + w1),
+                            0.5 * w1},
+                           {w1, w0, w1}};
+}
+
+void integrator_init(struct Integrator *integrator, enum IntegratorKind kind,
+                     int n) {
+    memset(integrator, 0, sizeof(*integrator));
+    integrator->kind = kind;
+    integrator->n = n;
+    changes_alloc(&integrator->accel, n);
+    if (kind == INTEGRATOR_HERMITE) {
+        changes_alloc(&integrator->jerk, n);
+        changes_alloc(&integrator->start_accel, n);
+        changes_alloc(&integrator->start_jerk, n);
+        integrator->x_pos = alloc_doubles(n);
+        integrator->y_pos = alloc_doubles(n);
+        integrator->x_velocity = alloc_doubles(n);
+        integrator->y_velocity = alloc_doubles(n);
+    }
+}
+
+void integrator_free(struct Integrator *integrator) {
+    changes_free(&integrator->accel);
+    if (integrator->kind == INTEGRATOR_HERMITE) {
+        changes_free(&integrator->jerk);
+        changes_free(&integrator->start_accel);
+        changes_free(&integrator->start_jerk);
+        free(integrator->x_pos);
+        free(integrator->y_pos);
+        free(integrator->x_velocity);
+        free(integrator->y_velocity);
+    }
+}
+
+void integrator_reset(struct Integrator *integrator) {
+    integrator->started = false;
+}
+
+static void kick(struct ParticleStore *particles,
+                 const struct ParticleChange *accel, double time) {
+    double *restrict x_velocity = particles->x_velocity;
+    double *restrict y_velocity = particles->y_velocity;
+    const double *restrict x_accel = accel->x_velocity;
+    const double *restrict y_accel = accel->y_velocity;
+    for (int i = 0; i < particles->n; i++) {
+        x_velocity[i] += x_accel[i] * time;
+        y_velocity[i] += y_accel[i] * time;
+    }
+}
+
+static void drift(struct ParticleStore *particles, double time) {
+    double *restrict x_pos = particles->x_pos;
+    double *restrict y_pos = particles->y_pos;
+    const double *restrict x_velocity = particles->x_velocity;
+    const double *restrict y_velocity = particles->y_velocity;
+    for (int i = 0; i < particles->n; i++) {
+        x_pos[i] += x_velocity[i] * time;
+        y_pos[i] += y_velocity[i] * time;
+    }
+}
+
+static void kick_drift_kick(struct Integrator *integrator,
+                            const struct Scheme *scheme,
+                            struct ParticleStore *particles, double delta_time,
+                            force_function forces, void *arg) {
+    for (int s = 0; s < scheme->stages; s++) {
+        kick(particles, &integrator->accel, scheme->kick[s] * delta_time);
+        drift(particles, scheme->drift[s] * delta_time);
+        forces(arg, &integrator->accel, NULL);
+        integrator->force_evaluations++;
+    }
+    kick(particles, &integrator->accel,
+         scheme->kick[scheme->stages] * delta_time);
+}
+
+static void swap_changes(struct ParticleChange *a, struct ParticleChange *b) {
+    struct ParticleChange swap = *a;
+    *a = *b;
+    *b = swap;
+}
+
+// Taylor series of one coordinate to the end of the step, keeping the start
+static void predict(int n, double dt, double *restrict pos,
+                    double *restrict velocity, double *restrict start_pos,
+                    double *restrict start_velocity,
+                    const double *restrict accel,
+                    const double *restrict jerk) {
+    const double dt2 = dt * dt / 2;
+    const double dt3 = dt * dt * dt / 6;
+    for (int i = 0; i < n; i++) {
+        start_pos[i] = pos[i];
+        start_velocity[i] = velocity[i];
+        pos[i] += velocity[i] * dt + accel[i] * dt2 + jerk[i] * dt3;
+        velocity[i] += accel[i] * dt + jerk[i] * dt2;
+    }
+}
+
+// Fourth order Hermite interpolation of one coordinate between the
+// derivatives at both ends of the step
+static void correct(int n, double dt, double *restrict pos,
+                    double *restrict velocity, const double *restrict start_pos,
+                    const double *restrict start_velocity,
+                    const double *restrict start_accel,
+                    const double *restrict start_jerk,
+                    const double *restrict accel,
+                    const double *restrict jerk) {
+    const double dt12 = dt * dt / 12;
+    for (int i = 0; i < n; i++) {
+        velocity[i] = start_velocity[i] + (start_accel[i] + accel[i]) * dt / 2 +
+                      (start_jerk[i] - jerk[i]) * dt12;
+        pos[i] = start_pos[i] + (start_velocity[i] + velocity[i]) * dt / 2 +
+                 (start_accel[i] - accel[i]) * dt12;
+    }
+}
+
+// Predicts the state at the end of the step from the acceleration and jerk,
+// evaluates both there, and corrects with the values at both ends
+static void hermite(struct Integrator *integrator,
+                    struct ParticleStore *particles, double delta_time,
+                    force_function forces, void *arg) {
+    const int n = particles->n;
+    swap_changes(&integrator->accel, &integrator->start_accel);
+    swap_changes(&integrator->jerk, &integrator->start_jerk);
+    const struct ParticleChange *accel = &integrator->start_accel;
+    const struct ParticleChange *jerk = &integrator->start_jerk;
+    predict(n, delta_time, particles->x_pos, particles->x_velocity,
+            integrator->x_pos, integrator->x_velocity, accel->x_velocity,
+            jerk->x_velocity);
+    predict(n, delta_time, particles->y_pos, particles->y_velocity,
+            integrator->y_pos, integrator->y_velocity, accel->y_velocity,
+            jerk->y_velocity);
+
+    forces(arg, &integrator->accel, &integrator->jerk);
+    integrator->force_evaluations++;
+
+    const struct ParticleChange *end_accel = &integrator->accel;
+    const struct ParticleChange *end_jerk = &integrator->jerk;
+    correct(n, delta_time, particles->x_pos, particles->x_velocity,
+            integrator->x_pos, integrator->x_velocity, accel->x_velocity,
+            jerk->x_velocity, end_accel->x_velocity, end_jerk->x_velocity);
+    correct(n, delta_time, particles->y_pos, particles->y_velocity,
+            integrator->y_pos, integrator->y_velocity, accel->y_velocity,
+            jerk->y_velocity, end_accel->y_velocity, end_jerk->y_velocity);
+}
+
+void integrator_step(struct Integrator *integrator,
+                     struct ParticleStore *particles, double delta_time,
+                     force_function forces, void *arg) {
+    bool with_jerk = integrator->kind == INTEGRATOR_HERMITE;
+    if (!integrator->started) {
+        forces(arg, &integrator->accel, with_jerk ? &integrator->jerk : NULL);
+        integrator->force_evaluations++;
+        integrator->started = true;
+    }
+
+    struct Scheme scheme;
+    switch (integrator->kind) {
+    case INTEGRATOR_LEAPFROG:
+        scheme = leapfrog_scheme();
+        kick_drift_kick(integrator, &scheme, particles, delta_time, forces,
+                        arg);
+        break;
+    case INTEGRATOR_YOSHIDA:
+        scheme = yoshida_scheme();
+        kick_drift_kick(integrator, &scheme, particles, delta_time, forces,
+                        arg);
+        break;
+    case INTEGRATOR_HERMITE:
+        hermite(integrator, particles, delta_time, forces, arg);
+        break;
+    case INTEGRATOR_EULER:
+        break;
+    }
+}
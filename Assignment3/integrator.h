@@ -0,0 +1,60 @@
+#ifndef INTEGRATOR_H
+#define INTEGRATOR_H
+
+#include <stdbool.h>
+
+#include "galsim.h"
+
+// Time integrators on top of the force solvers. Euler is the original
+// symplectic Euler update in step() and is not handled here.
+//
+// Leapfrog (kick-drift-kick) and Yoshida's fourth order composition of
+// three leapfrog steps reuse the acceleration from the end of one step for
+// the first kick of the next, so they cost one and three force evaluations
+// per step. Hermite is the fourth order predictor-corrector, which needs
+// the jerk (the time derivative of the acceleration) along with the
+// acceleration, once per step.
+enum IntegratorKind {
+    INTEGRATOR_EULER,
+    INTEGRATOR_LEAPFROG,
+    INTEGRATOR_YOSHIDA,
+    INTEGRATOR_HERMITE
+};
+
+// Computes the accelerations of all particles at their current positions
+// into accel, and with jerk != NULL also the jerks at the current positions
+// and velocities. Both are overwritten.
+typedef void (*force_function)(void *arg, struct ParticleChange *accel,
+                               struct ParticleChange *jerk);
+
+struct Integrator {
+    enum IntegratorKind kind;
+    int n;
+    // Whether accel (and jerk) hold the values for the current state
+    bool started;
+    struct ParticleChange accel;
+    struct ParticleChange jerk;
+    // Hermite: the state and derivatives at the start of the step
+    struct ParticleChange start_accel;
+    struct ParticleChange start_jerk;
+    double *x_pos;
+    double *y_pos;
+    double *x_velocity;
+    double *y_velocity;
+    long force_evaluations;
+};
+
+void integrator_init(struct Integrator *integrator, enum IntegratorKind kind,
+                     int n);
+void integrator_free(struct Integrator *integrator);
+
+// Forgets the cached accelerations, for when the particles are changed
+// from outside
+void integrator_reset(struct Integrator *integrator);
+
+// Advances all particles by delta_time
+void integrator_step(struct Integrator *integrator,
+                     struct ParticleStore *particles, double delta_time,
+                     force_function forces, void *arg);
+
+#endif
@@ -0,0 +1,603 @@
+// This file is built once per instruction set with KERNEL_ISA set to its
+// name (see the makefile). The public functions are renamed with that
+// suffix here and collected in kernel_table_<KERNEL_ISA> at the end.
+#ifndef KERNEL_ISA
+#define KERNEL_ISA sse2
+#endif
+#define KERNEL_JOIN(name, isa) name##_##isa
+#define KERNEL_NAME(name, isa) KERNEL_JOIN(name, isa)
+#define KERNEL_STRING(isa) #isa
+#define KERNEL_QUOTE(isa) KERNEL_STRING(isa)
+
+#define direct_rows KERNEL_NAME(direct_rows, KERNEL_ISA)
+#define float_store_alloc KERNEL_NAME(float_store_alloc, KERNEL_ISA)
+#define float_store_free KERNEL_NAME(float_store_free, KERNEL_ISA)
+#define float_store_update KERNEL_NAME(float_store_update, KERNEL_ISA)
+#define direct_rows_mixed KERNEL_NAME(direct_rows_mixed, KERNEL_ISA)
+#define integrate KERNEL_NAME(integrate, KERNEL_ISA)
+#define accel_rows KERNEL_NAME(accel_rows, KERNEL_ISA)
+#define accel_block KERNEL_NAME(accel_block, KERNEL_ISA)
+#define direct_rows_jerk KERNEL_NAME(direct_rows_jerk, KERNEL_ISA)
+#define direct_rows_energy KERNEL_NAME(direct_rows_energy, KERNEL_ISA)
+#define integrate_energy KERNEL_NAME(integrate_energy, KERNEL_ISA)
+
+#include "kernels.h"
+
+#include <immintrin.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// The pair force is G * m / (r + epsilon)^3 along the separation. Instead of
+// pow(), (r + epsilon)^3 is formed with two multiplies, which maps directly
+// onto vector sqrt, mul and div instructions.
+
+// Interacts particle i with the particles j_begin <= j < j_end. The changes
+// of the j particles are updated in place, while the contribution to particle
+// i is returned through accel_x and accel_y, in units of 1/factor. If
+// potential is not NULL, it is set to the sum of m_j (2 r + epsilon) / d^2,
+// the pair potentials without -G m_i / 2. That is the potential whose
+// gradient is the softened force, so that the energy it gives is conserved.
+static inline void interact_row(const struct ParticleStore *p, int i,
+                                int j_begin, int j_end, double factor,
+                                double epsilon, struct ParticleChange *changes,
+                                double *accel_x, double *accel_y,
+                                double *potential) {
+    const double *restrict x = p->x_pos;
+    const double *restrict y = p->y_pos;
+    const double *restrict m = p->mass;
+    double *restrict cx = changes->x_velocity;
+    double *restrict cy = changes->y_velocity;
+    const double x_i = x[i];
+    const double y_i = y[i];
+    const double factor_i = factor * m[i];
+    double ax = 0;
+    double ay = 0;
+    double pot = 0;
+    int j = j_begin;
+
+#if defined(__AVX512F__)
+    const __m512d vx_i = _mm512_set1_pd(x_i);
+    const __m512d vy_i = _mm512_set1_pd(y_i);
+    const __m512d veps = _mm512_set1_pd(epsilon);
+    const __m512d vone = _mm512_set1_pd(1.0);
+    const __m512d vfactor_i = _mm512_set1_pd(factor_i);
+    __m512d vax = _mm512_setzero_pd();
+    __m512d vay = _mm512_setzero_pd();
+    __m512d vpot = _mm512_setzero_pd();
+    while (j < j_end) {
+        // The last partial vector is handled with a lane mask. Masked lanes
+        // load zero mass and therefore contribute nothing.
+        __mmask8 mask = j_end - j >= 8 ? 0xff : (1u << (j_end - j)) - 1;
+        __m512d dx = _mm512_sub_pd(vx_i, _mm512_maskz_loadu_pd(mask, x + j));
+        __m512d dy = _mm512_sub_pd(vy_i, _mm512_maskz_loadu_pd(mask, y + j));
+        __m512d r = _mm512_sqrt_pd(
+            _mm512_fmadd_pd(dx, dx, _mm512_mul_pd(dy, dy)));
+        __m512d d = _mm512_add_pd(r, veps);
+        __m512d inv = _mm512_div_pd(vone, _mm512_mul_pd(_mm512_mul_pd(d, d), d));
+        __m512d f_j =
+            _mm512_mul_pd(inv, _mm512_maskz_loadu_pd(mask, m + j));
+        vax = _mm512_fnmadd_pd(f_j, dx, vax);
+        vay = _mm512_fnmadd_pd(f_j, dy, vay);
+        if (potential) {
+            // m_j (2 r + epsilon) / d^2 = f_j (r + d) d
+            vpot = _mm512_fmadd_pd(_mm512_mul_pd(f_j, _mm512_add_pd(r, d)), d,
+                                   vpot);
+        }
+        __m512d f_i = _mm512_mul_pd(inv, vfactor_i);
+        _mm512_mask_storeu_pd(
+            cx + j, mask,
+            _mm512_fmadd_pd(f_i, dx, _mm512_maskz_loadu_pd(mask, cx + j)));
+        _mm512_mask_storeu_pd(
+            cy + j, mask,
+            _mm512_fmadd_pd(f_i, dy, _mm512_maskz_loadu_pd(mask, cy + j)));
+        j += 8;
+    }
+    ax = _mm512_reduce_add_pd(vax);
+    ay = _mm512_reduce_add_pd(vay);
+    pot = _mm512_reduce_add_pd(vpot);
+#elif defined(__AVX2__) && defined(__FMA__)
+    const __m256d vx_i = _mm256_set1_pd(x_i);
+    const __m256d vy_i = _mm256_set1_pd(y_i);
+    const __m256d veps = _mm256_set1_pd(epsilon);
+    const __m256d vone = _mm256_set1_pd(1.0);
+    const __m256d vfactor_i = _mm256_set1_pd(factor_i);
+    __m256d vax = _mm256_setzero_pd();
+    __m256d vay = _mm256_setzero_pd();
+    __m256d vpot = _mm256_setzero_pd();
+    for (; j + 4 <= j_end; j += 4) {
+        __m256d dx = _mm256_sub_pd(vx_i, _mm256_loadu_pd(x + j));
+        __m256d dy = _mm256_sub_pd(vy_i, _mm256_loadu_pd(y + j));
+        __m256d r = _mm256_sqrt_pd(
+            _mm256_fmadd_pd(dx, dx, _mm256_mul_pd(dy, dy)));
+        __m256d d = _mm256_add_pd(r, veps);
+        __m256d inv = _mm256_div_pd(vone, _mm256_mul_pd(_mm256_mul_pd(d, d), d));
+        __m256d f_j = _mm256_mul_pd(inv, _mm256_loadu_pd(m + j));
+        vax = _mm256_fnmadd_pd(f_j, dx, vax);
+        vay = _mm256_fnmadd_pd(f_j, dy, vay);
+        if (potential) {
+            vpot = _mm256_fmadd_pd(_mm256_mul_pd(f_j, _mm256_add_pd(r, d)), d,
+                                   vpot);
+        }
+        __m256d f_i = _mm256_mul_pd(inv, vfactor_i);
+        _mm256_storeu_pd(cx + j,
+                         _mm256_fmadd_pd(f_i, dx, _mm256_loadu_pd(cx + j)));
+        _mm256_storeu_pd(cy + j,
+                         _mm256_fmadd_pd(f_i, dy, _mm256_loadu_pd(cy + j)));
+    }
+    __m256d sum = _mm256_hadd_pd(vax, vay);
+    __m128d halves = _mm_add_pd(_mm256_castpd256_pd128(sum),
+                                _mm256_extractf128_pd(sum, 1));
+    ax = _mm_cvtsd_f64(halves);
+    ay = _mm_cvtsd_f64(_mm_unpackhi_pd(halves, halves));
+    __m128d pots = _mm_add_pd(_mm256_castpd256_pd128(vpot),
+                              _mm256_extractf128_pd(vpot, 1));
+    pot = _mm_cvtsd_f64(_mm_add_sd(pots, _mm_unpackhi_pd(pots, pots)));
+#endif
+
+    // Scalar remainder, and the whole row without vector support
+    for (; j < j_end; j++) {
+        double dx = x_i - x[j];
+        double dy = y_i - y[j];
+        double r = sqrt(dx * dx + dy * dy);
+        double d = r + epsilon;
+        double inv = 1.0 / (d * d * d);
+        double f_j = inv * m[j];
+        ax -= f_j * dx;
+        ay -= f_j * dy;
+        if (potential) {
+            pot += f_j * (r + d) * d;
+        }
+        double f_i = inv * factor_i;
+        cx[j] += f_i * dx;
+        cy[j] += f_i * dy;
+    }
+
+    *accel_x = ax;
+    *accel_y = ay;
+    if (potential) {
+        *potential = pot;
+    }
+}
+
+static inline void rows(const struct ParticleStore *particles, int row_begin,
+                        int row_end, int tile, double G, double epsilon,
+                        double scale, struct ParticleChange *changes,
+                        double *potential) {
+    const int n = particles->n;
+    const double factor = G * scale;
+    double pot = 0;
+
+    // Walk the triangle in tile x tile blocks, so that the i-block and the
+    // j-block it is paired with stay in cache while all their pairs are done,
+    // instead of streaming the whole j-range through the cache for every row
+    for (int ib = row_begin; ib < row_end; ib += tile) {
+        int ie = ib + tile < row_end ? ib + tile : row_end;
+
+        for (int jb = ib; jb < n; jb += tile) {
+            int je = jb + tile < n ? jb + tile : n;
+            for (int i = ib; i < ie; i++) {
+                // On the diagonal block only the pairs with j > i are done
+                int j_begin = jb > i ? jb : i + 1;
+                double accel_x, accel_y, row_potential;
+                interact_row(particles, i, j_begin, je, factor, epsilon,
+                             changes, &accel_x, &accel_y,
+                             potential ? &row_potential : NULL);
+                changes->x_velocity[i] += factor * accel_x;
+                changes->y_velocity[i] += factor * accel_y;
+                if (potential) {
+                    pot -= 0.5 * G * particles->mass[i] * row_potential;
+                }
+            }
+        }
+    }
+    if (potential) {
+        *potential += pot;
+    }
+}
+
+void direct_rows(const struct ParticleStore *particles, int row_begin,
+                 int row_end, int tile, double G, double epsilon, double scale,
+                 struct ParticleChange *changes) {
+    rows(particles, row_begin, row_end, tile, G, epsilon, scale, changes,
+         NULL);
+}
+
+void direct_rows_energy(const struct ParticleStore *particles, int row_begin,
+                        int row_end, int tile, double G, double epsilon,
+                        double scale, struct ParticleChange *changes,
+                        double *potential) {
+    rows(particles, row_begin, row_end, tile, G, epsilon, scale, changes,
+         potential);
+}
+
+void float_store_alloc(struct FloatStore *store, int n) {
+    // Rounded up to whole cache lines like alloc_doubles()
+    size_t size = ((sizeof(float) * n + 63) / 64) * 64;
+    store->n = n;
+    store->x_pos = aligned_alloc(64, size ? size : 64);
+    store->y_pos = aligned_alloc(64, size ? size : 64);
+    store->mass = aligned_alloc(64, size ? size : 64);
+    if (!store->x_pos || !store->y_pos || !store->mass) {
+        fprintf(stderr, "Error allocating particle arrays\n");
+        exit(1);
+    }
+}
+
+void float_store_free(struct FloatStore *store) {
+    free(store->x_pos);
+    free(store->y_pos);
+    free(store->mass);
+}
+
+void float_store_update(struct FloatStore *store,
+                        const struct ParticleStore *particles) {
+    for (int i = 0; i < store->n; i++) {
+        store->x_pos[i] = (float)particles->x_pos[i];
+        store->y_pos[i] = (float)particles->y_pos[i];
+        store->mass[i] = (float)particles->mass[i];
+    }
+}
+
+// Mixed-precision version of interact_row(). The pair terms are computed in
+// float and widened to double per vector before they are added, to the row
+// sums for particle i as well as to the changes of the j.
+static inline void interact_row_mixed(const struct FloatStore *p, int i,
+                                      int j_begin, int j_end, double factor,
+                                      float epsilon,
+                                      struct ParticleChange *changes,
+                                      double *accel_x, double *accel_y) {
+    const float *restrict x = p->x_pos;
+    const float *restrict y = p->y_pos;
+    const float *restrict m = p->mass;
+    double *restrict cx = changes->x_velocity;
+    double *restrict cy = changes->y_velocity;
+    const float x_i = x[i];
+    const float y_i = y[i];
+    const float factor_i = (float)(factor * m[i]);
+    double ax = 0;
+    double ay = 0;
+    int j = j_begin;
+
+#if defined(__AVX512F__)
+    const __m512 vx_i = _mm512_set1_ps(x_i);
+    const __m512 vy_i = _mm512_set1_ps(y_i);
+    const __m512 veps = _mm512_set1_ps(epsilon);
+    const __m512 vone = _mm512_set1_ps(1.0f);
+    const __m512 vfactor_i = _mm512_set1_ps(factor_i);
+    __m512d vax = _mm512_setzero_pd();
+    __m512d vay = _mm512_setzero_pd();
+    while (j < j_end) {
+        __mmask16 mask =
+            j_end - j >= 16 ? 0xffff : (__mmask16)((1u << (j_end - j)) - 1);
+        __m512 dx = _mm512_sub_ps(vx_i, _mm512_maskz_loadu_ps(mask, x + j));
+        __m512 dy = _mm512_sub_ps(vy_i, _mm512_maskz_loadu_ps(mask, y + j));
+        __m512 r = _mm512_sqrt_ps(_mm512_fmadd_ps(dx, dx, _mm512_mul_ps(dy, dy)));
+        __m512 d = _mm512_add_ps(r, veps);
+        __m512 inv = _mm512_div_ps(vone, _mm512_mul_ps(_mm512_mul_ps(d, d), d));
+        __m512 f_j = _mm512_mul_ps(inv, _mm512_maskz_loadu_ps(mask, m + j));
+        __m512 pull_x = _mm512_mul_ps(f_j, dx);
+        __m512 pull_y = _mm512_mul_ps(f_j, dy);
+        __m512 f_i = _mm512_mul_ps(inv, vfactor_i);
+        __m512 change_x = _mm512_mul_ps(f_i, dx);
+        __m512 change_y = _mm512_mul_ps(f_i, dy);
+
+        // Widen both halves of the 16 float lanes to double before adding
+        __mmask8 low = (__mmask8)mask;
+        __mmask8 high = (__mmask8)(mask >> 8);
+        __m512d low_x = _mm512_cvtps_pd(_mm512_castps512_ps256(change_x));
+        __m512d high_x = _mm512_cvtps_pd(_mm256_castpd_ps(
+            _mm512_extractf64x4_pd(_mm512_castps_pd(change_x), 1)));
+        __m512d low_y = _mm512_cvtps_pd(_mm512_castps512_ps256(change_y));
+        __m512d high_y = _mm512_cvtps_pd(_mm256_castpd_ps(
+            _mm512_extractf64x4_pd(_mm512_castps_pd(change_y), 1)));
+        _mm512_mask_storeu_pd(
+            cx + j, low,
+            _mm512_add_pd(_mm512_maskz_loadu_pd(low, cx + j), low_x));
+        _mm512_mask_storeu_pd(
+            cy + j, low,
+            _mm512_add_pd(_mm512_maskz_loadu_pd(low, cy + j), low_y));
+        _mm512_mask_storeu_pd(
+            cx + j + 8, high,
+            _mm512_add_pd(_mm512_maskz_loadu_pd(high, cx + j + 8), high_x));
+        _mm512_mask_storeu_pd(
+            cy + j + 8, high,
+            _mm512_add_pd(_mm512_maskz_loadu_pd(high, cy + j + 8), high_y));
+        // Masked-off lanes of pull_x and pull_y are zero
+        vax = _mm512_sub_pd(vax,
+                            _mm512_cvtps_pd(_mm512_castps512_ps256(pull_x)));
+        vax = _mm512_sub_pd(vax, _mm512_cvtps_pd(_mm256_castpd_ps(
+                                     _mm512_extractf64x4_pd(
+                                         _mm512_castps_pd(pull_x), 1))));
+        vay = _mm512_sub_pd(vay,
+                            _mm512_cvtps_pd(_mm512_castps512_ps256(pull_y)));
+        vay = _mm512_sub_pd(vay, _mm512_cvtps_pd(_mm256_castpd_ps(
+                                     _mm512_extractf64x4_pd(
+                                         _mm512_castps_pd(pull_y), 1))));
+        j += 16;
+    }
+    ax = _mm512_reduce_add_pd(vax);
+    ay = _mm512_reduce_add_pd(vay);
+#elif defined(__AVX2__) && defined(__FMA__)
+    const __m256 vx_i = _mm256_set1_ps(x_i);
+    const __m256 vy_i = _mm256_set1_ps(y_i);
+    const __m256 veps = _mm256_set1_ps(epsilon);
+    const __m256 vone = _mm256_set1_ps(1.0f);
+    const __m256 vfactor_i = _mm256_set1_ps(factor_i);
+    __m256d vax = _mm256_setzero_pd();
+    __m256d vay = _mm256_setzero_pd();
+    for (; j + 8 <= j_end; j += 8) {
+        __m256 dx = _mm256_sub_ps(vx_i, _mm256_loadu_ps(x + j));
+        __m256 dy = _mm256_sub_ps(vy_i, _mm256_loadu_ps(y + j));
+        __m256 r = _mm256_sqrt_ps(_mm256_fmadd_ps(dx, dx, _mm256_mul_ps(dy, dy)));
+        __m256 d = _mm256_add_ps(r, veps);
+        __m256 inv = _mm256_div_ps(vone, _mm256_mul_ps(_mm256_mul_ps(d, d), d));
+        __m256 f_j = _mm256_mul_ps(inv, _mm256_loadu_ps(m + j));
+        __m256 pull_x = _mm256_mul_ps(f_j, dx);
+        __m256 pull_y = _mm256_mul_ps(f_j, dy);
+        __m256 f_i = _mm256_mul_ps(inv, vfactor_i);
+        __m256 change_x = _mm256_mul_ps(f_i, dx);
+        __m256 change_y = _mm256_mul_ps(f_i, dy);
+
+        // Widen both halves of the 8 float lanes to double before adding
+        _mm256_storeu_pd(
+            cx + j, _mm256_add_pd(_mm256_loadu_pd(cx + j),
+                                  _mm256_cvtps_pd(_mm256_castps256_ps128(change_x))));
+        _mm256_storeu_pd(
+            cy + j, _mm256_add_pd(_mm256_loadu_pd(cy + j),
+                                  _mm256_cvtps_pd(_mm256_castps256_ps128(change_y))));
+        _mm256_storeu_pd(
+            cx + j + 4,
+            _mm256_add_pd(_mm256_loadu_pd(cx + j + 4),
+                          _mm256_cvtps_pd(_mm256_extractf128_ps(change_x, 1))));
+        _mm256_storeu_pd(
+            cy + j + 4,
+            _mm256_add_pd(_mm256_loadu_pd(cy + j + 4),
+                          _mm256_cvtps_pd(_mm256_extractf128_ps(change_y, 1))));
+        vax = _mm256_sub_pd(vax,
+                            _mm256_cvtps_pd(_mm256_castps256_ps128(pull_x)));
+        vax = _mm256_sub_pd(vax,
+                            _mm256_cvtps_pd(_mm256_extractf128_ps(pull_x, 1)));
+        vay = _mm256_sub_pd(vay,
+                            _mm256_cvtps_pd(_mm256_castps256_ps128(pull_y)));
+        vay = _mm256_sub_pd(vay,
+                            _mm256_cvtps_pd(_mm256_extractf128_ps(pull_y, 1)));
+    }
+    // sum = (ax0 + ax1, ay0 + ay1, ax2 + ax3, ay2 + ay3)
+    __m256d sum = _mm256_hadd_pd(vax, vay);
+    __m128d both = _mm_add_pd(_mm256_castpd256_pd128(sum),
+                              _mm256_extractf128_pd(sum, 1));
+    ax = _mm_cvtsd_f64(both);
+    ay = _mm_cvtsd_f64(_mm_unpackhi_pd(both, both));
+#endif
+
+    // Scalar remainder, and the whole row without vector support
+    for (; j < j_end; j++) {
+        float dx = x_i - x[j];
+        float dy = y_i - y[j];
+        float d = sqrtf(dx * dx + dy * dy) + epsilon;
+        float inv = 1.0f / (d * d * d);
+        float f_j = inv * m[j];
+        ax -= (double)(f_j * dx);
+        ay -= (double)(f_j * dy);
+        float f_i = inv * factor_i;
+        cx[j] += (double)(f_i * dx);
+        cy[j] += (double)(f_i * dy);
+    }
+
+    *accel_x = ax;
+    *accel_y = ay;
+}
+
+void direct_rows_mixed(const struct FloatStore *particles, int row_begin,
+                       int row_end, int tile, double G, double epsilon,
+                       double scale, struct ParticleChange *changes) {
+    const int n = particles->n;
+    const double factor = G * scale;
+
+    for (int ib = row_begin; ib < row_end; ib += tile) {
+        int ie = ib + tile < row_end ? ib + tile : row_end;
+
+        for (int jb = ib; jb < n; jb += tile) {
+            int je = jb + tile < n ? jb + tile : n;
+            for (int i = ib; i < ie; i++) {
+                int j_begin = jb > i ? jb : i + 1;
+                double accel_x, accel_y;
+                interact_row_mixed(particles, i, j_begin, je, factor,
+                                   (float)epsilon, changes, &accel_x,
+                                   &accel_y);
+                changes->x_velocity[i] += factor * accel_x;
+                changes->y_velocity[i] += factor * accel_y;
+            }
+        }
+    }
+}
+
+void integrate(struct ParticleStore *particles,
+               const struct ParticleChange *changes, double delta_time) {
+    double *restrict x_pos = particles->x_pos;
+    double *restrict y_pos = particles->y_pos;
+    double *restrict x_velocity = particles->x_velocity;
+    double *restrict y_velocity = particles->y_velocity;
+    const double *restrict x_change = changes->x_velocity;
+    const double *restrict y_change = changes->y_velocity;
+    for (int i = 0; i < particles->n; i++) {
+        x_velocity[i] += x_change[i];
+        y_velocity[i] += y_change[i];
+
+        x_pos[i] += x_velocity[i] * delta_time;
+        y_pos[i] += y_velocity[i] * delta_time;
+    }
+}
+
+void integrate_energy(struct ParticleStore *particles,
+                      const struct ParticleChange *changes, double delta_time,
+                      struct Conserved *totals) {
+    double *restrict x_pos = particles->x_pos;
+    double *restrict y_pos = particles->y_pos;
+    double *restrict x_velocity = particles->x_velocity;
+    double *restrict y_velocity = particles->y_velocity;
+    const double *restrict mass = particles->mass;
+    const double *restrict x_change = changes->x_velocity;
+    const double *restrict y_change = changes->y_velocity;
+    double kinetic = 0;
+    double x_momentum = 0;
+    double y_momentum = 0;
+    for (int i = 0; i < particles->n; i++) {
+        kinetic += mass[i] * (x_velocity[i] * x_velocity[i] +
+                              y_velocity[i] * y_velocity[i]);
+        x_momentum += mass[i] * x_velocity[i];
+        y_momentum += mass[i] * y_velocity[i];
+
+        x_velocity[i] += x_change[i];
+        y_velocity[i] += y_change[i];
+
+        x_pos[i] += x_velocity[i] * delta_time;
+        y_pos[i] += y_velocity[i] * delta_time;
+    }
+    totals->kinetic += 0.5 * kinetic;
+    totals->x_momentum += x_momentum;
+    totals->y_momentum += y_momentum;
+}
+
+void accel_rows(const struct ParticleStore *particles, const int *rows,
+                int count, double G, double epsilon, double *x_accel,
+                double *y_accel, double *flyby) {
+    const double *restrict x = particles->x_pos;
+    const double *restrict y = particles->y_pos;
+    const double *restrict m = particles->mass;
+    const double *restrict vx = particles->x_velocity;
+    const double *restrict vy = particles->y_velocity;
+    for (int k = 0; k < count; k++) {
+        const double x_i = x[rows[k]];
+        const double y_i = y[rows[k]];
+        const double vx_i = vx[rows[k]];
+        const double vy_i = vy[rows[k]];
+        double ax = 0;
+        double ay = 0;
+        // Squared flyby time; the self term has no relative velocity and
+        // is left out by the tiny denominator offset
+        double shortest = 1e300;
+        // The particle itself has zero separation and adds no acceleration
+        for (int j = 0; j < particles->n; j++) {
+            double dx = x_i - x[j];
+            double dy = y_i - y[j];
+            double d = sqrt(dx * dx + dy * dy) + epsilon;
+            double f = m[j] / (d * d * d);
+            ax -= f * dx;
+            ay -= f * dy;
+            double dvx = vx_i - vx[j];
+            double dvy = vy_i - vy[j];
+            double t = d * d / (dvx * dvx + dvy * dvy + 1e-300);
+            shortest = t < shortest ? t : shortest;
+        }
+        x_accel[k] = G * ax;
+        y_accel[k] = G * ay;
+        flyby[k] = sqrt(shortest);
+    }
+}
+
+void accel_block(const double *restrict x_i, const double *restrict y_i,
+                 int count_i, const double *restrict x_j,
+                 const double *restrict y_j, const double *restrict m_j,
+                 int count_j, int tile, double factor, double epsilon,
+                 double *restrict x_change, double *restrict y_change) {
+    for (int jb = 0; jb < count_j; jb += tile) {
+        int je = jb + tile < count_j ? jb + tile : count_j;
+        for (int i = 0; i < count_i; i++) {
+            double ax = 0;
+            double ay = 0;
+            // A particle paired with itself has zero separation and adds
+            // nothing
+            for (int j = jb; j < je; j++) {
+                double dx = x_i[i] - x_j[j];
+                double dy = y_i[i] - y_j[j];
+                double d = sqrt(dx * dx + dy * dy) + epsilon;
+                double f = m_j[j] / (d * d * d);
+                ax -= f * dx;
+                ay -= f * dy;
+            }
+            x_change[i] += factor * ax;
+            y_change[i] += factor * ay;
+        }
+    }
+}
+
+// Interacts particle i with the particles j_begin <= j < j_end like
+// interact_row(), adding the jerk as well. With v the relative velocity and
+// d = r + epsilon, the pair jerk is G m (v - 3 (x . v) / (r d) x) / d^3.
+// The arrays are passed separately so that the compiler knows they do not
+// overlap and vectorises the loop.
+static inline void jerk_row(int i, int j_begin, int j_end, double G,
+                            double epsilon, const double *restrict x,
+                            const double *restrict y,
+                            const double *restrict vx,
+                            const double *restrict vy,
+                            const double *restrict m, double *restrict ax_j,
+                            double *restrict ay_j, double *restrict jx_j,
+                            double *restrict jy_j) {
+    const double x_i = x[i];
+    const double y_i = y[i];
+    const double vx_i = vx[i];
+    const double vy_i = vy[i];
+    const double factor_i = G * m[i];
+    double ax = 0;
+    double ay = 0;
+    double jx = 0;
+    double jy = 0;
+    for (int j = j_begin; j < j_end; j++) {
+        double dx = x_i - x[j];
+        double dy = y_i - y[j];
+        double dvx = vx_i - vx[j];
+        double dvy = vy_i - vy[j];
+        double r = sqrt(dx * dx + dy * dy);
+        double d = r + epsilon;
+        double inv = 1.0 / (d * d * d);
+        // Coincident particles have x . v = 0 and the offset keeps the
+        // quotient at zero
+        double s = 3 * (dx * dvx + dy * dvy) / (r * d + 1e-300);
+        double wx = dvx - s * dx;
+        double wy = dvy - s * dy;
+        double f_j = inv * m[j];
+        ax -= f_j * dx;
+        ay -= f_j * dy;
+        jx -= f_j * wx;
+        jy -= f_j * wy;
+        double f_i = inv * factor_i;
+        ax_j[j] += f_i * dx;
+        ay_j[j] += f_i * dy;
+        jx_j[j] += f_i * wx;
+        jy_j[j] += f_i * wy;
+    }
+    ax_j[i] += G * ax;
+    ay_j[i] += G * ay;
+    jx_j[i] += G * jx;
+    jy_j[i] += G * jy;
+}
+
+void direct_rows_jerk(const struct ParticleStore *particles, int row_begin,
+                      int row_end, int tile, double G, double epsilon,
+                      struct ParticleChange *accel,
+                      struct ParticleChange *jerk) {
+    const int n = particles->n;
+    for (int ib = row_begin; ib < row_end; ib += tile) {
+        int ie = ib + tile < row_end ? ib + tile : row_end;
+        for (int jb = ib; jb < n; jb += tile) {
+            int je = jb + tile < n ? jb + tile : n;
+            for (int i = ib; i < ie; i++) {
+                int j_begin = jb > i ? jb : i + 1;
+                jerk_row(i, j_begin, je, G, epsilon, particles->x_pos,
+                         particles->y_pos, particles->x_velocity,
+                         particles->y_velocity, particles->mass,
+                         accel->x_velocity, accel->y_velocity,
+                         jerk->x_velocity, jerk->y_velocity);
+            }
+        }
+    }
+}
+
+const struct KernelTable KERNEL_NAME(kernel_table, KERNEL_ISA) = {
+    KERNEL_QUOTE(KERNEL_ISA), direct_rows,       float_store_alloc,
+    float_store_free,         float_store_update, direct_rows_mixed,
+    integrate,                accel_rows,         accel_block,
+    direct_rows_jerk,         direct_rows_energy, integrate_energy};
@@ -0,0 +1,139 @@
+#ifndef KERNELS_H
+#define KERNELS_H
+
+#include "galsim.h"
+
+// The functions below are compiled once per instruction set from kernels.c
+// and reach the variant picked by kernels_select() through a table
+
+// Adds scale * acceleration to changes for every pair (i, j) with
+// row_begin <= i < row_end and i < j < n, using Newton's third law to update
+// both particles of a pair. With scale = delta_time this gives the velocity
+// change of a step. The pairs are visited in blocks of tile x tile particles.
+void direct_rows(const struct ParticleStore *particles, int row_begin,
+                 int row_end, int tile, double G, double epsilon, double scale,
+                 struct ParticleChange *changes);
+
+// Single-precision copy of the hot fields, refreshed every step for the
+// mixed-precision kernel
+struct FloatStore {
+    int n;
+    float *x_pos;
+    float *y_pos;
+    float *mass;
+};
+
+void float_store_alloc(struct FloatStore *store, int n);
+void float_store_free(struct FloatStore *store);
+void float_store_update(struct FloatStore *store,
+                        const struct ParticleStore *particles);
+
+// Same as direct_rows(), but distances and forces are computed in float,
+// with twice as many lanes per vector, while the velocity changes are still
+// accumulated in double
+void direct_rows_mixed(const struct FloatStore *particles, int row_begin,
+                       int row_end, int tile, double G, double epsilon,
+                       double scale, struct ParticleChange *changes);
+
+// Symplectic Euler update: adds the velocity changes, then moves every
+// particle with its new velocity
+void integrate(struct ParticleStore *particles,
+               const struct ParticleChange *changes, double delta_time);
+
+// Acceleration of the particles rows[0..count-1] from all particles, one
+// sided so that any subset can be updated, and the shortest flyby time
+// (r + epsilon) / |v_i - v_j| of each over all other particles
+void accel_rows(const struct ParticleStore *particles, const int *rows,
+                int count, double G, double epsilon, double *x_accel,
+                double *y_accel, double *flyby);
+
+// Adds factor times the acceleration of the count_i particles at (x_i, y_i)
+// from the count_j particles at (x_j, y_j) with masses m_j, one sided, in
+// j-blocks of tile particles. The two sets may be the same.
+void accel_block(const double *x_i, const double *y_i, int count_i,
+                 const double *x_j, const double *y_j, const double *m_j,
+                 int count_j, int tile, double factor, double epsilon,
+                 double *x_change, double *y_change);
+
+// Adds the acceleration and jerk to accel and jerk for the same pairs and
+// blocks as direct_rows(), for the Hermite integrator
+void direct_rows_jerk(const struct ParticleStore *particles, int row_begin,
+                      int row_end, int tile, double G, double epsilon,
+                      struct ParticleChange *accel,
+                      struct ParticleChange *jerk);
+
+// Totals of the conserved quantities, for the diagnostics
+struct Conserved {
+    double kinetic;
+    double potential;
+    double x_momentum;
+    double y_momentum;
+};
+
+// direct_rows() that also adds the potential energy of its pairs to
+// *potential, with the pair potential whose gradient is the softened force
+void direct_rows_energy(const struct ParticleStore *particles, int row_begin,
+                        int row_end, int tile, double G, double epsilon,
+                        double scale, struct ParticleChange *changes,
+                        double *potential);
+
+// integrate() that also adds the kinetic energy and momentum of the
+// velocities before the update to totals
+void integrate_energy(struct ParticleStore *particles,
+                      const struct ParticleChange *changes, double delta_time,
+                      struct Conserved *totals);
+
+// Instruction sets of the kernel variants: baseline x86-64, x86-64-v3
+// (AVX2, FMA) and x86-64-v4 (AVX-512)
+enum KernelIsa { ISA_AUTO, ISA_SSE2, ISA_AVX2, ISA_AVX512 };
+
+struct KernelTable {
+    const char *name;
+    void (*direct_rows_fn)(const struct ParticleStore *, int, int, int,
+                           double, double, double, struct ParticleChange *);
+    void (*float_store_alloc_fn)(struct FloatStore *, int);
+    void (*float_store_free_fn)(struct FloatStore *);
+    void (*float_store_update_fn)(struct FloatStore *,
+                                  const struct ParticleStore *);
+    void (*direct_rows_mixed_fn)(const struct FloatStore *, int, int, int,
+                                 double, double, double,
+                                 struct ParticleChange *);
+    void (*integrate_fn)(struct ParticleStore *,
+                         const struct ParticleChange *, double);
+    void (*accel_rows_fn)(const struct ParticleStore *, const int *, int,
+                          double, double, double *, double *, double *);
+    void (*accel_block_fn)(const double *, const double *, int,
+                           const double *, const double *, const double *,
+                           int, int, double, double, double *, double *);
+    void (*direct_rows_jerk_fn)(const struct ParticleStore *, int, int, int,
+                                double, double, struct ParticleChange *,
+                                struct ParticleChange *);
+    void (*direct_rows_energy_fn)(const struct ParticleStore *, int, int, int,
+                                  double, double, double,
+                                  struct ParticleChange *, double *);
+    void (*integrate_energy_fn)(struct ParticleStore *,
+                                const struct ParticleChange *, double,
+                                struct Conserved *);
+};
+
+extern const struct KernelTable kernel_table_sse2;
+extern const struct KernelTable kernel_table_avx2;
+extern const struct KernelTable kernel_table_avx512;
+
+// Picks the variant for isa, or with ISA_AUTO the widest one the CPU runs,
+// and exits if the CPU lacks the requested instruction set. Without a call
+// the first kernel call picks automatically, so programs that run kernels
+// from several threads should call it first.
+void kernels_select(enum KernelIsa isa);
+const char *kernels_name(void);
+
+// For hot loops outside this file, such as the tree solvers: GCC compiles
+// the function for each instruction set and picks one when the program loads
+#define CPU_CLONES                                                             \
+    __attribute__((target_clones("default", "arch=x86-64-v3",                 \
+                                 "arch=x86-64-v4")))
+
+// Block size whose i- and j-blocks together fit in a 48 KB L1 data cache
+#define DEFAULT_TILE 256
+
+#endif
@@ -0,0 +1,167 @@
+#include "memory.h"
+
+#include <linux/mempolicy.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "pool.h"
+
+#define HUGE_PAGE (2UL << 20)
+#define MAX_NODES 1024
+
+// Sits in the 64 bytes before the first column and remembers the mapping
+struct MemoryHeader {
+    _Alignas(64) void *mapping;
+    size_t size;
+};
+
+struct TouchJob {
+    char *columns;
+    int count;
+    int n;
+    int nblocks;
+    // Set once a block has been zeroed
+    atomic_bool *touched;
+};
+
+static enum PagePolicy page_policy = PAGES_HUGE;
+static enum NumaPolicy numa_policy = NUMA_LOCAL;
+
+void memory_configure(enum PagePolicy pages, enum NumaPolicy numa) {
+    page_policy = pages;
+    numa_policy = numa;
+}
+
+size_t memory_stride(int n) { return ((sizeof(double) * n + 63) / 64) * 64; }
+
+// Sets the bits of the online nodes, as listed in sysfs ("0-1,4"), and
+// returns their number
+static int online_nodes(unsigned long *mask) {
+    FILE *file = fopen("/sys/devices/system/node/online", "r");
+    if (!file) {
+        return 0;
+    }
+    int nodes = 0;
+    int first, last;
+    while (fscanf(file, "%d", &first) == 1) {
+        last = first;
+        if (fscanf(file, "-%d", &last) != 1) {
+            last = first;
+        }
+        for (int node = first; node <= last && node < MAX_NODES; node++) {
+            mask[node / (8 * sizeof(long))] |= 1UL << node % (8 * sizeof(long));
+            nodes++;
+        }
+        if (fgetc(file) != ',') {
+            break;
+        }
+    }
+    fclose(file);
+    return nodes;
+}
+
+static void interleave(void *region, size_t size) {
+    unsigned long mask[MAX_NODES / (8 * sizeof(long))] = {0};
+    if (online_nodes(mask) < 2) {
+        return;
+    }
+    if (syscall(SYS_mbind, region, size, MPOL_INTERLEAVE, mask, MAX_NODES,
+                0) != 0) {
+        fprintf(stderr, "Warning: cannot interleave the particle arrays\n");
+    }
+}
+
+// Returns a region of at least size bytes, aligned to a huge page if it
+// spans any, and its actual extent in mapping and mapped
+static char *map_region(size_t size, void **mapping, size_t *mapped) {
+    const int protection = PROT_READ | PROT_WRITE;
+    const int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+    if (page_policy == PAGES_HUGE && size >= HUGE_PAGE) {
+        size_t huge_size = (size + HUGE_PAGE - 1) & ~(HUGE_PAGE - 1);
+        char *region =
+            mmap(NULL, huge_size, protection, flags | MAP_HUGETLB, -1, 0);
+        if (region != MAP_FAILED) {
+            *mapping = region;
+            *mapped = huge_size;
+            return region;
+        }
+        // No reserved huge pages: over-map to align, and ask for
+        // transparent ones
+        region = mmap(NULL, huge_size + HUGE_PAGE, protection, flags, -1, 0);
+        if (region != MAP_FAILED) {
+            *mapping = region;
+            *mapped = huge_size + HUGE_PAGE;
+            char *aligned =
+                (char *)(((uintptr_t)region + HUGE_PAGE - 1) & ~(HUGE_PAGE - 1));
+            madvise(aligned, huge_size, MADV_HUGEPAGE);
+            return aligned;
+        }
+    } else {
+        char *region = mmap(NULL, size, protection, flags, -1, 0);
+        if (region != MAP_FAILED) {
+            *mapping = region;
+            *mapped = size;
+            return region;
+        }
+    }
+    fprintf(stderr, "Error allocating particle arrays\n");
+    exit(1);
+}
+
+static void touch_block(struct TouchJob *job, int block) {
+    if (atomic_exchange(&job->touched[block], true)) {
+        return;
+    }
+    int begin = (long)job->n * block / job->nblocks;
+    int end = (long)job->n * (block + 1) / job->nblocks;
+    for (int c = 0; c < job->count; c++) {
+        double *column = (double *)(job->columns + c * memory_stride(job->n));
+        memset(column + begin, 0, sizeof(double) * (end - begin));
+    }
+}
+
+// Zeroes the block of the worker that runs it, whichever tile that is
+static void touch_tile(void *arg, int worker, int tile) {
+    (void)tile;
+    touch_block(arg, worker);
+}
+
+double *memory_columns(int count, int n) {
+    size_t size = sizeof(struct MemoryHeader) + count * memory_stride(n);
+    void *mapping;
+    size_t mapped;
+    char *region = map_region(size, &mapping, &mapped);
+    if (numa_policy == NUMA_INTERLEAVE) {
+        interleave(region, size);
+    }
+    struct MemoryHeader *header = (struct MemoryHeader *)region;
+    header->mapping = mapping;
+    header->size = mapped;
+
+    char *columns = region + sizeof(struct MemoryHeader);
+    struct TouchJob job = {columns, count, n, pool_threads(), NULL};
+    job.touched = calloc(job.nblocks, sizeof(atomic_bool));
+    if (!job.touched) {
+        fprintf(stderr, "Error allocating particle arrays\n");
+        exit(1);
+    }
+    pool_run(job.nblocks, touch_tile, &job);
+    // The blocks of workers whose only tile was stolen
+    for (int block = 0; block < job.nblocks; block++) {
+        touch_block(&job, block);
+    }
+    free(job.touched);
+    return (double *)columns;
+}
+
+void memory_free(double *columns) {
+    struct MemoryHeader *header = (struct MemoryHeader *)columns - 1;
+    munmap(header->mapping, header->size);
+}
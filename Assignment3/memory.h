@@ -0,0 +1,34 @@
+#ifndef MEMORY_H
+#define MEMORY_H
+
+#include <stddef.h>
+
+// Page placement of the per-particle arrays of store_alloc() and
+// changes_alloc(). Each call maps its columns together in one anonymous
+// region, backed by 2 MB pages where possible to cut TLB misses: reserved
+// pages through MAP_HUGETLB if the system has them, otherwise transparent
+// huge pages requested with madvise, otherwise ordinary pages.
+//
+// The pages are placed under the kernel's first-touch policy: worker w of
+// the pool zeroes block w of pool_threads() equal blocks of each column,
+// which is the block pool_run() first hands worker w in any job of evenly
+// sized tiles, such as the reduction of the force buffers. Work that is
+// stolen, the paired row blocks of the direct solver and the tree order of
+// Barnes-Hut do not follow this placement. NUMA_INTERLEAVE spreads the
+// pages over all nodes instead, for when the access pattern has no
+// locality. Start the pool before allocating for the placement to matter.
+enum PagePolicy { PAGES_HUGE, PAGES_SMALL };
+enum NumaPolicy { NUMA_LOCAL, NUMA_INTERLEAVE };
+
+void memory_configure(enum PagePolicy pages, enum NumaPolicy numa);
+
+// Maps count zeroed columns of n doubles, each 64-byte aligned and
+// memory_stride(n) bytes after the previous one, and returns the first
+// column, or exits on failure
+double *memory_columns(int count, int n);
+size_t memory_stride(int n);
+
+// Unmaps columns from memory_columns()
+void memory_free(double *columns);
+
+#endif
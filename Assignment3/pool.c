@@ -0,0 +1,132 @@
+#include "pool.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// Each worker owns the tiles [next, end) of the current job. Owners and
+// thieves both claim tiles with an atomic increment of next. Every queue
+// gets its own cache line so that claiming does not cause false sharing.
+struct WorkQueue {
+    _Alignas(64) atomic_int next;
+    int end;
+};
+
+static int nthreads = 1;
+static pthread_t *threads;
+static struct WorkQueue *queues;
+static pthread_barrier_t start_barrier;
+static pthread_barrier_t finish_barrier;
+// The job of the current pool_run(), which only one thread outside the
+// tasks may call at a time
+static pool_task current_task;
+static void *current_arg;
+static atomic_bool running;
+static bool shutting_down;
+// Set while a thread runs a tile, so that a job started from inside one
+// runs inline instead of waiting for the busy pool, and on the worker
+// that started it
+static _Thread_local bool inside_task;
+static _Thread_local int current_worker;
+
+static void run_tiles(int worker) {
+    // Drain the own queue first, then go round the others and steal
+    for (int v = 0; v < nthreads; v++) {
+        struct WorkQueue *queue = &queues[(worker + v) % nthreads];
+        int tile;
+        while ((tile = atomic_fetch_add_explicit(&queue->next, 1,
+                                                 memory_order_relaxed)) <
+               queue->end) {
+            inside_task = true;
+            current_worker = worker;
+            current_task(current_arg, worker, tile);
+            inside_task = false;
+        }
+    }
+}
+
+static void *worker_main(void *arg) {
+    int worker = (int)(intptr_t)arg;
+    for (;;) {
+        pthread_barrier_wait(&start_barrier);
+        if (shutting_down) {
+            break;
+        }
+        run_tiles(worker);
+        pthread_barrier_wait(&finish_barrier);
+    }
+    return NULL;
+}
+
+void pool_init(int count) {
+    nthreads = count < 1 ? 1 : count;
+    queues = aligned_alloc(64, sizeof(struct WorkQueue) * nthreads);
+    threads = malloc(sizeof(pthread_t) * nthreads);
+    if (!queues || !threads) {
+        fprintf(stderr, "Error allocating thread pool\n");
+        exit(1);
+    }
+    pthread_barrier_init(&start_barrier, NULL, nthreads);
+    pthread_barrier_init(&finish_barrier, NULL, nthreads);
+    shutting_down = false;
+
+    for (int w = 1; w < nthreads; w++) {
+        if (pthread_create(&threads[w], NULL, worker_main,
+                           (void *)(intptr_t)w) != 0) {
+            fprintf(stderr, "Error creating worker thread\n");
+            exit(1);
+        }
+    }
+}
+
+void pool_destroy(void) {
+    if (!threads) {
+        return;
+    }
+    shutting_down = true;
+    pthread_barrier_wait(&start_barrier);
+    for (int w = 1; w < nthreads; w++) {
+        pthread_join(threads[w], NULL);
+    }
+    pthread_barrier_destroy(&start_barrier);
+    pthread_barrier_destroy(&finish_barrier);
+    free(threads);
+    free(queues);
+    threads = NULL;
+    queues = NULL;
+    nthreads = 1;
+}
+
+int pool_threads(void) { return nthreads; }
+
+void pool_run(int ntiles, pool_task task, void *arg) {
+    if (!threads || inside_task) {
+        int worker = inside_task ? current_worker : 0;
+        for (int tile = 0; tile < ntiles; tile++) {
+            task(arg, worker, tile);
+        }
+        return;
+    }
+
+    if (atomic_exchange(&running, true)) {
+        fprintf(stderr, "pool_run called from two threads at once\n");
+        exit(1);
+    }
+    current_task = task;
+    current_arg = arg;
+    for (int w = 0; w < nthreads; w++) {
+        atomic_store_explicit(&queues[w].next,
+                              (int)((long)ntiles * w / nthreads),
+                              memory_order_relaxed);
+        queues[w].end = (int)((long)ntiles * (w + 1) / nthreads);
+    }
+
+    // The barriers publish the job to the workers and their results back
+    pthread_barrier_wait(&start_barrier);
+    run_tiles(0);
+    pthread_barrier_wait(&finish_barrier);
+    atomic_store(&running, false);
+}
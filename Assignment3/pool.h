@@ -0,0 +1,21 @@
+#ifndef POOL_H
+#define POOL_H
+
+// Runs one tile of a job on the given worker (0 <= worker < nthreads)
+typedef void (*pool_task)(void *arg, int worker, int tile);
+
+// Starts nthreads - 1 worker threads; the calling thread acts as worker 0
+void pool_init(int nthreads);
+void pool_destroy(void);
+int pool_threads(void);
+
+// Runs task on the tiles 0..ntiles-1 and returns when all of them are done.
+// The tiles are handed out as contiguous blocks, one per worker, and a worker
+// that runs out steals from the others, so callers should number the tiles
+// such that contiguous blocks have similar cost. Called from inside a
+// task, it runs the tiles on the calling worker, with its index. Only one
+// thread outside the tasks may be in pool_run() at a time; a second one
+// exits with an error.
+void pool_run(int ntiles, pool_task task, void *arg);
+
+#endif
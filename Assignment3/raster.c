@@ -0,0 +1,227 @@
+#include "raster.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct Splat splat_circle(float x, float y, float W, float H, float radius,
+                          float color, unsigned width, unsigned height,
+                          const float caxis[2]) {
+    struct Splat splat;
+    splat.left = (int)((x - radius) / W * width);
+    splat.top = height - (int)((y + radius) / H * height);
+    splat.diameter = 2 * (int)(radius / W * width);
+
+    if (color >= caxis[1])
+        splat.color = NUMCOLORS - 1;
+    else if (color < caxis[0])
+        splat.color = 0;
+    else
+        splat.color = (int)((color - caxis[0]) / (caxis[1] - caxis[0]) *
+                            (float)NUMCOLORS);
+    return splat;
+}
+
+double particle_radius(int n, double mass, double largest_particle) {
+    double radius = 0.1 / n * mass / largest_particle;
+    return radius > 0.002 ? radius : 0.002;
+}
+
+double particle_color(double brightness, double brightest) {
+    return 1.0 - brightness / brightest;
+}
+
+double color_level(int i) {
+    return (double)(NUMCOLORS - i) / (double)NUMCOLORS;
+}
+
+void framebuffer_alloc(struct Framebuffer *frame, unsigned width,
+                       unsigned height) {
+    frame->width = width;
+    frame->height = height;
+    frame->caxis[0] = 0;
+    frame->caxis[1] = 1;
+    frame->rgb = malloc(3 * (size_t)width * height);
+    if (!frame->rgb) {
+        fprintf(stderr, "Error allocating framebuffer\n");
+        exit(1);
+    }
+}
+
+void framebuffer_free(struct Framebuffer *frame) { free(frame->rgb); }
+
+void raster_band(struct Framebuffer *frame, unsigned row_begin,
+                 unsigned row_end, int n, const double *x, const double *y,
+                 const double *mass, const double *brightness,
+                 double largest_particle, double brightest) {
+    unsigned width = frame->width;
+    memset(frame->rgb + 3 * (size_t)row_begin * width, 0,
+           3 * (size_t)(row_end - row_begin) * width);
+
+    for (int p = 0; p < n; p++) {
+        double radius = particle_radius(n, mass[p], largest_particle);
+        struct Splat splat = splat_circle(
+            x[p], y[p], 1, 1, radius, particle_color(brightness[p], brightest),
+            width, frame->height, frame->caxis);
+        int top = splat.top;
+        int bottom = splat.top + splat.diameter;
+        if (splat.diameter == 0 || bottom <= (int)row_begin ||
+            top >= (int)row_end) {
+            continue;
+        }
+        // Fill the pixels whose centres lie inside the circle inscribed in
+        // the bounding box, like XFillArc
+        unsigned char level = (unsigned char)(255 * color_level(splat.color));
+        double half = 0.5 * splat.diameter;
+        double centre_x = splat.left + half;
+        double centre_y = splat.top + half;
+        int row_first = top > (int)row_begin ? top : (int)row_begin;
+        int row_last = bottom < (int)row_end ? bottom : (int)row_end;
+        int column_first = splat.left > 0 ? splat.left : 0;
+        int column_last = splat.left + splat.diameter;
+        if (column_last > (int)width) {
+            column_last = width;
+        }
+        for (int row = row_first; row < row_last; row++) {
+            double dy = row + 0.5 - centre_y;
+            unsigned char *line = frame->rgb + 3 * (size_t)row * width;
+            for (int column = column_first; column < column_last; column++) {
+                double dx = column + 0.5 - centre_x;
+                if (dx * dx + dy * dy <= half * half) {
+                    line[3 * column + 0] = level;
+                    line[3 * column + 1] = level;
+                    line[3 * column + 2] = level;
+                }
+            }
+        }
+    }
+}
+
+static void write_ppm(const struct Framebuffer *frame, FILE *file) {
+    fprintf(file, "P6\n%u %u\n255\n", frame->width, frame->height);
+    fwrite(frame->rgb, 3, (size_t)frame->width * frame->height, file);
+}
+
+static uint32_t crc_table[256];
+
+static void init_crc_table() {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = crc & 1 ? 0xedb88320u ^ (crc >> 1) : crc >> 1;
+        }
+        crc_table[i] = crc;
+    }
+}
+
+static uint32_t crc_update(uint32_t crc, const unsigned char *data,
+                           size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        crc = crc_table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+static void put_u32(unsigned char *out, uint32_t value) {
+    out[0] = value >> 24;
+    out[1] = value >> 16;
+    out[2] = value >> 8;
+    out[3] = value;
+}
+
+static void write_chunk(FILE *file, const char *type,
+                        const unsigned char *data, uint32_t size) {
+    unsigned char length[4];
+    put_u32(length, size);
+    fwrite(length, 1, 4, file);
+    uint32_t crc = crc_update(0xffffffffu, (const unsigned char *)type, 4);
+    crc = crc_update(crc, data, size) ^ 0xffffffffu;
+    fwrite(type, 1, 4, file);
+    if (size) {
+        fwrite(data, 1, size, file);
+    }
+    unsigned char checksum[4];
+    put_u32(checksum, crc);
+    fwrite(checksum, 1, 4, file);
+}
+
+// PNG with the image data in uncompressed deflate blocks, which needs no
+// compression library and keeps writing cheap
+static void write_png(const struct Framebuffer *frame, FILE *file) {
+    static const unsigned char signature[8] = {0x89, 'P',  'N',  'G',
+                                               '\r', '\n', 0x1a, '\n'};
+    if (!crc_table[1]) {
+        init_crc_table();
+    }
+    fwrite(signature, 1, 8, file);
+
+    unsigned char header[13];
+    put_u32(header, frame->width);
+    put_u32(header + 4, frame->height);
+    header[8] = 8;  // bits per channel
+    header[9] = 2;  // RGB
+    header[10] = 0; // deflate
+    header[11] = 0; // adaptive filtering
+    header[12] = 0; // no interlace
+    write_chunk(file, "IHDR", header, sizeof(header));
+
+    // Every row is prefixed with filter type 0
+    size_t row_size = 3 * (size_t)frame->width + 1;
+    size_t raw_size = row_size * frame->height;
+    size_t blocks = (raw_size + 65534) / 65535;
+    size_t data_size = 2 + raw_size + 5 * blocks + 4;
+    unsigned char *data = malloc(data_size);
+    unsigned char *raw = malloc(raw_size);
+    if (!data || !raw) {
+        fprintf(stderr, "Error allocating PNG buffer\n");
+        exit(1);
+    }
+    for (unsigned row = 0; row < frame->height; row++) {
+        raw[row * row_size] = 0;
+        memcpy(raw + row * row_size + 1,
+               frame->rgb + 3 * (size_t)row * frame->width, row_size - 1);
+    }
+
+    unsigned char *out = data;
+    *out++ = 0x78; // zlib header: deflate, 32K window
+    *out++ = 0x01;
+    uint32_t adler_a = 1, adler_b = 0;
+    for (size_t offset = 0; offset < raw_size; offset += 65535) {
+        size_t size = raw_size - offset < 65535 ? raw_size - offset : 65535;
+        *out++ = offset + size == raw_size; // final block flag
+        *out++ = size & 0xff;
+        *out++ = size >> 8;
+        *out++ = ~size & 0xff;
+        *out++ = (~size >> 8) & 0xff;
+        memcpy(out, raw + offset, size);
+        out += size;
+        for (size_t i = 0; i < size; i++) {
+            adler_a = (adler_a + raw[offset + i]) % 65521;
+            adler_b = (adler_b + adler_a) % 65521;
+        }
+    }
+    put_u32(out, (adler_b << 16) | adler_a);
+    write_chunk(file, "IDAT", data, data_size);
+    write_chunk(file, "IEND", NULL, 0);
+    free(raw);
+    free(data);
+}
+
+void raster_write(const struct Framebuffer *frame, const char *filename) {
+    FILE *file = fopen(filename, "wb");
+    if (!file) {
+        fprintf(stderr, "Error opening %s\n", filename);
+        exit(1);
+    }
+    size_t length = strlen(filename);
+    if (length >= 4 && strcmp(filename + length - 4, ".png") == 0) {
+        write_png(frame, file);
+    } else {
+        write_ppm(frame, file);
+    }
+    if (fclose(file) != 0) {
+        fprintf(stderr, "Error writing %s\n", filename);
+        exit(1);
+    }
+}
@@ -0,0 +1,52 @@
+#ifndef RASTER_H
+#define RASTER_H
+
+#define NUMCOLORS 512
+
+// Pixel footprint of a filled circle: the bounding box at (left, top) with
+// the given diameter, and its index into the color table
+struct Splat {
+    int left;
+    int top;
+    int diameter;
+    int color;
+};
+
+// Maps a circle of the given radius at (x, y) in a W x H domain onto a
+// width x height image, and its color value through caxis onto
+// 0..NUMCOLORS-1. This is the mapping DrawCircle uses on screen.
+struct Splat splat_circle(float x, float y, float W, float H, float radius,
+                          float color, unsigned width, unsigned height,
+                          const float caxis[2]);
+
+// Radius and color value a particle is drawn with
+double particle_radius(int n, double mass, double largest_particle);
+double particle_color(double brightness, double brightest);
+
+// Gray level of color table entry i, from white at 0 to black at NUMCOLORS
+double color_level(int i);
+
+// An RGB image in memory
+struct Framebuffer {
+    unsigned width;
+    unsigned height;
+    float caxis[2];
+    unsigned char *rgb;
+};
+
+void framebuffer_alloc(struct Framebuffer *frame, unsigned width,
+                       unsigned height);
+void framebuffer_free(struct Framebuffer *frame);
+
+// Clears the image rows row_begin <= row < row_end to black and draws all
+// particles onto them in order, so that bands can be drawn in parallel
+void raster_band(struct Framebuffer *frame, unsigned row_begin,
+                 unsigned row_end, int n, const double *x, const double *y,
+                 const double *mass, const double *brightness,
+                 double largest_particle, double brightest);
+
+// Writes the image as PNG if filename ends in .png and as binary PPM
+// otherwise, or exits on failure
+void raster_write(const struct Framebuffer *frame, const char *filename);
+
+#endif
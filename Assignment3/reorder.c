@@ -0,0 +1,271 @@
+#include "reorder.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pool.h"
+
+#define AXIS_BITS 21
+#define DIGIT_BITS 8
+#define BUCKETS (1 << DIGIT_BITS)
+// 42-bit keys in six passes, an even number, so the sorted keys end up
+// back in keys
+#define PASSES ((2 * AXIS_BITS + DIGIT_BITS - 1) / DIGIT_BITS)
+
+struct KeyJob {
+    struct Reorder *reorder;
+    const struct ParticleStore *particles;
+    double x_min;
+    double y_min;
+    double x_scale;
+    double y_scale;
+};
+
+struct SortJob {
+    struct Reorder *reorder;
+    int shift;
+    const uint64_t *keys_in;
+    const int *index_in;
+    uint64_t *keys_out;
+    int *index_out;
+};
+
+struct PermuteJob {
+    struct Reorder *reorder;
+    double *values;
+};
+
+void reorder_init(struct Reorder *reorder, int n, enum Curve curve) {
+    reorder->n = n;
+    reorder->curve = curve;
+    reorder->order = malloc(sizeof(int) * n);
+    reorder->index = malloc(sizeof(int) * n);
+    reorder->index_scratch = malloc(sizeof(int) * n);
+    reorder->order_scratch = malloc(sizeof(int) * n);
+    reorder->keys = malloc(sizeof(uint64_t) * n);
+    reorder->key_scratch = malloc(sizeof(uint64_t) * n);
+    reorder->scratch = alloc_doubles(n);
+    // A few tiles per worker, but not so many that the histograms dominate
+    reorder->ntiles = 4 * pool_threads();
+    if (reorder->ntiles > n / 1024 + 1) {
+        reorder->ntiles = n / 1024 + 1;
+    }
+    reorder->histograms = malloc(sizeof(int) * BUCKETS * reorder->ntiles);
+    if (!reorder->order || !reorder->index || !reorder->index_scratch ||
+        !reorder->order_scratch || !reorder->keys || !reorder->key_scratch ||
+        !reorder->histograms) {
+        fprintf(stderr, "Error allocating reordering buffers\n");
+        exit(1);
+    }
+    reorder_reset(reorder);
+}
+
+void reorder_free(struct Reorder *reorder) {
+    free(reorder->order);
+    free(reorder->index);
+    free(reorder->index_scratch);
+    free(reorder->order_scratch);
+    free(reorder->keys);
+    free(reorder->key_scratch);
+    free(reorder->scratch);
+    free(reorder->histograms);
+}
+
+void reorder_reset(struct Reorder *reorder) {
+    for (int i = 0; i < reorder->n; i++) {
+        reorder->order[i] = i;
+    }
+}
+
+static int tile_begin(const struct Reorder *reorder, int tile) {
+    return (long)reorder->n * tile / reorder->ntiles;
+}
+
+// Spreads the low 21 bits of v to the even bits of the result
+static uint64_t spread_bits(uint64_t v) {
+    v &= (1u << AXIS_BITS) - 1;
+    v = (v | v << 16) & 0x0000ffff0000ffffull;
+    v = (v | v << 8) & 0x00ff00ff00ff00ffull;
+    v = (v | v << 4) & 0x0f0f0f0f0f0f0f0full;
+    v = (v | v << 2) & 0x3333333333333333ull;
+    v = (v | v << 1) & 0x5555555555555555ull;
+    return v;
+}
+
+static uint64_t morton_key(uint32_t x, uint32_t y) {
+    return spread_bits(x) | spread_bits(y) << 1;
+}
+
+// Distance along the Hilbert curve through the 2^21 x 2^21 grid, walking
+// from the coarsest quadrant down and rotating the frame into each one
+static uint64_t hilbert_key(uint32_t x, uint32_t y) {
+    const uint32_t side = 1u << AXIS_BITS;
+    uint64_t key = 0;
+    for (uint32_t s = side / 2; s > 0; s /= 2) {
+        uint32_t rx = (x & s) > 0;
+        uint32_t ry = (y & s) > 0;
+        key += (uint64_t)s * s * ((3 * rx) ^ ry);
+        if (ry == 0) {
+            if (rx == 1) {
+                x = side - 1 - x;
+                y = side - 1 - y;
+            }
+            uint32_t swap = x;
+            x = y;
+            y = swap;
+        }
+    }
+    return key;
+}
+
+static void key_tile(void *arg, int worker, int tile) {
+    (void)worker;
+    struct KeyJob *job = arg;
+    struct Reorder *reorder = job->reorder;
+    const double *x = job->particles->x_pos;
+    const double *y = job->particles->y_pos;
+    for (int i = tile_begin(reorder, tile); i < tile_begin(reorder, tile + 1);
+         i++) {
+        uint32_t qx = (uint32_t)((x[i] - job->x_min) * job->x_scale);
+        uint32_t qy = (uint32_t)((y[i] - job->y_min) * job->y_scale);
+        reorder->keys[i] = reorder->curve == CURVE_HILBERT
+                               ? hilbert_key(qx, qy)
+                               : morton_key(qx, qy);
+        reorder->index[i] = i;
+    }
+}
+
+static void histogram_tile(void *arg, int worker, int tile) {
+    (void)worker;
+    struct SortJob *job = arg;
+    struct Reorder *reorder = job->reorder;
+    int *counts = reorder->histograms + tile * BUCKETS;
+    memset(counts, 0, sizeof(int) * BUCKETS);
+    for (int i = tile_begin(reorder, tile); i < tile_begin(reorder, tile + 1);
+         i++) {
+        counts[(job->keys_in[i] >> job->shift) & (BUCKETS - 1)]++;
+    }
+}
+
+// Moves the keys of a tile to the offsets left in its histogram by the
+// prefix sum, which keeps equal digits in tile order and so is stable
+static void scatter_tile(void *arg, int worker, int tile) {
+    (void)worker;
+    struct SortJob *job = arg;
+    struct Reorder *reorder = job->reorder;
+    int *offsets = reorder->histograms + tile * BUCKETS;
+    for (int i = tile_begin(reorder, tile); i < tile_begin(reorder, tile + 1);
+         i++) {
+        int slot = offsets[(job->keys_in[i] >> job->shift) & (BUCKETS - 1)]++;
+        job->keys_out[slot] = job->keys_in[i];
+        job->index_out[slot] = job->index_in[i];
+    }
+}
+
+static void radix_sort(struct Reorder *reorder) {
+    struct SortJob job = {reorder, 0, reorder->keys, reorder->index,
+                          reorder->key_scratch, reorder->index_scratch};
+    for (int pass = 0; pass < PASSES; pass++) {
+        job.shift = pass * DIGIT_BITS;
+        pool_run(reorder->ntiles, histogram_tile, &job);
+        int offset = 0;
+        for (int digit = 0; digit < BUCKETS; digit++) {
+            for (int tile = 0; tile < reorder->ntiles; tile++) {
+                int *count = &reorder->histograms[tile * BUCKETS + digit];
+                int size = *count;
+                *count = offset;
+                offset += size;
+            }
+        }
+        pool_run(reorder->ntiles, scatter_tile, &job);
+
+        const uint64_t *keys = job.keys_in;
+        const int *index = job.index_in;
+        job.keys_in = job.keys_out;
+        job.index_in = job.index_out;
+        job.keys_out = (uint64_t *)keys;
+        job.index_out = (int *)index;
+    }
+}
+
+static void permute_tile(void *arg, int worker, int tile) {
+    (void)worker;
+    struct PermuteJob *job = arg;
+    struct Reorder *reorder = job->reorder;
+    int begin = tile_begin(reorder, tile);
+    int end = tile_begin(reorder, tile + 1);
+    for (int i = begin; i < end; i++) {
+        reorder->scratch[i] = job->values[reorder->index[i]];
+    }
+}
+
+static void copy_back_tile(void *arg, int worker, int tile) {
+    (void)worker;
+    struct PermuteJob *job = arg;
+    struct Reorder *reorder = job->reorder;
+    int begin = tile_begin(reorder, tile);
+    int end = tile_begin(reorder, tile + 1);
+    memcpy(job->values + begin, reorder->scratch + begin,
+           sizeof(double) * (end - begin));
+}
+
+void reorder_permute(struct Reorder *reorder, double *values) {
+    struct PermuteJob job = {reorder, values};
+    pool_run(reorder->ntiles, permute_tile, &job);
+    pool_run(reorder->ntiles, copy_back_tile, &job);
+}
+
+void reorder_particles(struct Reorder *reorder,
+                       struct ParticleStore *particles) {
+    const int n = reorder->n;
+    if (n == 0) {
+        return;
+    }
+    double x_min = particles->x_pos[0], x_max = x_min;
+    double y_min = particles->y_pos[0], y_max = y_min;
+    for (int i = 1; i < n; i++) {
+        x_min = particles->x_pos[i] < x_min ? particles->x_pos[i] : x_min;
+        x_max = particles->x_pos[i] > x_max ? particles->x_pos[i] : x_max;
+        y_min = particles->y_pos[i] < y_min ? particles->y_pos[i] : y_min;
+        y_max = particles->y_pos[i] > y_max ? particles->y_pos[i] : y_max;
+    }
+    // Map the bounding box onto [0, 2^21), keeping the largest coordinate
+    // just inside
+    const double cells = (double)(1u << AXIS_BITS) * (1 - 1e-9);
+    struct KeyJob keys = {reorder,
+                          particles,
+                          x_min,
+                          y_min,
+                          x_max > x_min ? cells / (x_max - x_min) : 0,
+                          y_max > y_min ? cells / (y_max - y_min) : 0};
+    pool_run(reorder->ntiles, key_tile, &keys);
+    radix_sort(reorder);
+
+    reorder_permute(reorder, particles->x_pos);
+    reorder_permute(reorder, particles->y_pos);
+    reorder_permute(reorder, particles->mass);
+    reorder_permute(reorder, particles->x_velocity);
+    reorder_permute(reorder, particles->y_velocity);
+    reorder_permute(reorder, particles->brightness);
+    for (int i = 0; i < n; i++) {
+        reorder->order_scratch[i] = reorder->order[reorder->index[i]];
+    }
+    int *order = reorder->order;
+    reorder->order = reorder->order_scratch;
+    reorder->order_scratch = order;
+}
+
+void reorder_restore(const struct Reorder *reorder,
+                     const struct ParticleStore *particles,
+                     struct ParticleStore *out) {
+    for (int i = 0; i < reorder->n; i++) {
+        int k = reorder->order[i];
+        out->x_pos[k] = particles->x_pos[i];
+        out->y_pos[k] = particles->y_pos[i];
+        out->mass[k] = particles->mass[i];
+        out->x_velocity[k] = particles->x_velocity[i];
+        out->y_velocity[k] = particles->y_velocity[i];
+        out->brightness[k] = particles->brightness[i];
+    }
+}
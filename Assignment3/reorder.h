@@ -0,0 +1,52 @@
+#ifndef REORDER_H
+#define REORDER_H
+
+#include <stdint.h>
+
+#include "galsim.h"
+
+enum Curve { CURVE_NONE, CURVE_MORTON, CURVE_HILBERT };
+
+// Sorts the particles along a space-filling curve, so that particles close
+// in space are close in memory. The positions are quantised to 21 bits per
+// axis within their bounding box, and the 42-bit Morton or Hilbert keys are
+// sorted with a parallel LSD radix sort on the thread pool. The store is
+// permuted in place, and order keeps the original index of every particle
+// so that files can be written in the input order.
+struct Reorder {
+    int n;
+    enum Curve curve;
+    // Original index of the particle at each position
+    int *order;
+    // Position before the last reordering of the particle at each position
+    int *index;
+    uint64_t *keys;
+    uint64_t *key_scratch;
+    int *index_scratch;
+    int *order_scratch;
+    double *scratch;
+    // Digit counts of every tile of the radix sort
+    int ntiles;
+    int *histograms;
+};
+
+void reorder_init(struct Reorder *reorder, int n, enum Curve curve);
+void reorder_free(struct Reorder *reorder);
+
+// Forgets the permutation so far, taking the current order as the original
+void reorder_reset(struct Reorder *reorder);
+
+// Sorts the particles by their current positions
+void reorder_particles(struct Reorder *reorder,
+                       struct ParticleStore *particles);
+
+// Applies the permutation of the last reorder_particles() to another array
+// of per-particle values
+void reorder_permute(struct Reorder *reorder, double *values);
+
+// Writes the particles to out in their original order
+void reorder_restore(const struct Reorder *reorder,
+                     const struct ParticleStore *particles,
+                     struct ParticleStore *out);
+
+#endif
@@ -0,0 +1,346 @@
+#include "server.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+_Static_assert(sizeof(struct SharedState) == 64,
+               "shared state header must be 64 bytes");
+
+static volatile sig_atomic_t interrupted = 0;
+
+static void interrupt(int signal) {
+    (void)signal;
+    interrupted = 1;
+}
+
+// Copies the particles into the shared memory object between two updates
+// of the sequence number
+static void publish(struct Server *server) {
+    struct SharedState *shared = server->shared;
+    const struct ParticleStore *particles = server->state(server->arg);
+    uint64_t sequence = atomic_load_explicit(&shared->sequence,
+                                             memory_order_relaxed);
+    atomic_store_explicit(&shared->sequence, sequence + 1,
+                          memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    shared->step = server->step;
+    shared->delta_time = *server->delta_time;
+    double *columns = (double *)(shared + 1);
+    const double *sources[6] = {
+        particles->x_pos,      particles->y_pos,      particles->mass,
+        particles->x_velocity, particles->y_velocity, particles->brightness};
+    for (int c = 0; c < 6; c++) {
+        memcpy(columns + (size_t)c * server->n, sources[c],
+               sizeof(double) * server->n);
+    }
+
+    atomic_store_explicit(&shared->sequence, sequence + 2,
+                          memory_order_release);
+}
+
+void server_open(struct Server *server, const char *socket_path,
+                 const char *shm_name, int n, int step, double *delta_time,
+                 server_step advance, server_state state, void *arg) {
+    memset(server, 0, sizeof(*server));
+    server->socket_path = socket_path;
+    server->shm_name = shm_name;
+    server->n = n;
+    server->step = step;
+    server->delta_time = delta_time;
+    server->advance = advance;
+    server->state = state;
+    server->arg = arg;
+    for (int c = 0; c < SERVER_CLIENTS; c++) {
+        server->clients[c].fd = -1;
+    }
+
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    if (strlen(socket_path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Socket path %s is too long\n", socket_path);
+        exit(1);
+    }
+    strcpy(address.sun_path, socket_path);
+    // A socket left behind by a daemon that did not shut down cleanly
+    unlink(socket_path);
+    server->listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server->listener < 0 ||
+        bind(server->listener, (struct sockaddr *)&address,
+             sizeof(address)) != 0 ||
+        listen(server->listener, SERVER_CLIENTS) != 0) {
+        fprintf(stderr, "Error listening on %s: %s\n", socket_path,
+                strerror(errno));
+        exit(1);
+    }
+
+    server->shared_size =
+        sizeof(struct SharedState) + 6 * sizeof(double) * (size_t)n;
+    int fd = shm_open(shm_name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || ftruncate(fd, server->shared_size) != 0) {
+        fprintf(stderr, "Error creating shared memory %s: %s\n", shm_name,
+                strerror(errno));
+        exit(1);
+    }
+    server->shared = mmap(NULL, server->shared_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED, fd, 0);
+    close(fd);
+    if (server->shared == MAP_FAILED) {
+        fprintf(stderr, "Error mapping shared memory %s\n", shm_name);
+        exit(1);
+    }
+    struct SharedState *shared = server->shared;
+    memcpy(shared->magic, SHARED_MAGIC, sizeof(shared->magic));
+    shared->version = SHARED_VERSION;
+    shared->header_size = sizeof(*shared);
+    shared->n = n;
+    atomic_init(&shared->sequence, 0);
+    publish(server);
+
+    // SIGINT and SIGTERM interrupt poll() so that the daemon cleans up, and
+    // a client hanging up mid-reply must not kill it
+    struct sigaction action = {.sa_handler = interrupt};
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+}
+
+// Writes all of text to the client, and gives up on clients that hang up
+static void send_all(struct ClientConnection *client, const char *text,
+                     size_t size) {
+    while (size > 0 && client->fd >= 0) {
+        ssize_t sent = write(client->fd, text, size);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent <= 0) {
+            close(client->fd);
+            client->fd = -1;
+            return;
+        }
+        text += sent;
+        size -= sent;
+    }
+}
+
+static void reply(struct ClientConnection *client, const char *format, ...) {
+    char text[SERVER_LINE];
+    va_list args;
+    va_start(args, format);
+    int size = vsnprintf(text, sizeof(text) - 1, format, args);
+    va_end(args);
+    if (size > (int)sizeof(text) - 2) {
+        size = sizeof(text) - 2;
+    }
+    text[size] = '\n';
+    send_all(client, text, size + 1);
+}
+
+static void query(struct Server *server, struct ClientConnection *client,
+                  const char *first_word, const char *count_word) {
+    char *first_end, *count_end;
+    long first = strtol(first_word, &first_end, 10);
+    long count = strtol(count_word, &count_end, 10);
+    if (*first_end != '\0' || *count_end != '\0') {
+        reply(client, "error query needs numbers FIRST and COUNT");
+        return;
+    }
+    if (first < 0 || count < 0 || first > server->n ||
+        count > server->n - first) {
+        reply(client, "error %s particles from %s are not all in 0 to %d",
+              count_word, first_word, server->n - 1);
+        return;
+    }
+    const struct ParticleStore *particles = server->state(server->arg);
+    reply(client, "ok %ld", count);
+    // The lines go out in batches, so a large query is not one write per
+    // particle
+    char batch[64 * SERVER_LINE];
+    size_t used = 0;
+    for (long i = first; i < first + count; i++) {
+        if (used > sizeof(batch) - SERVER_LINE) {
+            send_all(client, batch, used);
+            used = 0;
+        }
+        used += snprintf(batch + used, sizeof(batch) - used,
+                         "%.17g %.17g %.17g %.17g %.17g %.17g\n",
+                         particles->x_pos[i], particles->y_pos[i],
+                         particles->mass[i], particles->x_velocity[i],
+                         particles->y_velocity[i], particles->brightness[i]);
+    }
+    send_all(client, batch, used);
+}
+
+static void snapshot(struct Server *server, struct ClientConnection *client,
+                     const char *path, const char *format) {
+    enum GalFormat layout = GAL_LEGACY;
+    if (format && strcmp(format, "v2") == 0) {
+        layout = GAL_V2;
+    } else if (format && strcmp(format, "legacy") != 0) {
+        reply(client, "error unknown format '%s'", format);
+        return;
+    }
+    // gal_write() would exit on errors, which a bad path from a client must
+    // not do to the daemon
+    char reason[SERVER_LINE];
+    if (!gal_save(path, layout, server->state(server->arg), server->step,
+                  *server->delta_time, reason, sizeof(reason))) {
+        reply(client, "error %s", reason);
+        return;
+    }
+    reply(client, "ok");
+}
+
+static void execute(struct Server *server, struct ClientConnection *client,
+                    char *line) {
+    char *words[4] = {NULL};
+    int count = 0;
+    char *save;
+    for (char *word = strtok_r(line, " \t\r", &save); word && count < 4;
+         word = strtok_r(NULL, " \t\r", &save)) {
+        words[count++] = word;
+    }
+    if (count == 0) {
+        return;
+    }
+    const char *command = words[0];
+    char *end;
+    if (strcmp(command, "info") == 0) {
+        reply(client, "ok n=%d step=%d dt=%.17g", server->n, server->step,
+              *server->delta_time);
+    } else if (strcmp(command, "step") == 0) {
+        long steps = count > 1 ? strtol(words[1], &end, 10) : 1;
+        if (count > 1 && (*end != '\0' || steps < 1 || steps > 1000000000)) {
+            reply(client, "error step needs a positive count");
+            return;
+        }
+        // The step is an int everywhere, down to the snapshot headers
+        if (steps > INT_MAX - server->step) {
+            reply(client, "error the step would pass %d", INT_MAX);
+            return;
+        }
+        server->advance(server->arg, steps);
+        server->step += steps;
+        publish(server);
+        reply(client, "ok step=%d", server->step);
+    } else if (strcmp(command, "dt") == 0) {
+        double dt = count > 1 ? strtod(words[1], &end) : 0;
+        if (count < 2 || *end != '\0' || !(dt > 0)) {
+            reply(client, "error dt needs a positive value");
+            return;
+        }
+        *server->delta_time = dt;
+        publish(server);
+        reply(client, "ok dt=%.17g", dt);
+    } else if (strcmp(command, "query") == 0) {
+        if (count < 3) {
+            reply(client, "error query needs FIRST and COUNT");
+            return;
+        }
+        query(server, client, words[1], words[2]);
+    } else if (strcmp(command, "snapshot") == 0) {
+        if (count < 2) {
+            reply(client, "error snapshot needs a path");
+            return;
+        }
+        snapshot(server, client, words[1], words[2]);
+    } else if (strcmp(command, "quit") == 0) {
+        close(client->fd);
+        client->fd = -1;
+    } else if (strcmp(command, "shutdown") == 0) {
+        reply(client, "ok");
+        server->stopping = true;
+    } else {
+        reply(client, "error unknown command '%s'", command);
+    }
+}
+
+// Reads what the client sent and runs every complete line
+static void receive(struct Server *server, struct ClientConnection *client) {
+    ssize_t got = read(client->fd, client->line + client->used,
+                       sizeof(client->line) - client->used);
+    if (got < 0 && errno == EINTR) {
+        return;
+    }
+    if (got <= 0) {
+        close(client->fd);
+        client->fd = -1;
+        return;
+    }
+    client->used += got;
+    char *newline;
+    while (client->fd >= 0 && !server->stopping &&
+           (newline = memchr(client->line, '\n', client->used))) {
+        *newline = '\0';
+        size_t length = newline + 1 - client->line;
+        execute(server, client, client->line);
+        memmove(client->line, client->line + length, client->used - length);
+        client->used -= length;
+    }
+    if (client->fd >= 0 && client->used == sizeof(client->line)) {
+        reply(client, "error line longer than %d bytes", SERVER_LINE - 1);
+        close(client->fd);
+        client->fd = -1;
+    }
+}
+
+void server_run(struct Server *server) {
+    struct pollfd fds[SERVER_CLIENTS + 1];
+    while (!server->stopping && !interrupted) {
+        fds[0] = (struct pollfd){.fd = server->listener, .events = POLLIN};
+        for (int c = 0; c < SERVER_CLIENTS; c++) {
+            fds[c + 1] =
+                (struct pollfd){.fd = server->clients[c].fd, .events = POLLIN};
+        }
+        if (poll(fds, SERVER_CLIENTS + 1, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "Error waiting for clients: %s\n",
+                    strerror(errno));
+            exit(1);
+        }
+        if (fds[0].revents & POLLIN) {
+            int fd = accept(server->listener, NULL, NULL);
+            int c = 0;
+            while (c < SERVER_CLIENTS && server->clients[c].fd >= 0) {
+                c++;
+            }
+            if (fd >= 0 && c == SERVER_CLIENTS) {
+                struct ClientConnection busy = {.fd = fd};
+                reply(&busy, "error too many clients");
+                close(fd);
+            } else if (fd >= 0) {
+                server->clients[c] = (struct ClientConnection){.fd = fd};
+            }
+        }
+        for (int c = 0; c < SERVER_CLIENTS && !server->stopping; c++) {
+            if (fds[c + 1].fd >= 0 && server->clients[c].fd == fds[c + 1].fd &&
+                fds[c + 1].revents & (POLLIN | POLLHUP | POLLERR)) {
+                receive(server, &server->clients[c]);
+            }
+        }
+    }
+}
+
+void server_close(struct Server *server) {
+    for (int c = 0; c < SERVER_CLIENTS; c++) {
+        if (server->clients[c].fd >= 0) {
+            close(server->clients[c].fd);
+        }
+    }
+    close(server->listener);
+    unlink(server->socket_path);
+    munmap(server->shared, server->shared_size);
+    shm_unlink(server->shm_name);
+}
@@ -0,0 +1,93 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <poll.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "galfile.h"
+#include "galsim.h"
+
+#define SHARED_MAGIC "GALSHM1"
+#define SHARED_VERSION 1
+#define SERVER_CLIENTS 16
+#define SERVER_LINE 1024
+
+// Daemon mode: the simulation stays resident and serves commands from
+// clients on a Unix domain socket, one text line per command:
+//
+//     info                     ok n=N step=STEP dt=DT
+//     step [K]                 advance K steps (default 1, at most 1e9,
+//                              and STEP stays an int); ok step=STEP
+//     dt VALUE                 set the time step; ok dt=DT
+//     query FIRST COUNT        ok COUNT, then one line of the six values
+//                              of each particle FIRST, FIRST + 1, ...
+//     snapshot PATH [v2]       write the particles to a legacy (or v2)
+//                              .gal file; ok
+//     quit                     close this connection
+//     shutdown                 stop the daemon; ok
+//
+// Failed commands answer error and a reason. Commands run one at a time on
+// the simulation thread, in the order they arrive, so a long step command
+// holds up the other clients.
+//
+// After every step command the particles are also published in the POSIX
+// shared memory object shm_name: this header followed by the columns x_pos,
+// y_pos, mass, x_velocity, y_velocity and brightness of n doubles each, in
+// input order. Clients map it read-only and read it in place. sequence is
+// odd while the server writes, so a reader that sees the same even value
+// before and after reading has a consistent state.
+struct SharedState {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint64_t n;
+    _Atomic uint64_t sequence;
+    uint64_t step;
+    double delta_time;
+    uint64_t reserved[2];
+};
+
+// Advances the simulation by steps steps of the current delta_time
+typedef void (*server_step)(void *arg, int steps);
+// The particles in input order
+typedef const struct ParticleStore *(*server_state)(void *arg);
+
+struct ClientConnection {
+    int fd;
+    char line[SERVER_LINE];
+    size_t used;
+};
+
+struct Server {
+    const char *socket_path;
+    const char *shm_name;
+    int n;
+    int step;
+    double *delta_time;
+    server_step advance;
+    server_state state;
+    void *arg;
+    int listener;
+    struct ClientConnection clients[SERVER_CLIENTS];
+    struct SharedState *shared;
+    size_t shared_size;
+    bool stopping;
+};
+
+// Listens on socket_path and creates shm_name for n particles, at the given
+// step. delta_time is read before and changed by the dt command.
+void server_open(struct Server *server, const char *socket_path,
+                 const char *shm_name, int n, int step, double *delta_time,
+                 server_step advance, server_state state, void *arg);
+
+// Serves commands until a client sends shutdown or the process gets SIGINT
+// or SIGTERM
+void server_run(struct Server *server);
+
+// Closes the connections and removes the socket and the shared memory
+void server_close(struct Server *server);
+
+#endif
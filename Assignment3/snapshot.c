@@ -0,0 +1,160 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "snapshot.h"
+
+int step_conversions(const char *pattern) {
+    int count = 0;
+    for (const char *c = pattern; *c; c++) {
+        if (*c != '%') {
+            continue;
+        }
+        c++;
+        if (*c == '%') {
+            continue;
+        }
+        c += strspn(c, "-+ #0");
+        c += strspn(c, "0123456789");
+        if (*c == '.') {
+            c++;
+            c += strspn(c, "0123456789");
+        }
+        if (*c != 'd' && *c != 'i') {
+            return -1;
+        }
+        count++;
+    }
+    return count;
+}
+
+static void write_snapshot(struct SnapshotWriter *writer,
+                           const struct ParticleStore *buffer, int step) {
+    if (writer->compressed) {
+        trajectory_append(&writer->compressor, buffer, step);
+        return;
+    }
+    if (!writer->numbered) {
+        gal_write_frame(writer->trajectory, writer->format, buffer, step,
+                        writer->delta_time);
+        return;
+    }
+    int size = snprintf(NULL, 0, writer->path, step) + 1;
+    char *name = malloc(size);
+    snprintf(name, size, writer->path, step);
+    gal_write(name, writer->format, buffer, step, writer->delta_time);
+    free(name);
+}
+
+static void *writer_main(void *arg) {
+    struct SnapshotWriter *writer = arg;
+    pthread_mutex_lock(&writer->lock);
+    for (;;) {
+        while (writer->queued == 0 && !writer->closing) {
+            pthread_cond_wait(&writer->filled, &writer->lock);
+        }
+        if (writer->queued == 0) {
+            break;
+        }
+        int slot = writer->head;
+        pthread_mutex_unlock(&writer->lock);
+
+        write_snapshot(writer, &writer->buffers[slot], writer->steps[slot]);
+
+        pthread_mutex_lock(&writer->lock);
+        writer->head = (writer->head + 1) % SNAPSHOT_BUFFERS;
+        writer->queued--;
+        pthread_cond_signal(&writer->emptied);
+    }
+    pthread_mutex_unlock(&writer->lock);
+    return NULL;
+}
+
+void snapshot_open(struct SnapshotWriter *writer, const char *path,
+                   enum GalFormat format, int n, double delta_time,
+                   double tolerance, int compress_threads) {
+    size_t length = strlen(path);
+    writer->path = path;
+    writer->numbered = step_conversions(path) == 1;
+    writer->compressed = length >= 5 && strcmp(path + length - 5, ".galz") == 0;
+    writer->format = format;
+    writer->delta_time = delta_time;
+    writer->trajectory = NULL;
+    if (writer->compressed) {
+        if (writer->numbered) {
+            fprintf(stderr, "Compressed trajectories go in a single file\n");
+            exit(1);
+        }
+        trajectory_create(&writer->compressor, path, n, delta_time, tolerance,
+                          compress_threads);
+    } else if (!writer->numbered) {
+        writer->trajectory = fopen(path, "w");
+        if (!writer->trajectory) {
+            fprintf(stderr, "Error opening %s\n", path);
+            exit(1);
+        }
+    }
+    for (int b = 0; b < SNAPSHOT_BUFFERS; b++) {
+        store_alloc(&writer->buffers[b], n);
+    }
+    writer->head = 0;
+    writer->queued = 0;
+    writer->closing = false;
+    writer->stalls = 0;
+    pthread_mutex_init(&writer->lock, NULL);
+    pthread_cond_init(&writer->filled, NULL);
+    pthread_cond_init(&writer->emptied, NULL);
+    if (pthread_create(&writer->thread, NULL, writer_main, writer) != 0) {
+        fprintf(stderr, "Error creating snapshot thread\n");
+        exit(1);
+    }
+}
+
+void snapshot_push(struct SnapshotWriter *writer,
+                   const struct ParticleStore *particles, int step) {
+    pthread_mutex_lock(&writer->lock);
+    if (writer->queued == SNAPSHOT_BUFFERS) {
+        writer->stalls++;
+    }
+    while (writer->queued == SNAPSHOT_BUFFERS) {
+        pthread_cond_wait(&writer->emptied, &writer->lock);
+    }
+    int slot = (writer->head + writer->queued) % SNAPSHOT_BUFFERS;
+    pthread_mutex_unlock(&writer->lock);
+
+    // The writer never touches a buffer that is not queued, so the copy can
+    // run without the lock
+    store_copy(&writer->buffers[slot], particles);
+
+    pthread_mutex_lock(&writer->lock);
+    writer->steps[slot] = step;
+    writer->queued++;
+    pthread_cond_signal(&writer->filled);
+    pthread_mutex_unlock(&writer->lock);
+}
+
+void snapshot_close(struct SnapshotWriter *writer) {
+    pthread_mutex_lock(&writer->lock);
+    writer->closing = true;
+    pthread_cond_signal(&writer->filled);
+    pthread_mutex_unlock(&writer->lock);
+    pthread_join(writer->thread, NULL);
+
+    if (writer->compressed) {
+        trajectory_close(&writer->compressor);
+    }
+    if (writer->trajectory && fclose(writer->trajectory) != 0) {
+        fprintf(stderr, "Error writing %s\n", writer->path);
+        exit(1);
+    }
+    if (writer->stalls > 0) {
+        fprintf(stderr, "snapshot writer: waited for the disk %d times\n",
+                writer->stalls);
+    }
+    for (int b = 0; b < SNAPSHOT_BUFFERS; b++) {
+        store_free(&writer->buffers[b]);
+    }
+    pthread_mutex_destroy(&writer->lock);
+    pthread_cond_destroy(&writer->filled);
+    pthread_cond_destroy(&writer->emptied);
+}
@@ -0,0 +1,63 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "galfile.h"
+#include "galsim.h"
+#include "trajectory.h"
+
+#define SNAPSHOT_BUFFERS 3
+
+// Background writer of trajectory snapshots. The simulation copies the
+// particles into one of SNAPSHOT_BUFFERS buffers and continues, while the
+// writer thread saves the filled buffers in order. The simulation only
+// waits when all buffers are still queued for writing.
+//
+// If path contains an integer conversion such as snap_%05d.gal, every
+// snapshot goes to its own file numbered by step. Otherwise all snapshots
+// are appended to path as a sequence of frames, or, if path ends in
+// .galz, to a compressed trajectory (see trajectory.h) with positions and
+// velocities kept to within tolerance and every frame compressed by
+// compress_threads threads.
+struct SnapshotWriter {
+    const char *path;
+    bool numbered;
+    bool compressed;
+    struct TrajectoryWriter compressor;
+    enum GalFormat format;
+    double delta_time;
+    FILE *trajectory;
+    struct ParticleStore buffers[SNAPSHOT_BUFFERS];
+    int steps[SNAPSHOT_BUFFERS];
+    // Buffers head, head + 1, ..., head + queued - 1 (mod SNAPSHOT_BUFFERS)
+    // wait for the writer, the rest are free
+    int head;
+    int queued;
+    bool closing;
+    int stalls;
+    pthread_mutex_t lock;
+    pthread_cond_t filled;
+    pthread_cond_t emptied;
+    pthread_t thread;
+};
+
+void snapshot_open(struct SnapshotWriter *writer, const char *path,
+                   enum GalFormat format, int n, double delta_time,
+                   double tolerance, int compress_threads);
+
+// Queues a copy of particles as the state after the given step
+void snapshot_push(struct SnapshotWriter *writer,
+                   const struct ParticleStore *particles, int step);
+
+// Writes the queued snapshots and stops the writer thread
+void snapshot_close(struct SnapshotWriter *writer);
+
+// Counts the conversions in a printf pattern for file names numbered by
+// step, where %% stands for itself. Returns -1 unless each is an integer
+// conversion with at most flags, a width and a precision, like %05d.
+int step_conversions(const char *pattern);
+
+#endif
@@ -0,0 +1,84 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "galsim.h"
+#include "memory.h"
+
+double *alloc_doubles(int n) {
+    // aligned_alloc wants a multiple of the alignment, and a non-zero size
+    size_t size = ((sizeof(double) * n + 63) / 64) * 64;
+    double *array = aligned_alloc(64, size ? size : 64);
+    if (!array) {
+        fprintf(stderr, "Error allocating particle arrays\n");
+        exit(1);
+    }
+    return array;
+}
+
+void store_alloc(struct ParticleStore *store, int n) {
+    const size_t stride = memory_stride(n) / sizeof(double);
+    store->n = n;
+    store->x_pos = memory_columns(6, n);
+    store->y_pos = store->x_pos + 1 * stride;
+    store->mass = store->x_pos + 2 * stride;
+    store->x_velocity = store->x_pos + 3 * stride;
+    store->y_velocity = store->x_pos + 4 * stride;
+    store->brightness = store->x_pos + 5 * stride;
+    store->mapping = NULL;
+    store->mapping_size = 0;
+}
+
+void store_free(struct ParticleStore *store) {
+    if (store->mapping) {
+        munmap(store->mapping, store->mapping_size);
+        return;
+    }
+    memory_free(store->x_pos);
+}
+
+void store_copy(struct ParticleStore *destination,
+                const struct ParticleStore *source) {
+    size_t size = sizeof(double) * source->n;
+    memcpy(destination->x_pos, source->x_pos, size);
+    memcpy(destination->y_pos, source->y_pos, size);
+    memcpy(destination->mass, source->mass, size);
+    memcpy(destination->x_velocity, source->x_velocity, size);
+    memcpy(destination->y_velocity, source->y_velocity, size);
+    memcpy(destination->brightness, source->brightness, size);
+}
+
+void store_from_records(struct ParticleStore *store,
+                        const struct Particle *records) {
+    for (int i = 0; i < store->n; i++) {
+        store->x_pos[i] = records[i].x_pos;
+        store->y_pos[i] = records[i].y_pos;
+        store->mass[i] = records[i].mass;
+        store->x_velocity[i] = records[i].x_velocity;
+        store->y_velocity[i] = records[i].y_velocity;
+        store->brightness[i] = records[i].brightness;
+    }
+}
+
+void store_to_records(const struct ParticleStore *store,
+                      struct Particle *records) {
+    for (int i = 0; i < store->n; i++) {
+        records[i].x_pos = store->x_pos[i];
+        records[i].y_pos = store->y_pos[i];
+        records[i].mass = store->mass[i];
+        records[i].x_velocity = store->x_velocity[i];
+        records[i].y_velocity = store->y_velocity[i];
+        records[i].brightness = store->brightness[i];
+    }
+}
+
+void changes_alloc(struct ParticleChange *changes, int n) {
+    changes->x_velocity = memory_columns(2, n);
+    changes->y_velocity =
+        changes->x_velocity + memory_stride(n) / sizeof(double);
+}
+
+void changes_free(struct ParticleChange *changes) {
+    memory_free(changes->x_velocity);
+}
@@ -0,0 +1,145 @@
+#!/bin/sh
+# Accuracy and speed sweep of galsim against ref_output_data. Runs every
+# mode below with every thread count on the input of each reference file
+# (ellipse_N_<N>_after<steps>steps.gal, dt 1e-5), compares the result with
+# compare_gal_files, and writes one CSV row per run:
+#
+#   n,steps,mode,threads,seconds,speedup,pos_maxdiff,pos_rmsdiff,pareto
+#
+# seconds is galsim's own wall time (the best of the repeats), speedup is
+# relative to the first mode with the first thread count, and pareto is 1
+# for the runs no other run of the same case beats in both time and
+# pos_maxdiff. The Pareto table of each case is printed at the end, fastest
+# first, so the first row within an error budget is the mode to use.
+#
+# Usage: ./sweep.sh [-t 1,2,4] [-r REPEATS] [-b BUDGET] [-n MIN,MAX] [-o CSV]
+
+threads=1,2,4
+repeats=1
+budget=
+min_n=0
+max_n=1000000000
+output=sweep.csv
+while getopts "t:r:b:n:o:h" option; do
+    case $option in
+    t) threads=$OPTARG ;;
+    r) repeats=$OPTARG ;;
+    b) budget=$OPTARG ;;
+    n) min_n=${OPTARG%,*}; max_n=${OPTARG#*,} ;;
+    o) output=$OPTARG ;;
+    *)
+        echo "Usage: $0 [-t 1,2,4] [-r REPEATS] [-b BUDGET] [-n MIN,MAX] [-o CSV]"
+        echo "  -t  thread counts (default 1,2,4)"
+        echo "  -r  runs per configuration, the fastest counts (default 1)"
+        echo "  -b  pos_maxdiff budget: report the fastest mode within it"
+        echo "  -n  range of N to run (default all references)"
+        echo "  -o  CSV output (default sweep.csv)"
+        exit 1
+        ;;
+    esac
+done
+
+# Mode name and galsim options
+modes="direct:
+mixed:--precision=mixed
+bh-0.3:--solver=bh --theta=0.3
+bh-0.5:--solver=bh --theta=0.5
+bh-0.8:--solver=bh --theta=0.8
+fmm-4:--solver=fmm --fmm-order=4
+fmm-8:--solver=fmm --fmm-order=8"
+
+compare=./compare_gal_files/compare_gal_files
+for program in ./galsim $compare; do
+    if [ ! -x $program ]; then
+        echo "$program is missing, run make first" >&2
+        exit 1
+    fi
+done
+
+scratch=$(mktemp -d) || exit 1
+trap 'rm -rf "$scratch"' EXIT
+
+echo "n,steps,mode,threads,seconds,speedup,pos_maxdiff,pos_rmsdiff" \
+    > "$scratch/runs.csv"
+for reference in ref_output_data/ellipse_N_*_after*steps.gal; do
+    name=${reference##*/}
+    n=$(echo "$name" | sed 's/ellipse_N_0*\([0-9]*\)_.*/\1/')
+    steps=$(echo "$name" | sed 's/.*_after\([0-9]*\)steps.gal/\1/')
+    input=input_data/$(echo "$name" | sed 's/_after.*/.gal/')
+    if [ "$n" -lt "$min_n" ] || [ "$n" -gt "$max_n" ] || [ ! -f "$input" ]; then
+        continue
+    fi
+    baseline=
+    echo "$modes" | while IFS=: read -r mode options; do
+        for t in $(echo "$threads" | tr ',' ' '); do
+            best=
+            run=0
+            while [ $run -lt "$repeats" ]; do
+                # Word splitting of $options is intended
+                seconds=$(./galsim "$n" "$input" "$steps" 0.00001 0 \
+                    --threads="$t" --output="$scratch/result.gal" $options |
+                    awk '/wall seconds/ { print $3 }')
+                if [ -z "$seconds" ]; then
+                    echo "galsim failed: N=$n $mode threads=$t" >&2
+                    exit 1
+                fi
+                best=$(awk -v best="$best" -v seconds="$seconds" 'BEGIN {
+                    print (best == "" || seconds + 0 < best + 0) ? seconds : best
+                }')
+                run=$((run + 1))
+            done
+            errors=$($compare "$n" "$scratch/result.gal" "$reference" |
+                awk '/pos_maxdiff/ { max = $3 } /pos_rmsdiff/ { rms = $3 }
+                     END { print max "," rms }')
+            baseline=${baseline:-$best}
+            speedup=$(awk -v a="$baseline" -v b="$best" \
+                'BEGIN { printf "%.2f", a / b }')
+            echo "$n,$steps,$mode,$t,$best,$speedup,$errors" \
+                >> "$scratch/runs.csv"
+            printf "N=%-6s %-7s threads=%-3s %9.4f s  x%-6s pos_maxdiff %s\n" \
+                "$n" "$mode" "$t" "$best" "$speedup" "${errors%,*}"
+        done
+    done || exit 1
+done
+
+# Mark the runs no other run of the same case is at least as fast and as
+# accurate as, and better in one of the two
+awk -F, 'NR == 1 { print $0 ",pareto"; next }
+    { row[NR] = $0; n[NR] = $1; t[NR] = $5; e[NR] = $7 }
+    END {
+        for (i = 2; i <= NR; i++) {
+            pareto = 1
+            for (j = 2; j <= NR; j++) {
+                if (j != i && n[j] == n[i] && t[j] <= t[i] && e[j] <= e[i] &&
+                    (t[j] < t[i] || e[j] < e[i])) {
+                    pareto = 0
+                }
+            }
+            print row[i] "," pareto
+        }
+    }' "$scratch/runs.csv" > "$output"
+
+echo
+echo "Pareto table (fastest first):"
+printf "%-7s %-6s %-7s %-8s %10s %8s %14s\n" N steps mode threads seconds \
+    speedup pos_maxdiff
+awk -F, 'NR > 1 && $9 == 1' "$output" | sort -t, -k1,1n -k5,5g |
+    awk -F, -v budget="$budget" '
+    {
+        printf "%-7s %-6s %-7s %-8s %10.4f %8s %14s\n", $1, $2, $3, $4, $5,
+               $6, $7
+        if (!($1 in chosen)) {
+            cases[++count] = $1
+            chosen[$1] = ""
+        }
+        if (budget != "" && chosen[$1] == "" && $7 + 0 <= budget + 0) {
+            chosen[$1] = sprintf("%s with %s threads, %.4f s", $3, $4, $5)
+        }
+    }
+    END {
+        for (c = 1; budget != "" && c <= count; c++) {
+            printf "N=%s: fastest within pos_maxdiff %s: %s\n", cases[c],
+                   budget, chosen[cases[c]] == "" ? "none" : chosen[cases[c]]
+        }
+    }'
+echo "All runs written to $output"
@@ -0,0 +1,421 @@
+#include "trajectory.h"
+
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define COLUMNS 6
+#define TRAJECTORY_CHUNK 65536
+// A block at full width: the width byte and 64 bits per number
+#define BLOCK_BOUND (1 + 8 * TRAJECTORY_BLOCK)
+
+_Static_assert(sizeof(struct TrajectoryHeader) == 64,
+               "trajectory header must be 64 bytes");
+
+// Work of one frame for the compression threads
+struct EncodeJob {
+    struct TrajectoryWriter *writer;
+    const double *columns[COLUMNS];
+    bool keyframe;
+    atomic_int next;
+};
+
+static bool quantized(const struct TrajectoryHeader *header, int column) {
+    // x_pos, y_pos, x_velocity, y_velocity
+    return header->quantum > 0 && column != 2 && column != 5;
+}
+
+static uint64_t zigzag(int64_t v) { return ((uint64_t)v << 1) ^ (v >> 63); }
+
+static int64_t unzigzag(uint64_t v) { return (int64_t)(v >> 1) ^ -(v & 1); }
+
+static uint64_t mask(int width) {
+    return width == 64 ? ~0ULL : (1ULL << width) - 1;
+}
+
+// Writes count numbers as a width byte and the numbers packed LSB first,
+// and returns the bytes written
+static size_t pack_block(const uint64_t *values, int count, uint8_t *out) {
+    uint64_t all = 0;
+    for (int i = 0; i < count; i++) {
+        all |= values[i];
+    }
+    const int width = all ? 64 - __builtin_clzll(all) : 0;
+    out[0] = width;
+    if (width == 0) {
+        return 1;
+    }
+    uint8_t *bytes = out + 1;
+    uint64_t acc = 0;
+    int bits = 0;
+    for (int i = 0; i < count; i++) {
+        acc |= values[i] << bits;
+        bits += width;
+        if (bits >= 64) {
+            memcpy(bytes, &acc, 8);
+            bytes += 8;
+            bits -= 64;
+            acc = bits ? values[i] >> (width - bits) : 0;
+        }
+    }
+    memcpy(bytes, &acc, (bits + 7) / 8);
+    return 1 + ((size_t)count * width + 7) / 8;
+}
+
+// Reverses pack_block() and returns the bytes read, or 0 if the block
+// would run past size
+static size_t unpack_block(const uint8_t *in, size_t size, int count,
+                           uint64_t *values) {
+    if (size < 1 || in[0] > 64) {
+        return 0;
+    }
+    const int width = in[0];
+    const size_t length = 1 + ((size_t)count * width + 7) / 8;
+    if (length > size) {
+        return 0;
+    }
+    const uint8_t *bytes = in + 1;
+    const uint8_t *end = in + length;
+    uint64_t acc = 0;
+    int bits = 0;
+    for (int i = 0; i < count; i++) {
+        if (bits >= width) {
+            values[i] = acc & mask(width);
+            acc = width == 64 ? 0 : acc >> width;
+            bits -= width;
+            continue;
+        }
+        uint64_t next = 0;
+        size_t take = end - bytes < 8 ? end - bytes : 8;
+        memcpy(&next, bytes, take);
+        bytes += take;
+        values[i] = (acc | next << bits) & mask(width);
+        acc = width - bits == 64 ? 0 : next >> (width - bits);
+        bits = 64 - (width - bits);
+    }
+    return length;
+}
+
+static void encode_chunk(struct EncodeJob *job, int column, int chunk) {
+    struct TrajectoryWriter *writer = job->writer;
+    const struct TrajectoryHeader *header = &writer->header;
+    const int n = header->n;
+    const int size_of_chunk = header->chunk;
+    const int begin = chunk * size_of_chunk;
+    const int end = begin + size_of_chunk < n ? begin + size_of_chunk : n;
+    const double *values = job->columns[column];
+    uint64_t *previous = writer->previous[column];
+    const bool quantize = quantized(header, column);
+    const double inverse = quantize ? 1 / header->quantum : 0;
+
+    uint8_t *out = writer->buffers[column * writer->chunks + chunk];
+    size_t size = 0;
+    uint64_t residuals[TRAJECTORY_BLOCK];
+    for (int b = begin; b < end; b += TRAJECTORY_BLOCK) {
+        int count = end - b < TRAJECTORY_BLOCK ? end - b : TRAJECTORY_BLOCK;
+        for (int k = 0; k < count; k++) {
+            int i = b + k;
+            uint64_t before = job->keyframe ? 0 : previous[i];
+            uint64_t now;
+            if (quantize) {
+                double q = nearbyint(values[i] * inverse);
+                if (!(fabs(q) < 0x1p62)) {
+                    fprintf(stderr, "%s: a value of %g does not fit the "
+                                    "tolerance\n",
+                            writer->path, values[i]);
+                    exit(1);
+                }
+                now = (uint64_t)(int64_t)q;
+                residuals[k] = zigzag((int64_t)(now - before));
+            } else {
+                memcpy(&now, &values[i], sizeof(now));
+                residuals[k] = now ^ before;
+            }
+            previous[i] = now;
+        }
+        size += pack_block(residuals, count, out + size);
+    }
+    writer->sizes[column * writer->chunks + chunk] = size;
+}
+
+static void *encode_chunks(void *arg) {
+    struct EncodeJob *job = arg;
+    const int chunks = job->writer->chunks;
+    int task;
+    while ((task = atomic_fetch_add(&job->next, 1)) < COLUMNS * chunks) {
+        encode_chunk(job, task / chunks, task % chunks);
+    }
+    return NULL;
+}
+
+static void *alloc_or_exit(size_t size) {
+    void *memory = malloc(size ? size : 1);
+    if (!memory) {
+        fprintf(stderr, "Error allocating trajectory buffers\n");
+        exit(1);
+    }
+    return memory;
+}
+
+static void write_or_exit(struct TrajectoryWriter *writer, const void *data,
+                          size_t size) {
+    if (size && fwrite(data, size, 1, writer->file) != 1) {
+        fprintf(stderr, "Error writing %s\n", writer->path);
+        exit(1);
+    }
+    writer->offset += size;
+}
+
+void trajectory_create(struct TrajectoryWriter *writer, const char *path,
+                       int n, double delta_time, double tolerance,
+                       int threads) {
+    memset(writer, 0, sizeof(*writer));
+    writer->path = path;
+    writer->file = fopen(path, "w");
+    if (!writer->file) {
+        fprintf(stderr, "Error opening %s\n", path);
+        exit(1);
+    }
+    struct TrajectoryHeader *header = &writer->header;
+    memcpy(header->magic, TRAJECTORY_MAGIC, sizeof(header->magic));
+    header->version = TRAJECTORY_VERSION;
+    header->header_size = sizeof(*header);
+    header->n = n;
+    header->delta_time = delta_time;
+    header->quantum = sqrt(2) * tolerance;
+    header->chunk = TRAJECTORY_CHUNK;
+    write_or_exit(writer, header, sizeof(*header));
+
+    writer->threads = threads < 1 ? 1 : threads;
+    writer->chunks = (n + TRAJECTORY_CHUNK - 1) / TRAJECTORY_CHUNK;
+    for (int c = 0; c < COLUMNS; c++) {
+        writer->previous[c] = alloc_or_exit(sizeof(uint64_t) * n);
+    }
+    writer->buffers = alloc_or_exit(sizeof(uint8_t *) * COLUMNS *
+                                    writer->chunks);
+    writer->sizes = alloc_or_exit(sizeof(uint32_t) * COLUMNS * writer->chunks);
+    const size_t bound =
+        (TRAJECTORY_CHUNK + TRAJECTORY_BLOCK - 1) / TRAJECTORY_BLOCK *
+        BLOCK_BOUND;
+    for (int b = 0; b < COLUMNS * writer->chunks; b++) {
+        writer->buffers[b] = alloc_or_exit(bound);
+    }
+}
+
+void trajectory_append(struct TrajectoryWriter *writer,
+                       const struct ParticleStore *particles, int step) {
+    struct TrajectoryHeader *header = &writer->header;
+    struct EncodeJob job = {
+        .writer = writer,
+        .columns = {particles->x_pos, particles->y_pos, particles->mass,
+                    particles->x_velocity, particles->y_velocity,
+                    particles->brightness},
+        .keyframe = header->frames % TRAJECTORY_KEYFRAME_EVERY == 0};
+    atomic_init(&job.next, 0);
+
+    // Chunks are independent, so helpers for this frame only take work
+    // from a shared counter
+    int helpers = writer->threads - 1;
+    if (helpers > COLUMNS * writer->chunks - 1) {
+        helpers = COLUMNS * writer->chunks - 1;
+    }
+    pthread_t *threads = alloc_or_exit(sizeof(pthread_t) * (helpers + 1));
+    int started = 0;
+    while (started < helpers &&
+           pthread_create(&threads[started], NULL, encode_chunks, &job) == 0) {
+        started++;
+    }
+    encode_chunks(&job);
+    for (int t = 0; t < started; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    free(threads);
+
+    if (header->frames == writer->capacity) {
+        writer->capacity = writer->capacity ? 2 * writer->capacity : 64;
+        writer->entries =
+            realloc(writer->entries,
+                    sizeof(struct TrajectoryEntry) * writer->capacity);
+        if (!writer->entries) {
+            fprintf(stderr, "Error allocating trajectory index\n");
+            exit(1);
+        }
+    }
+    struct TrajectoryEntry *entry = &writer->entries[header->frames++];
+    entry->step = step;
+    entry->offset = writer->offset;
+    entry->keyframe = job.keyframe;
+
+    struct TrajectoryFrame frame = {step, job.keyframe, writer->chunks};
+    write_or_exit(writer, &frame, sizeof(frame));
+    write_or_exit(writer, writer->sizes,
+                  sizeof(uint32_t) * COLUMNS * writer->chunks);
+    for (int b = 0; b < COLUMNS * writer->chunks; b++) {
+        write_or_exit(writer, writer->buffers[b], writer->sizes[b]);
+    }
+    entry->size = writer->offset - entry->offset;
+}
+
+void trajectory_close(struct TrajectoryWriter *writer) {
+    struct TrajectoryHeader *header = &writer->header;
+    header->index_offset = writer->offset;
+    write_or_exit(writer, writer->entries,
+                  sizeof(struct TrajectoryEntry) * header->frames);
+    if (fseek(writer->file, 0, SEEK_SET) != 0 ||
+        fwrite(header, sizeof(*header), 1, writer->file) != 1 ||
+        fclose(writer->file) != 0) {
+        fprintf(stderr, "Error writing %s\n", writer->path);
+        exit(1);
+    }
+    for (int c = 0; c < COLUMNS; c++) {
+        free(writer->previous[c]);
+    }
+    for (int b = 0; b < COLUMNS * writer->chunks; b++) {
+        free(writer->buffers[b]);
+    }
+    free(writer->buffers);
+    free(writer->sizes);
+    free(writer->entries);
+}
+
+static void read_or_exit(FILE *file, void *data, size_t size, long offset) {
+    if (size == 0) {
+        return;
+    }
+    if ((offset >= 0 && fseek(file, offset, SEEK_SET) != 0) ||
+        fread(data, size, 1, file) != 1) {
+        fprintf(stderr, "Error reading trajectory\n");
+        exit(1);
+    }
+}
+
+void trajectory_open(struct TrajectoryReader *reader, const char *path) {
+    memset(reader, 0, sizeof(*reader));
+    reader->file = fopen(path, "r");
+    if (!reader->file) {
+        fprintf(stderr, "Error opening %s\n", path);
+        exit(1);
+    }
+    struct TrajectoryHeader *header = &reader->header;
+    read_or_exit(reader->file, header, sizeof(*header), 0);
+    if (memcmp(header->magic, TRAJECTORY_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != TRAJECTORY_VERSION ||
+        header->header_size != sizeof(*header) || header->chunk == 0) {
+        fprintf(stderr, "%s is not a compressed trajectory\n", path);
+        exit(1);
+    }
+    if (header->index_offset == 0) {
+        fprintf(stderr, "%s has no index; was the run interrupted?\n", path);
+        exit(1);
+    }
+    reader->entries =
+        alloc_or_exit(sizeof(struct TrajectoryEntry) * header->frames);
+    read_or_exit(reader->file, reader->entries,
+                 sizeof(struct TrajectoryEntry) * header->frames,
+                 header->index_offset);
+
+    reader->chunks = (header->n + header->chunk - 1) / header->chunk;
+    for (int c = 0; c < COLUMNS; c++) {
+        reader->previous[c] = alloc_or_exit(sizeof(uint64_t) * header->n);
+    }
+    reader->sizes = alloc_or_exit(sizeof(uint32_t) * COLUMNS * reader->chunks);
+    reader->buffer = alloc_or_exit(
+        (header->chunk + TRAJECTORY_BLOCK - 1) / TRAJECTORY_BLOCK *
+        BLOCK_BOUND);
+    reader->current = -1;
+}
+
+void trajectory_close_reader(struct TrajectoryReader *reader) {
+    fclose(reader->file);
+    free(reader->entries);
+    for (int c = 0; c < COLUMNS; c++) {
+        free(reader->previous[c]);
+    }
+    free(reader->sizes);
+    free(reader->buffer);
+}
+
+// Decodes frame k into the previous values, which must hold frame k - 1
+// unless k is a key frame
+static void decode_frame(struct TrajectoryReader *reader, long k) {
+    const struct TrajectoryHeader *header = &reader->header;
+    const struct TrajectoryEntry *entry = &reader->entries[k];
+    struct TrajectoryFrame frame;
+    read_or_exit(reader->file, &frame, sizeof(frame), entry->offset);
+    if (frame.chunks != (uint32_t)reader->chunks) {
+        fprintf(stderr, "Trajectory frame %ld is corrupt\n", k);
+        exit(1);
+    }
+    read_or_exit(reader->file, reader->sizes,
+                 sizeof(uint32_t) * COLUMNS * reader->chunks, -1);
+
+    uint64_t residuals[TRAJECTORY_BLOCK];
+    for (int column = 0; column < COLUMNS; column++) {
+        const bool quantize = quantized(header, column);
+        uint64_t *previous = reader->previous[column];
+        for (int chunk = 0; chunk < reader->chunks; chunk++) {
+            size_t size = reader->sizes[column * reader->chunks + chunk];
+            read_or_exit(reader->file, reader->buffer, size, -1);
+            long begin = chunk * header->chunk;
+            long end = begin + header->chunk < header->n ? begin + header->chunk
+                                                         : header->n;
+            size_t used = 0;
+            for (long b = begin; b < end; b += TRAJECTORY_BLOCK) {
+                int count = end - b < TRAJECTORY_BLOCK ? end - b
+                                                       : TRAJECTORY_BLOCK;
+                size_t length = unpack_block(reader->buffer + used,
+                                             size - used, count, residuals);
+                if (length == 0) {
+                    fprintf(stderr, "Trajectory frame %ld is corrupt\n", k);
+                    exit(1);
+                }
+                used += length;
+                for (int i = 0; i < count; i++) {
+                    uint64_t before = frame.keyframe ? 0 : previous[b + i];
+                    previous[b + i] =
+                        quantize ? before + (uint64_t)unzigzag(residuals[i])
+                                 : before ^ residuals[i];
+                }
+            }
+        }
+    }
+    reader->current = k;
+}
+
+int trajectory_read(struct TrajectoryReader *reader, long k,
+                    struct ParticleStore *particles) {
+    const struct TrajectoryHeader *header = &reader->header;
+    if (k < 0 || (uint64_t)k >= header->frames) {
+        fprintf(stderr, "Frame %ld is not in the trajectory of %llu frames\n",
+                k, (unsigned long long)header->frames);
+        exit(1);
+    }
+    long from = k;
+    while (!reader->entries[from].keyframe) {
+        from--;
+    }
+    if (reader->current >= from && reader->current < k) {
+        from = reader->current + 1;
+    }
+    for (long f = from; f <= k; f++) {
+        decode_frame(reader, f);
+    }
+
+    double *columns[COLUMNS] = {
+        particles->x_pos,      particles->y_pos,      particles->mass,
+        particles->x_velocity, particles->y_velocity, particles->brightness};
+    for (int column = 0; column < COLUMNS; column++) {
+        const uint64_t *values = reader->previous[column];
+        if (quantized(header, column)) {
+            for (uint64_t i = 0; i < header->n; i++) {
+                columns[column][i] = (int64_t)values[i] * header->quantum;
+            }
+        } else {
+            memcpy(columns[column], values, sizeof(double) * header->n);
+        }
+    }
+    return reader->entries[k].step;
+}
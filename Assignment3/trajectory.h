@@ -0,0 +1,110 @@
+#ifndef TRAJECTORY_H
+#define TRAJECTORY_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "galsim.h"
+
+#define TRAJECTORY_MAGIC "GALTRAJ1"
+#define TRAJECTORY_VERSION 1
+// Every this many frames is a key frame, which bounds the frames a seek has
+// to decode
+#define TRAJECTORY_KEYFRAME_EVERY 32
+
+// Compressed trajectory (.galz): this 64-byte header, the frames, and an
+// index of all frames at index_offset, written when the file is closed.
+//
+// Each column of a frame is cut into chunks of chunk particles, which are
+// compressed independently so that threads can work on them in parallel.
+// The values are first turned into 64-bit integers: positions and
+// velocities are rounded to multiples of quantum, sqrt(2) times the
+// tolerance so that the x and y errors of a position or a velocity together
+// stay within it, or kept as their IEEE bits if quantum is 0, and masses
+// and brightness are always kept exactly. Outside key frames, each integer
+// is replaced by its difference (zigzag coded) or, for IEEE bits, its XOR
+// with the same particle's value in the previous frame, which leaves mostly
+// small numbers. The chunk is then written in blocks of TRAJECTORY_BLOCK
+// numbers: one byte with the bit width of the largest, then all of them
+// packed at that width.
+struct TrajectoryHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint64_t n;
+    double delta_time;
+    double quantum;
+    uint64_t chunk;
+    uint64_t frames;
+    uint64_t index_offset;
+};
+
+// A frame starts with this header, then the compressed size of each of its
+// 6 * chunks chunks as uint32, column by column, then the chunks
+struct TrajectoryFrame {
+    uint64_t step;
+    uint32_t keyframe;
+    uint32_t chunks;
+};
+
+struct TrajectoryEntry {
+    uint64_t step;
+    uint64_t offset;
+    uint64_t size;
+    uint64_t keyframe;
+};
+
+#define TRAJECTORY_BLOCK 256
+
+struct TrajectoryWriter {
+    FILE *file;
+    const char *path;
+    struct TrajectoryHeader header;
+    int threads;
+    int chunks;
+    // Integers of the previous frame, per column
+    uint64_t *previous[6];
+    // Compressed chunks of the frame being written and their sizes
+    uint8_t **buffers;
+    uint32_t *sizes;
+    struct TrajectoryEntry *entries;
+    uint64_t capacity;
+    uint64_t offset;
+};
+
+// Creates path for n particles. tolerance is the largest distance allowed
+// between a stored and a true position or velocity, 0 for lossless. Frames
+// are compressed by threads threads.
+void trajectory_create(struct TrajectoryWriter *writer, const char *path,
+                       int n, double delta_time, double tolerance,
+                       int threads);
+
+// Appends the particles as the state after the given step
+void trajectory_append(struct TrajectoryWriter *writer,
+                       const struct ParticleStore *particles, int step);
+
+// Writes the index and closes the file
+void trajectory_close(struct TrajectoryWriter *writer);
+
+struct TrajectoryReader {
+    FILE *file;
+    struct TrajectoryHeader header;
+    struct TrajectoryEntry *entries;
+    int chunks;
+    uint64_t *previous[6];
+    // Frame the previous values belong to, or -1
+    long current;
+    uint8_t *buffer;
+    uint32_t *sizes;
+};
+
+void trajectory_open(struct TrajectoryReader *reader, const char *path);
+void trajectory_close_reader(struct TrajectoryReader *reader);
+
+// Decodes frame k into particles, allocated for header.n particles, and
+// returns its step. Reading forwards decodes each frame once; any other
+// frame is reached from the key frame before it.
+int trajectory_read(struct TrajectoryReader *reader, long k,
+                    struct ParticleStore *particles);
+
+#endif
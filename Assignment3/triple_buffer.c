@@ -0,0 +1,52 @@
+#include "triple_buffer.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "galsim.h"
+
+void triple_buffer_alloc(struct TripleBuffer *buffer, int n) {
+    buffer->n = n;
+    for (int s = 0; s < TRIPLE_BUFFER_SLOTS; s++) {
+        buffer->x_pos[s] = alloc_doubles(n);
+        buffer->y_pos[s] = alloc_doubles(n);
+    }
+    buffer->back = 0;
+    atomic_init(&buffer->middle, 1);
+    buffer->front = 2;
+    buffer->dropped = 0;
+}
+
+void triple_buffer_free(struct TripleBuffer *buffer) {
+    for (int s = 0; s < TRIPLE_BUFFER_SLOTS; s++) {
+        free(buffer->x_pos[s]);
+        free(buffer->y_pos[s]);
+    }
+}
+
+void triple_buffer_push(struct TripleBuffer *buffer, const double *x_pos,
+                        const double *y_pos) {
+    int slot = buffer->back;
+    memcpy(buffer->x_pos[slot], x_pos, sizeof(double) * buffer->n);
+    memcpy(buffer->y_pos[slot], y_pos, sizeof(double) * buffer->n);
+    // Publish the copy, and take over whatever the consumer has not taken
+    unsigned previous = atomic_exchange_explicit(
+        &buffer->middle, slot | TRIPLE_BUFFER_FRESH, memory_order_acq_rel);
+    if (previous & TRIPLE_BUFFER_FRESH) {
+        buffer->dropped++;
+    }
+    buffer->back = previous & ~TRIPLE_BUFFER_FRESH;
+}
+
+int triple_buffer_acquire_newest(struct TripleBuffer *buffer) {
+    if (!(atomic_load_explicit(&buffer->middle, memory_order_relaxed) &
+          TRIPLE_BUFFER_FRESH)) {
+        return -1;
+    }
+    // Only the consumer clears TRIPLE_BUFFER_FRESH, so middle still holds a
+    // fresh snapshot, possibly a newer one
+    unsigned previous = atomic_exchange_explicit(
+        &buffer->middle, buffer->front, memory_order_acq_rel);
+    buffer->front = previous & ~TRIPLE_BUFFER_FRESH;
+    return buffer->front;
+}
@@ -0,0 +1,39 @@
+#ifndef TRIPLE_BUFFER_H
+#define TRIPLE_BUFFER_H
+
+#include <stdatomic.h>
+
+#define TRIPLE_BUFFER_SLOTS 3
+#define TRIPLE_BUFFER_FRESH 4u
+
+// Lock-free handoff of position snapshots from the simulation to the
+// display, in three slots: back, which the producer fills, front, which
+// the consumer shows, and the one in between, whose index is in middle.
+// A push swaps the filled back slot into middle and takes the old one
+// back, so the producer never waits and the newest snapshot always
+// replaces an unseen older one (counted in dropped) instead of being lost.
+// The consumer swaps middle with front when TRIPLE_BUFFER_FRESH is set.
+// back and front are only touched by their own side, each on its own cache
+// line.
+struct TripleBuffer {
+    int n;
+    double *x_pos[TRIPLE_BUFFER_SLOTS];
+    double *y_pos[TRIPLE_BUFFER_SLOTS];
+    _Alignas(64) atomic_uint middle;
+    _Alignas(64) int back;
+    int dropped;
+    _Alignas(64) int front;
+};
+
+void triple_buffer_alloc(struct TripleBuffer *buffer, int n);
+void triple_buffer_free(struct TripleBuffer *buffer);
+
+// Copies the positions into the buffer as the newest snapshot
+void triple_buffer_push(struct TripleBuffer *buffer, const double *x_pos,
+                        const double *y_pos);
+
+// Returns the slot of the newest snapshot, or -1 if there is none newer
+// than the last one returned. The slot stays valid until the next call.
+int triple_buffer_acquire_newest(struct TripleBuffer *buffer);
+
+#endif